@@ -0,0 +1,15 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Reads the triangles of a Wavefront OBJ (.obj) or binary PLY (.ply) file, chosen by the
+// extension, as x, y, z per vertex and three vertex indices per triangle (the layout of
+// triangle_mesh). Polygons are split into fans; normals, texture coordinates and any other
+// attributes are skipped. The file is streamed, so only the output buffers are held in
+// memory. Returns false after reporting the problem on std::cerr.
+bool load_mesh(const std::string& path, std::vector<float>& positions, std::vector<uint32_t>& indices);
+
+#endif
@@ -1,9 +1,13 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <memory>
+
 #include "hittable_list.hpp"
 #include "vec3.hpp"
 
+class bvh;
+
 struct camera_desc {
     point3 position {0, 0, 1.5};
     point3 look_at  {0, 0, -1};
@@ -15,6 +19,9 @@ class scene {
     public:
         hittable_list world;
         camera_desc camera;
+        // BVH over world built with non-default options, which serialize_scene ships instead
+        // of building its own; world may be cleared once it is set
+        std::shared_ptr<bvh> accel;
     private: 
 
 };
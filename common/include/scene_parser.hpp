@@ -2,8 +2,10 @@
 #define SCENE_PARSER_H
 
 #include <string> 
+#include "bvh.hpp"
 #include "scene.hpp"
 
-scene parse_scene(const std::string& filename);
+// Mesh and object BLASes are built with bvh_options
+scene parse_scene(const std::string& filename, const bvh_build_options& bvh_options);
 
 #endif
\ No newline at end of file
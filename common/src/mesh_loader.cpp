@@ -0,0 +1,322 @@
+#include "mesh_loader.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "triangle_mesh.hpp"
+
+namespace {
+
+bool ends_with(const std::string& s, const std::string& suffix) {
+    if (s.size() < suffix.size()) return false;
+    return std::equal(suffix.rbegin(), suffix.rend(), s.rbegin(),
+                      [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
+// Splits the polygon with corners `polygon` into a fan around its first corner
+void add_fan(const std::vector<uint32_t>& polygon, std::vector<uint32_t>& indices) {
+    for (size_t k = 2; k < polygon.size(); ++k) {
+        indices.push_back(polygon[0]);
+        indices.push_back(polygon[k - 1]);
+        indices.push_back(polygon[k]);
+    }
+}
+
+// OBJ
+
+bool load_obj(const std::string& path, std::vector<float>& positions, std::vector<uint32_t>& indices) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open mesh file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    std::vector<uint32_t> polygon;
+    size_t line_number = 0;
+    while (std::getline(file, line)) {
+        ++line_number;
+        const char* p = line.c_str();
+        while (*p == ' ' || *p == '\t') ++p;
+        const bool vertex = p[0] == 'v' && (p[1] == ' ' || p[1] == '\t');
+        const bool face = p[0] == 'f' && (p[1] == ' ' || p[1] == '\t');
+        if (!vertex && !face) continue; // comments, normals, texture coordinates, groups, ...
+        ++p;
+
+        if (vertex) {
+            for (int k = 0; k < 3; ++k) {
+                char* end;
+                const float x = std::strtof(p, &end);
+                if (end == p) {
+                    std::cerr << "Error: malformed vertex at " << path << ":" << line_number << std::endl;
+                    return false;
+                }
+                positions.push_back(x);
+                p = end;
+            }
+            continue;
+        }
+
+        // each corner is v, v/vt, v//vn or v/vt/vn; negative indices count back from the
+        // last vertex read
+        polygon.clear();
+        const long long vertex_count = static_cast<long long>(positions.size() / 3);
+        while (true) {
+            while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+            if (*p == '\0') break;
+            char* end;
+            const long long v = std::strtoll(p, &end, 10);
+            const long long index = v < 0 ? vertex_count + v : v - 1;
+            if (end == p || v == 0 || index < 0 || index >= vertex_count) {
+                std::cerr << "Error: invalid face at " << path << ":" << line_number << std::endl;
+                return false;
+            }
+            polygon.push_back(static_cast<uint32_t>(index));
+            p = end;
+            while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r') ++p;
+        }
+        add_fan(polygon, indices);
+    }
+    return true;
+}
+
+// PLY
+
+enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid };
+
+ply_type parse_ply_type(const std::string& name) {
+    if (name == "char" || name == "int8") return ply_type::int8;
+    if (name == "uchar" || name == "uint8") return ply_type::uint8;
+    if (name == "short" || name == "int16") return ply_type::int16;
+    if (name == "ushort" || name == "uint16") return ply_type::uint16;
+    if (name == "int" || name == "int32") return ply_type::int32;
+    if (name == "uint" || name == "uint32") return ply_type::uint32;
+    if (name == "float" || name == "float32") return ply_type::float32;
+    if (name == "double" || name == "float64") return ply_type::float64;
+    return ply_type::invalid;
+}
+
+size_t ply_size(ply_type type) {
+    switch (type) {
+        case ply_type::int8: case ply_type::uint8: return 1;
+        case ply_type::int16: case ply_type::uint16: return 2;
+        case ply_type::int32: case ply_type::uint32: case ply_type::float32: return 4;
+        case ply_type::float64: return 8;
+        case ply_type::invalid: break;
+    }
+    return 0;
+}
+
+struct ply_property {
+    std::string name;
+    ply_type type = ply_type::invalid;
+    ply_type count_type = ply_type::invalid; // set for list properties
+};
+
+struct ply_element {
+    std::string name;
+    uint64_t count = 0;
+    std::vector<ply_property> properties;
+};
+
+// Buffered reads from the binary body of a PLY file, converting from its byte order
+class ply_reader {
+  public:
+    ply_reader(std::istream& in, bool big_endian) : in(in), swap((std::endian::native == std::endian::big) != big_endian) {}
+
+    bool read(ply_type type, double& value) {
+        unsigned char bytes[8];
+        const size_t size = ply_size(type);
+        if (!fill(bytes, size)) return false;
+        if (swap) std::reverse(bytes, bytes + size);
+        switch (type) {
+            case ply_type::int8: value = static_cast<int8_t>(bytes[0]); break;
+            case ply_type::uint8: value = bytes[0]; break;
+            case ply_type::int16: value = load<int16_t>(bytes); break;
+            case ply_type::uint16: value = load<uint16_t>(bytes); break;
+            case ply_type::int32: value = load<int32_t>(bytes); break;
+            case ply_type::uint32: value = load<uint32_t>(bytes); break;
+            case ply_type::float32: value = load<float>(bytes); break;
+            case ply_type::float64: value = load<double>(bytes); break;
+            case ply_type::invalid: return false;
+        }
+        return true;
+    }
+
+  private:
+    template <class T>
+    static T load(const unsigned char* bytes) {
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    bool fill(unsigned char* out, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            if (pos == end) {
+                in.read(buffer, sizeof(buffer));
+                pos = 0;
+                end = static_cast<size_t>(in.gcount());
+                if (end == 0) return false;
+            }
+            out[i] = static_cast<unsigned char>(buffer[pos++]);
+        }
+        return true;
+    }
+
+    std::istream& in;
+    bool swap;
+    char buffer[1 << 16];
+    size_t pos = 0, end = 0;
+};
+
+bool load_ply(const std::string& path, std::vector<float>& positions, std::vector<uint32_t>& indices) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open mesh file " << path << std::endl;
+        return false;
+    }
+
+    auto fail = [&](const std::string& message) {
+        std::cerr << "Error: " << message << " in PLY file " << path << std::endl;
+        return false;
+    };
+
+    std::string line;
+    if (!std::getline(file, line) || line.rfind("ply", 0) != 0) return fail("missing 'ply' magic");
+
+    bool big_endian = false;
+    bool have_format = false;
+    std::vector<ply_element> elements;
+    while (true) {
+        if (!std::getline(file, line)) return fail("header without end_header");
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        std::stringstream ss(line);
+        std::string keyword;
+        ss >> keyword;
+        if (keyword == "end_header") break;
+        if (keyword == "format") {
+            std::string format;
+            ss >> format;
+            if (format == "binary_little_endian") {
+                big_endian = false;
+            } else if (format == "binary_big_endian") {
+                big_endian = true;
+            } else {
+                return fail("unsupported format '" + format + "' (only binary PLY is read)");
+            }
+            have_format = true;
+        } else if (keyword == "element") {
+            ply_element element;
+            if (!(ss >> element.name >> element.count)) return fail("malformed element");
+            elements.push_back(element);
+        } else if (keyword == "property") {
+            if (elements.empty()) return fail("property before any element");
+            ply_property property;
+            std::string type;
+            ss >> type;
+            if (type == "list") {
+                std::string count_type, item_type;
+                ss >> count_type >> item_type;
+                property.count_type = parse_ply_type(count_type);
+                property.type = parse_ply_type(item_type);
+                if (property.count_type == ply_type::invalid) return fail("unknown type '" + count_type + "'");
+                type = item_type;
+            } else {
+                property.type = parse_ply_type(type);
+            }
+            if (property.type == ply_type::invalid) return fail("unknown type '" + type + "'");
+            ss >> property.name;
+            elements.back().properties.push_back(property);
+        }
+        // comment, obj_info: nothing to do
+    }
+    if (!have_format) return fail("missing format");
+
+    ply_reader reader(file, big_endian);
+    std::vector<uint32_t> polygon;
+    uint64_t vertex_count = 0;
+    for (const ply_element& element : elements) {
+        const bool is_vertex = element.name == "vertex";
+        const bool is_face = element.name == "face";
+        int axis[3] = {-1, -1, -1}; // property index of x, y, z
+        int corners = -1;           // property index of the face's vertex list
+        for (size_t k = 0; k < element.properties.size(); ++k) {
+            const ply_property& property = element.properties[k];
+            if (is_vertex && property.count_type == ply_type::invalid) {
+                if (property.name == "x") axis[0] = static_cast<int>(k);
+                if (property.name == "y") axis[1] = static_cast<int>(k);
+                if (property.name == "z") axis[2] = static_cast<int>(k);
+            }
+            if (is_face && property.count_type != ply_type::invalid &&
+                (property.name == "vertex_indices" || property.name == "vertex_index")) {
+                corners = static_cast<int>(k);
+            }
+        }
+        if (is_vertex && (axis[0] < 0 || axis[1] < 0 || axis[2] < 0)) return fail("vertices without x, y and z");
+        if (is_face && corners < 0) return fail("faces without vertex_indices");
+        if (is_vertex) {
+            vertex_count = element.count;
+            positions.reserve(3 * element.count);
+        }
+
+        for (uint64_t n = 0; n < element.count; ++n) {
+            float xyz[3] = {0, 0, 0};
+            for (size_t k = 0; k < element.properties.size(); ++k) {
+                const ply_property& property = element.properties[k];
+                double value;
+                if (property.count_type == ply_type::invalid) {
+                    if (!reader.read(property.type, value)) return fail("truncated data");
+                    for (int a = 0; a < 3; ++a) {
+                        if (axis[a] == static_cast<int>(k)) xyz[a] = static_cast<float>(value);
+                    }
+                    continue;
+                }
+
+                double length;
+                if (!reader.read(property.count_type, length) || length < 0) return fail("truncated data");
+                const bool keep = corners == static_cast<int>(k);
+                if (keep) polygon.clear();
+                for (uint64_t i = 0; i < static_cast<uint64_t>(length); ++i) {
+                    if (!reader.read(property.type, value)) return fail("truncated data");
+                    if (!keep) continue;
+                    if (value < 0 || value >= static_cast<double>(vertex_count)) return fail("vertex index out of range");
+                    polygon.push_back(static_cast<uint32_t>(value));
+                }
+                if (keep) add_fan(polygon, indices);
+            }
+            if (is_vertex) positions.insert(positions.end(), xyz, xyz + 3);
+        }
+    }
+    return true;
+}
+
+}
+
+bool load_mesh(const std::string& path, std::vector<float>& positions, std::vector<uint32_t>& indices) {
+    positions.clear();
+    indices.clear();
+    bool loaded;
+    if (ends_with(path, ".obj")) {
+        loaded = load_obj(path, positions, indices);
+    } else if (ends_with(path, ".ply")) {
+        loaded = load_ply(path, positions, indices);
+    } else {
+        std::cerr << "Error: unknown mesh format for " << path << " (expected .obj or .ply)" << std::endl;
+        return false;
+    }
+    if (!loaded) {
+        return false;
+    }
+    if (indices.empty()) {
+        std::cerr << "Error: mesh file " << path << " has no triangles" << std::endl;
+        return false;
+    }
+    return triangle_mesh::indices_in_range(positions, indices);
+}
@@ -1,16 +1,23 @@
 #include "scene_parser.hpp"
 
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <sstream>
+#include <cstdint>
+#include <utility>
 
+#include "bvh.hpp"
 #include "color.hpp"
 #include "material.hpp"
+#include "mesh_loader.hpp"
 #include "scene.hpp"
 #include "sphere.hpp"
 #include "cylinder.hpp"
+#include "instance.hpp"
+#include "transform.hpp"
 
 namespace {
 std::shared_ptr<material> find_material(
@@ -24,11 +31,50 @@ std::shared_ptr<material> find_material(
     }
     return it->second;
 }
+
+// Reads "translate x y z", "rotate ax ay az degrees" and "scale sx sy sz" steps up to the end
+// of the line, each applied after the ones before it. False on an unknown or incomplete step
+// or a singular result.
+bool parse_transform(std::stringstream& ss, transform& out) {
+    transform result;
+    std::string step;
+    while (ss >> step) {
+        double x, y, z;
+        if (!(ss >> x >> y >> z)) return false;
+        if (step == "translate") {
+            result = result.then(transform::translate(vec3(x, y, z)));
+        } else if (step == "scale") {
+            result = result.then(transform::scale(vec3(x, y, z)));
+        } else if (step == "rotate") {
+            double degrees;
+            if (!(ss >> degrees) || (x == 0 && y == 0 && z == 0)) return false;
+            result = result.then(transform::rotate(vec3(x, y, z), degrees));
+        } else {
+            return false;
+        }
+    }
+    transform inverse;
+    if (!result.inverse(inverse)) return false;
+    out = result;
+    return true;
+}
+
+// A loaded mesh with its BLAS, shared by every instance that names the same file and material
+struct loaded_mesh {
+    std::shared_ptr<const triangle_mesh> mesh;
+    std::shared_ptr<const bvh> blas;
+};
 }
 
-scene parse_scene(const std::string& filename) {
+scene parse_scene(const std::string& filename, const bvh_build_options& bvh_options) {
     scene sc;
     std::map<std::string, std::shared_ptr<material>> materials;
+    std::map<std::pair<std::string, std::string>, loaded_mesh> meshes; // by path and material
+    std::map<std::string, std::shared_ptr<const bvh>> objects;          // BLAS by object name
+    // Primitives go to the world, or to the object being defined between "object" and "end"
+    hittable_list* target = &sc.world;
+    hittable_list object_primitives;
+    std::string object_name;
     std::ifstream file(filename);
     if (!file.is_open()) {
         std::cerr << "Error: Could not open scene file " << filename << std::endl;
@@ -55,28 +101,28 @@ scene parse_scene(const std::string& filename) {
                     std::cerr << "Warning: invalid lambertian material '" << name << "', skipping.\n";
                     continue;
                 }
-                materials[name] = std::make_shared<lambertian>(color(r, g, b));
+                materials[name] = std::make_shared<material>(lambertian(color(r, g, b)));
             } else if (mat_type == "metal") {
                 double r, g, b, fuzz;
                 if (!(ss >> r >> g >> b >> fuzz)) {
                     std::cerr << "Warning: invalid metal material '" << name << "', skipping.\n";
                     continue;
                 }
-                materials[name] = std::make_shared<metal>(color(r, g, b), fuzz);
+                materials[name] = std::make_shared<material>(metal(color(r, g, b), fuzz));
             } else if (mat_type == "dielectric") {
                 double ir;
                 if (!(ss >> ir)) {
                     std::cerr << "Warning: invalid dielectric material '" << name << "', skipping.\n";
                     continue;
                 }
-                materials[name] = std::make_shared<dielectric>(ir);
+                materials[name] = std::make_shared<material>(dielectric(ir));
             } else if (mat_type == "diffuse_light") {
                 double r, g, b;
                 if (!(ss >> r >> g >> b)) {
                     std::cerr << "Warning: invalid diffuse_light material '" << name << "', skipping.\n";
                     continue;
                 }
-                materials[name] = std::make_shared<diffuse_light>(color(r, g, b));
+                materials[name] = std::make_shared<material>(diffuse_light(color(r, g, b)));
             } else {
                 std::cerr << "Warning: unknown material type '" << mat_type << "' for material '" << name << "'.\n";
             }
@@ -91,7 +137,7 @@ scene parse_scene(const std::string& filename) {
             if (!mat_ptr) {
                 continue;
             }
-            sc.world.add(std::make_shared<sphere>(point3(cx, cy, cz), radius, mat_ptr));
+            target->add(sphere(point3(cx, cy, cz), radius, mat_ptr));
         } else if (type == "cylinder") {
             double p1x, p1y, p1z, p2x, p2y, p2z, radius;
             std::string mat_name;
@@ -103,7 +149,88 @@ scene parse_scene(const std::string& filename) {
             if (!mat_ptr) {
                 continue;
             }
-            sc.world.add(std::make_shared<cylinder>(point3(p1x, p1y, p1z), point3(p2x, p2y, p2z), radius, mat_ptr));
+            target->add(cylinder(point3(p1x, p1y, p1z), point3(p2x, p2y, p2z), radius, mat_ptr));
+        } else if (type == "mesh") {
+            std::string path;
+            std::string mat_name;
+            transform object_to_world;
+            if (!(ss >> path >> mat_name) || !parse_transform(ss, object_to_world)) {
+                std::cerr << "Warning: malformed mesh definition, skipping line: " << line << "\n";
+                continue;
+            }
+            auto mat_ptr = find_material(materials, mat_name);
+            if (!mat_ptr) {
+                continue;
+            }
+            // mesh paths are relative to the scene file
+            std::filesystem::path mesh_path(path);
+            if (mesh_path.is_relative()) {
+                mesh_path = std::filesystem::path(filename).parent_path() / mesh_path;
+            }
+            loaded_mesh& entry = meshes[{mesh_path.string(), mat_name}];
+            if (!entry.mesh) {
+                std::vector<float> positions;
+                std::vector<uint32_t> indices;
+                if (!load_mesh(mesh_path.string(), positions, indices)) {
+                    std::cerr << "Warning: could not load mesh, skipping line: " << line << "\n";
+                    meshes.erase({mesh_path.string(), mat_name});
+                    continue;
+                }
+                entry.mesh = std::make_shared<triangle_mesh>(std::move(positions), std::move(indices), mat_ptr);
+                entry.blas = instance::build_blas(entry.mesh, bvh_options);
+            }
+            target->add(instance(entry.mesh, entry.blas, object_to_world));
+        } else if (type == "object") {
+            std::string name;
+            if (!(ss >> name) || target != &sc.world) {
+                std::cerr << "Warning: malformed or nested object definition, skipping line: " << line << "\n";
+                continue;
+            }
+            object_name = name;
+            object_primitives.clear();
+            target = &object_primitives;
+        } else if (type == "end" && target != &sc.world) {
+            // the object's BLAS is built once here, in the object's own space
+            if (object_primitives.objects.empty()) {
+                std::cerr << "Warning: object '" << object_name << "' is empty, skipping.\n";
+            } else {
+                objects[object_name] = std::make_shared<bvh>(object_primitives, bvh_options);
+            }
+            object_primitives.clear();
+            target = &sc.world;
+        } else if (type == "instance") {
+            std::string name;
+            transform object_to_world;
+            if (!(ss >> name) || !parse_transform(ss, object_to_world)) {
+                std::cerr << "Warning: malformed instance definition, skipping line: " << line << "\n";
+                continue;
+            }
+            auto it = objects.find(name);
+            if (it == objects.end()) {
+                std::cerr << "Warning: object '" << name << "' is not defined.\n";
+                continue;
+            }
+            target->add(instance(it->second, object_to_world));
+        } else if (type == "random_spheres") {
+            long long count;
+            double half_extent, radius;
+            std::string mat_name;
+            if (!(ss >> count >> half_extent >> radius >> mat_name) || count < 0) {
+                std::cerr << "Warning: malformed random_spheres definition, skipping line: " << line << "\n";
+                continue;
+            }
+            uint64_t seed = 0;
+            ss >> seed;
+            auto mat_ptr = find_material(materials, mat_name);
+            if (!mat_ptr) {
+                continue;
+            }
+            pcg32 rng(seed);
+            target->objects.reserve(target->objects.size() + static_cast<size_t>(count));
+            for (long long i = 0; i < count; ++i) {
+                point3 center = vec3::random(-half_extent, half_extent, rng);
+                target->add(sphere(center, radius, mat_ptr));
+            }
         } else if (type == "camera") {
             while (std::getline(file, line)) {
                 std::stringstream cs(line);
@@ -134,5 +261,9 @@ scene parse_scene(const std::string& filename) {
         }
     }
 
+    if (target != &sc.world) {
+        std::cerr << "Warning: object '" << object_name << "' has no end, skipping.\n";
+    }
+
     return sc;
 }
\ No newline at end of file
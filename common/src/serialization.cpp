@@ -7,10 +7,18 @@
 #include "sphere.hpp"
 #include "cylinder.hpp"
 #include "material.hpp"
+#include "instance.hpp"
+#include "transform.hpp"
 
 #include <vector>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
 #include <unordered_map>
-#include <stdexcept>
 
 namespace {
 
@@ -23,61 +31,332 @@ void fill_proto_vec3(raytracer::Vec3* proto_vec, const vec3& cpp_vec) {
 
 // C++ -> Proto
 void fill_proto_material(raytracer::Material* proto_mat, const material& cpp_mat) {
-    if (const auto* p = dynamic_cast<const lambertian*>(&cpp_mat)) {
-        fill_proto_vec3(proto_mat->mutable_lambertian()->mutable_albedo(), p->albedo());
-    } else if (const auto* p = dynamic_cast<const metal*>(&cpp_mat)) {
-        auto* proto_m = proto_mat->mutable_metal();
-        fill_proto_vec3(proto_m->mutable_albedo(), p->albedo());
-        proto_m->set_fuzz(p->fuzz());
-    } else if (const auto* p = dynamic_cast<const dielectric*>(&cpp_mat)) {
-        proto_mat->mutable_dielectric()->set_ir(p->ir());
-    } else if (const auto* p = dynamic_cast<const diffuse_light*>(&cpp_mat)) {
-        fill_proto_vec3(proto_mat->mutable_diffuse_light()->mutable_emit_color(), p->emitted({}));
-    }
-}
-
-// recursive helper for serializing one hittable node
-int32_t serialize_node(
-    const std::shared_ptr<hittable>& node,
-    raytracer::SceneData& scene_data,
-    std::unordered_map<std::shared_ptr<hittable>, int32_t>& memo
-) {
-    if (!node) return -1;
-    if (memo.count(node)) {
-        return memo.at(node);
-    }
-
-    auto* new_node = scene_data.add_nodes();
-    const int32_t current_index = scene_data.nodes_size() - 1;
-    memo[node] = current_index;
-
-    if (const auto* p = dynamic_cast<const bvh_node*>(node.get())) {
-        auto* proto_bvh = new_node->mutable_bvh_node();
-        fill_proto_vec3(proto_bvh->mutable_bounding_box()->mutable_min_point(), p->bounding_box().min());
-        fill_proto_vec3(proto_bvh->mutable_bounding_box()->mutable_max_point(), p->bounding_box().max());
-        proto_bvh->set_left_child_index(serialize_node(p->left_child(), scene_data, memo));
-        proto_bvh->set_right_child_index(serialize_node(p->right_child(), scene_data, memo));
-    } else if (const auto* p = dynamic_cast<const sphere*>(node.get())) {
-        auto* proto_sphere = new_node->mutable_sphere();
-        fill_proto_vec3(proto_sphere->mutable_center(), p->center_point());
-        proto_sphere->set_radius(p->radius_value());
-        fill_proto_material(proto_sphere->mutable_material(), *p->get_material());
-    } else if (const auto* p = dynamic_cast<const cylinder*>(node.get())) {
-        auto* proto_cyl = new_node->mutable_cylinder();
-        fill_proto_vec3(proto_cyl->mutable_p1(), p->p1());
-        fill_proto_vec3(proto_cyl->mutable_p2(), p->p2());
-        proto_cyl->set_radius(p->radius());
-        fill_proto_material(proto_cyl->mutable_material(), *p->get_material());
-    }
-
-    return current_index;
+    switch (cpp_mat.type()) {
+        case material::kind::lambertian:
+            fill_proto_vec3(proto_mat->mutable_lambertian()->mutable_albedo(), cpp_mat.as<lambertian>().albedo());
+            break;
+        case material::kind::metal: {
+            const metal& m = cpp_mat.as<metal>();
+            auto* proto_m = proto_mat->mutable_metal();
+            fill_proto_vec3(proto_m->mutable_albedo(), m.albedo());
+            proto_m->set_fuzz(m.fuzz());
+            break;
+        }
+        case material::kind::dielectric:
+            proto_mat->mutable_dielectric()->set_ir(cpp_mat.as<dielectric>().ir());
+            break;
+        case material::kind::diffuse_light:
+            fill_proto_vec3(proto_mat->mutable_diffuse_light()->mutable_emit_color(), cpp_mat.as<diffuse_light>().emit());
+            break;
+    }
+}
+
+// C++ -> Proto
+void fill_proto_bvh_build(raytracer::BvhBuild* proto_build, const bvh_build_options& options) {
+    proto_build->set_method(options.method == bvh_build_method::median ? raytracer::BvhBuild::MEDIAN
+                                                                       : raytracer::BvhBuild::SAH);
+    proto_build->set_max_leaf_size(options.max_leaf_size);
+}
+
+// Proto -> C++, rejects unknown builders and negative leaf sizes
+bool proto_to_bvh_build(const raytracer::BvhBuild& proto_build, bvh_build_options& options) {
+    switch (proto_build.method()) {
+        case raytracer::BvhBuild::SAH: options.method = bvh_build_method::sah; break;
+        case raytracer::BvhBuild::MEDIAN: options.method = bvh_build_method::median; break;
+        default: return false;
+    }
+    if (proto_build.max_leaf_size() < 0) {
+        return false;
+    }
+    if (proto_build.max_leaf_size() > 0) {
+        options.max_leaf_size = proto_build.max_leaf_size();
+    }
+    return true;
+}
+
+// Packs 4-byte values as little-endian bytes, the Mesh buffer encoding
+template <class T>
+std::string pack_little_endian(const std::vector<T>& values) {
+    static_assert(sizeof(T) == 4);
+    std::string bytes(values.size() * 4, '\0');
+    std::memcpy(bytes.data(), values.data(), bytes.size());
+    if constexpr (std::endian::native == std::endian::big) {
+        for (size_t i = 0; i < bytes.size(); i += 4) std::reverse(bytes.begin() + i, bytes.begin() + i + 4);
+    }
+    return bytes;
+}
+
+// Proto -> C++, false unless bytes holds whole values
+template <class T>
+bool unpack_little_endian(const std::string& bytes, std::vector<T>& values) {
+    static_assert(sizeof(T) == 4);
+    if (bytes.size() % 4 != 0) return false;
+    std::string native = bytes;
+    if constexpr (std::endian::native == std::endian::big) {
+        for (size_t i = 0; i < native.size(); i += 4) std::reverse(native.begin() + i, native.begin() + i + 4);
+    }
+    values.resize(native.size() / 4);
+    std::memcpy(values.data(), native.data(), native.size());
+    return true;
+}
+
+// C++ -> Proto
+void fill_proto_transform(raytracer::Transform* proto_transform, const transform& t) {
+    for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 4; ++column) {
+            proto_transform->add_m(t(row, column));
+        }
+    }
+}
+
+// Proto -> C++, false unless it is a finite invertible 3x4 matrix
+bool proto_to_transform(const raytracer::Transform& proto_transform, transform& t) {
+    if (proto_transform.m_size() != 12) return false;
+    for (int i = 0; i < 12; ++i) {
+        if (!std::isfinite(proto_transform.m(i))) return false;
+        t(i / 4, i % 4) = proto_transform.m(i);
+    }
+    transform inverse;
+    return t.inverse(inverse);
+}
+
+// Meshes and objects already added to a SceneData, by their index there
+struct shipped_ids {
+    std::unordered_map<const triangle_mesh*, int32_t> meshes;
+    std::unordered_map<const bvh*, int32_t> objects;
+};
+
+void fill_proto_tree(const bvh& tree, google::protobuf::RepeatedPtrField<raytracer::SceneNode>* proto_nodes,
+                     google::protobuf::RepeatedPtrField<raytracer::BvhNode>* proto_bvh_nodes,
+                     raytracer::SceneData& scene_data, shipped_ids& ids);
+
+// C++ -> Proto, one leaf primitive. The mesh or object an instance places is added to
+// scene_data the first time an instance references it; an object after the objects its own
+// instances reference.
+void fill_proto_primitive(raytracer::SceneNode* new_node, const primitive& object, raytracer::SceneData& scene_data,
+                          shipped_ids& ids) {
+    switch (object.type()) {
+        case primitive::kind::sphere: {
+            const sphere& s = object.as<sphere>();
+            auto* proto_sphere = new_node->mutable_sphere();
+            fill_proto_vec3(proto_sphere->mutable_center(), s.center_point());
+            proto_sphere->set_radius(s.radius_value());
+            fill_proto_material(proto_sphere->mutable_material(), *s.get_material());
+            break;
+        }
+        case primitive::kind::cylinder: {
+            const cylinder& c = object.as<cylinder>();
+            auto* proto_cyl = new_node->mutable_cylinder();
+            fill_proto_vec3(proto_cyl->mutable_p1(), c.p1());
+            fill_proto_vec3(proto_cyl->mutable_p2(), c.p2());
+            proto_cyl->set_radius(c.radius());
+            fill_proto_material(proto_cyl->mutable_material(), *c.get_material());
+            break;
+        }
+        case primitive::kind::instance: {
+            const instance& inst = object.as<instance>();
+            auto* proto_instance = new_node->mutable_instance();
+            if (inst.mesh()) {
+                auto [it, added] = ids.meshes.emplace(inst.mesh().get(), scene_data.meshes_size());
+                if (added) {
+                    auto* proto_mesh = scene_data.add_meshes();
+                    proto_mesh->set_positions(pack_little_endian(inst.mesh()->positions()));
+                    proto_mesh->set_indices(pack_little_endian(inst.mesh()->indices()));
+                    fill_proto_material(proto_mesh->mutable_material(), *inst.mesh()->get_material());
+                    fill_proto_bvh_build(proto_mesh->mutable_bvh(), inst.blas()->build_options());
+                }
+                proto_instance->set_mesh(it->second);
+            } else {
+                auto it = ids.objects.find(inst.blas().get());
+                if (it == ids.objects.end()) {
+                    raytracer::Object proto_object;
+                    fill_proto_tree(*inst.blas(), proto_object.mutable_nodes(), proto_object.mutable_bvh_nodes(),
+                                    scene_data, ids);
+                    it = ids.objects.emplace(inst.blas().get(), scene_data.objects_size()).first;
+                    *scene_data.add_objects() = std::move(proto_object);
+                }
+                proto_instance->set_object(it->second);
+            }
+            fill_proto_transform(proto_instance->mutable_object_to_world(), inst.object_to_world());
+            break;
+        }
+    }
+}
+
+void fill_proto_bvh_node(raytracer::BvhNode* proto_bvh, const bvh_node& node, int32_t index) {
+    const aabb box = node.bounds();
+    fill_proto_vec3(proto_bvh->mutable_bounding_box()->mutable_min_point(), box.min());
+    fill_proto_vec3(proto_bvh->mutable_bounding_box()->mutable_max_point(), box.max());
+    if (node.is_leaf()) {
+        proto_bvh->set_left_child_index(-1);
+        proto_bvh->set_right_child_index(-1);
+        proto_bvh->set_primitive_offset(static_cast<int32_t>(node.offset));
+        proto_bvh->set_primitive_count(node.primitive_count);
+    } else {
+        proto_bvh->set_left_child_index(index + 1);
+        proto_bvh->set_right_child_index(static_cast<int32_t>(node.offset));
+    }
+    proto_bvh->set_split_axis(node.axis);
+}
+
+// C++ -> Proto, a tree with its primitives in leaf order
+void fill_proto_tree(const bvh& tree, google::protobuf::RepeatedPtrField<raytracer::SceneNode>* proto_nodes,
+                     google::protobuf::RepeatedPtrField<raytracer::BvhNode>* proto_bvh_nodes,
+                     raytracer::SceneData& scene_data, shipped_ids& ids) {
+    for (const auto& object : tree.primitives()) {
+        fill_proto_primitive(proto_nodes->Add(), object, scene_data, ids);
+    }
+
+    const auto& nodes = tree.nodes();
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        fill_proto_bvh_node(proto_bvh_nodes->Add(), nodes[i], static_cast<int32_t>(i));
+    }
+}
+
+// Proto -> C++, rejects nodes that would send traversal out of bounds
+bool proto_to_bvh_node(const raytracer::BvhNode& proto_bvh, int32_t index, int32_t node_count,
+                       int32_t primitive_count, bvh_node& node) {
+    const auto& box = proto_bvh.bounding_box();
+    node.bounds_min[0] = static_cast<float>(box.min_point().x());
+    node.bounds_min[1] = static_cast<float>(box.min_point().y());
+    node.bounds_min[2] = static_cast<float>(box.min_point().z());
+    node.bounds_max[0] = static_cast<float>(box.max_point().x());
+    node.bounds_max[1] = static_cast<float>(box.max_point().y());
+    node.bounds_max[2] = static_cast<float>(box.max_point().z());
+    node.pad = 0;
+
+    if (proto_bvh.split_axis() < 0 || proto_bvh.split_axis() > 2) return false;
+    node.axis = static_cast<uint8_t>(proto_bvh.split_axis());
+
+    if (proto_bvh.primitive_count() > 0) {
+        if (proto_bvh.primitive_count() > std::numeric_limits<uint16_t>::max() ||
+            proto_bvh.primitive_offset() < 0 ||
+            proto_bvh.primitive_offset() > primitive_count - proto_bvh.primitive_count()) {
+            return false;
+        }
+        node.offset = static_cast<uint32_t>(proto_bvh.primitive_offset());
+        node.primitive_count = static_cast<uint16_t>(proto_bvh.primitive_count());
+        return true;
+    }
+
+    // children must come after their parent, which also rules out cycles
+    if (proto_bvh.left_child_index() != index + 1 || index + 1 >= node_count ||
+        proto_bvh.right_child_index() <= index + 1 || proto_bvh.right_child_index() >= node_count) {
+        return false;
+    }
+    node.offset = static_cast<uint32_t>(proto_bvh.right_child_index());
+    node.primitive_count = 0;
+    return true;
+}
+
+// Meshes and objects rebuilt from a SceneData so far. Mesh BLASes are built when an
+// instance first references them.
+struct shipped_geometry {
+    struct mesh_entry {
+        std::shared_ptr<const triangle_mesh> mesh;
+        bvh_build_options options; // for the BLAS
+        std::shared_ptr<const bvh> blas;
+    };
+    std::vector<mesh_entry> meshes;
+    std::vector<std::shared_ptr<const bvh>> objects;
+};
+
+// Proto -> C++, one leaf primitive. Instances may only reference the objects rebuilt so far.
+bool proto_to_primitive(const raytracer::SceneNode& node, shipped_geometry& geometry, std::vector<primitive>& primitives) {
+    switch (node.node_type_case()) {
+        case raytracer::SceneNode::kSphere: {
+            const auto& proto_sphere = node.sphere();
+            auto mat = deserialize_material(proto_sphere.material());
+            primitives.push_back(sphere(
+                proto_to_vec3(proto_sphere.center()),
+                proto_sphere.radius(),
+                mat
+            ));
+            return true;
+        }
+        case raytracer::SceneNode::kCylinder: {
+            const auto& proto_cyl = node.cylinder();
+            auto mat = deserialize_material(proto_cyl.material());
+            primitives.push_back(cylinder(
+                proto_to_vec3(proto_cyl.p1()),
+                proto_to_vec3(proto_cyl.p2()),
+                proto_cyl.radius(),
+                mat
+            ));
+            return true;
+        }
+        case raytracer::SceneNode::kInstance: {
+            const auto& proto_instance = node.instance();
+            transform object_to_world;
+            if (!proto_to_transform(proto_instance.object_to_world(), object_to_world)) {
+                return false;
+            }
+            if (proto_instance.blas_case() == raytracer::Instance::kMesh) {
+                if (proto_instance.mesh() < 0 || proto_instance.mesh() >= static_cast<int32_t>(geometry.meshes.size())) {
+                    return false;
+                }
+                auto& entry = geometry.meshes[proto_instance.mesh()];
+                if (!entry.blas) {
+                    entry.blas = instance::build_blas(entry.mesh, entry.options);
+                }
+                primitives.push_back(instance(entry.mesh, entry.blas, object_to_world));
+                return true;
+            }
+            if (proto_instance.blas_case() != raytracer::Instance::kObject || proto_instance.object() < 0 ||
+                proto_instance.object() >= static_cast<int32_t>(geometry.objects.size())) {
+                return false;
+            }
+            primitives.push_back(instance(geometry.objects[proto_instance.object()], object_to_world));
+            return true;
+        }
+        default:
+            return false; // shouldnt reach
+    }
+}
+
+// Proto -> C++, a tree laid out as serialize_scene sends it, or null if it is malformed
+std::shared_ptr<bvh> proto_to_tree(const google::protobuf::RepeatedPtrField<raytracer::SceneNode>& proto_nodes,
+                                   const google::protobuf::RepeatedPtrField<raytracer::BvhNode>& proto_bvh_nodes,
+                                   shipped_geometry& geometry) {
+    if (proto_nodes.empty() || proto_bvh_nodes.empty()) {
+        return nullptr;
+    }
+
+    std::vector<primitive> primitives;
+    primitives.reserve(proto_nodes.size());
+    for (const auto& node : proto_nodes) {
+        if (!proto_to_primitive(node, geometry, primitives)) {
+            return nullptr;
+        }
+    }
+
+    const int32_t node_count = proto_bvh_nodes.size();
+    std::vector<bvh_node> nodes(node_count);
+    for (int32_t i = 0; i < node_count; ++i) {
+        if (!proto_to_bvh_node(proto_bvh_nodes.Get(i), i, node_count,
+                               static_cast<int32_t>(primitives.size()), nodes[i])) {
+            return nullptr;
+        }
+    }
+
+    // children always follow their parent, so depths can be filled in back to front
+    std::vector<int> depth(node_count, 1);
+    for (int32_t i = node_count - 1; i >= 0; --i) {
+        if (!nodes[i].is_leaf()) {
+            depth[i] = 1 + std::max(depth[i + 1], depth[nodes[i].offset]);
+            if (depth[i] > bvh::max_depth) {
+                return nullptr;
+            }
+        }
+    }
+
+    return std::make_shared<bvh>(std::move(primitives), std::move(nodes));
 }
 
 } 
 
 raytracer::SceneData serialize_scene(const scene& sc) {
     raytracer::SceneData scene_data;
-    std::unordered_map<std::shared_ptr<hittable>, int32_t> memo;
 
     // serialize camera data
     auto* proto_cam = scene_data.mutable_camera();
@@ -86,64 +365,57 @@ raytracer::SceneData serialize_scene(const scene& sc) {
     fill_proto_vec3(proto_cam->mutable_up(), sc.camera.up);
     proto_cam->set_vfov(sc.camera.vfov);
 
-    // expect hittable_list containing one bvh_node
-    if (sc.world.objects.empty()) {
-        return scene_data;
+    auto accel = sc.accel;
+    if (!accel) {
+        if (sc.world.objects.empty()) {
+            return scene_data;
+        }
+        accel = std::make_shared<bvh>(sc.world);
     }
 
-    int32_t root_index = serialize_node(sc.world.objects[0], scene_data, memo);
-    scene_data.set_root_node_index(root_index);
+    shipped_ids ids;
+    fill_proto_tree(*accel, scene_data.mutable_nodes(), scene_data.mutable_bvh_nodes(), scene_data, ids);
 
     return scene_data;
 }
 
-std::shared_ptr<hittable> deserialize_scene(const raytracer::SceneData& scene_data) {
-    if (scene_data.nodes_size() == 0) {
+std::shared_ptr<bvh> deserialize_scene(const raytracer::SceneData& scene_data,
+                                       const std::optional<bvh_build_options>& rebuild) {
+    if (scene_data.nodes_size() == 0 || scene_data.bvh_nodes_size() == 0) {
         return nullptr;
     }
 
-    std::vector<std::shared_ptr<hittable>> reconstructed_nodes(scene_data.nodes_size());
-
-    // iterate backwards to ensure children are reconstructed before their parents
-    for (int i = scene_data.nodes_size() - 1; i >= 0; --i) {
-        const auto& node = scene_data.nodes(i);
-        switch (node.node_type_case()) {
-            case raytracer::SceneNode::kSphere: {
-                const auto& proto_sphere = node.sphere();
-                auto mat = deserialize_material(proto_sphere.material());
-                reconstructed_nodes[i] = std::make_shared<sphere>(
-                    proto_to_vec3(proto_sphere.center()),
-                    proto_sphere.radius(),
-                    mat
-                );
-                break;
-            }
-            case raytracer::SceneNode::kCylinder: {
-                const auto& proto_cyl = node.cylinder();
-                auto mat = deserialize_material(proto_cyl.material());
-                reconstructed_nodes[i] = std::make_shared<cylinder>(
-                    proto_to_vec3(proto_cyl.p1()),
-                    proto_to_vec3(proto_cyl.p2()),
-                    proto_cyl.radius(),
-                    mat
-                );
-                break;
-            }
-            case raytracer::SceneNode::kBvhNode: {
-                const auto& proto_bvh = node.bvh_node();
-                auto left = reconstructed_nodes.at(proto_bvh.left_child_index());
-                auto right = reconstructed_nodes.at(proto_bvh.right_child_index());
-                aabb bbox(
-                    proto_to_vec3(proto_bvh.bounding_box().min_point()),
-                    proto_to_vec3(proto_bvh.bounding_box().max_point())
-                );
-                reconstructed_nodes[i] = std::make_shared<bvh_node>(left, right, bbox);
-                break;
-            }
-            default:
-                break; // shouldnt reach
+    shipped_geometry geometry;
+    geometry.meshes.reserve(scene_data.meshes_size());
+    for (const auto& proto_mesh : scene_data.meshes()) {
+        std::vector<float> positions;
+        std::vector<uint32_t> indices;
+        bvh_build_options options;
+        auto mat = deserialize_material(proto_mesh.material());
+        if (!unpack_little_endian(proto_mesh.positions(), positions) || positions.size() % 3 != 0 ||
+            !unpack_little_endian(proto_mesh.indices(), indices) || indices.empty() || indices.size() % 3 != 0 ||
+            !triangle_mesh::indices_in_range(positions, indices) || !mat ||
+            !proto_to_bvh_build(proto_mesh.bvh(), options)) {
+            return nullptr;
+        }
+        geometry.meshes.push_back({std::make_shared<triangle_mesh>(std::move(positions), std::move(indices), mat),
+                                   rebuild.value_or(options), nullptr});
+    }
+
+    // in order, so every object's instances reference objects rebuilt before it
+    geometry.objects.reserve(scene_data.objects_size());
+    for (const auto& proto_object : scene_data.objects()) {
+        auto blas = proto_to_tree(proto_object.nodes(), proto_object.bvh_nodes(), geometry);
+        if (!blas) {
+            return nullptr;
+        }
+        if (rebuild) {
+            hittable_list object_primitives;
+            object_primitives.objects = blas->primitives();
+            blas = std::make_shared<bvh>(object_primitives, *rebuild);
         }
+        geometry.objects.push_back(std::move(blas));
     }
 
-    return reconstructed_nodes[scene_data.root_node_index()];
+    return proto_to_tree(scene_data.nodes(), scene_data.bvh_nodes(), geometry);
 }
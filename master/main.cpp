@@ -2,6 +2,7 @@
 #include <memory>
 #include "cxxopts.hpp"
 #include "master.hpp"
+#include "simulation.hpp"
 #include "scene.hpp"
 #include "scene_parser.hpp"
 #include "bvh.hpp"
@@ -16,7 +17,24 @@ int main(int argc, char** argv) {
         ("p,port", "Port to listen on", cxxopts::value<int>()->default_value("50051"))
         ("samples", "Samples per pixel", cxxopts::value<int>()->default_value("100"))
         ("depth", "Max ray depth", cxxopts::value<int>()->default_value("50"))
+        ("roulette-depth", "Bounces before Russian roulette may end a path (0 disables it)", cxxopts::value<int>()->default_value("0"))
+        ("noise-threshold", "Relative noise at which adaptive sampling stops (0 disables it)", cxxopts::value<double>()->default_value("0"))
+        ("sampler", "Sample generator: independent, stratified, sobol or bluenoise", cxxopts::value<std::string>()->default_value("independent"))
         ("tile-size", "Size of render tiles", cxxopts::value<int>()->default_value("64"))
+        ("pass-samples", "Render progressively in passes of this many samples per pixel (0 renders one pass)", cxxopts::value<int>()->default_value("0"))
+        ("preview-interval", "Seconds between preview images written to the output path (0 disables them)", cxxopts::value<int>()->default_value("0"))
+        ("time-budget", "Stop progressive rendering after this many seconds (0 disables it)", cxxopts::value<int>()->default_value("0"))
+        ("target-noise", "Stop progressive rendering once the mean pixel noise is below this (0 disables it)", cxxopts::value<double>()->default_value("0"))
+        ("bvh", "BVH builder (sah or median)", cxxopts::value<std::string>()->default_value("sah"))
+        ("bvh-leaf-size", "Max primitives per BVH leaf", cxxopts::value<int>()->default_value("4"))
+        ("max-batch", "Most tasks leased by one RequestTask (1 disables batching)", cxxopts::value<int>()->default_value("16"))
+        ("batch-target-ms", "Work per task batch, in milliseconds of the worker's tile time", cxxopts::value<int>()->default_value("500"))
+        ("tile-order", "Order tiles are handed out in: cost (costliest first, from a probe render) or raster", cxxopts::value<std::string>()->default_value("cost"))
+        ("min-split-size", "Smallest tile side tasks are split down to at the end of a frame (0 disables splitting)", cxxopts::value<int>()->default_value("8"))
+        ("speculative-copies", "Copies of a late task idle workers may render at the end of a frame (0 disables them)", cxxopts::value<int>()->default_value("1"))
+        ("simulate-workers", "Load test: serve this many simulated in-process workers instead of listening (0 disables it)", cxxopts::value<int>()->default_value("0"))
+        ("simulate-tile-us", "Time a simulated worker spends on each tile, in microseconds", cxxopts::value<int>()->default_value("2000"))
+        ("simulate-slow-workers", "How many simulated workers take 20 times as long per tile", cxxopts::value<int>()->default_value("0"))
         ("help", "Print usage");
 
     auto result = options.parse(argc, argv);
@@ -40,16 +58,104 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    const int roulette_depth = result["roulette-depth"].as<int>();
+    if (roulette_depth < 0) {
+        std::cerr << "Roulette depth must not be negative." << std::endl;
+        return 1;
+    }
+
+    const double noise_threshold = result["noise-threshold"].as<double>();
+    if (noise_threshold < 0.0) {
+        std::cerr << "Noise threshold must not be negative." << std::endl;
+        return 1;
+    }
+
+    sampler_kind sampler;
+    if (!parse_sampler_kind(result["sampler"].as<std::string>(), sampler)) {
+        std::cerr << "Unknown sampler '" << result["sampler"].as<std::string>() << "' (expected independent, stratified, sobol or bluenoise)." << std::endl;
+        return 1;
+    }
+
+    ProgressiveSettings progressive;
+    progressive.pass_samples = result["pass-samples"].as<int>();
+    progressive.preview_interval = std::chrono::seconds(result["preview-interval"].as<int>());
+    progressive.time_budget = std::chrono::seconds(result["time-budget"].as<int>());
+    progressive.target_noise = result["target-noise"].as<double>();
+    if (progressive.pass_samples < 0 || progressive.preview_interval.count() < 0 ||
+        progressive.time_budget.count() < 0 || progressive.target_noise < 0.0) {
+        std::cerr << "Pass samples, preview interval, time budget and target noise must not be negative." << std::endl;
+        return 1;
+    }
+
+    SchedulerSettings scheduler;
+    scheduler.max_batch = result["max-batch"].as<int>();
+    scheduler.batch_target = std::chrono::milliseconds(result["batch-target-ms"].as<int>());
+    if (scheduler.max_batch <= 0 || scheduler.batch_target.count() <= 0) {
+        std::cerr << "Max batch and batch target must be positive." << std::endl;
+        return 1;
+    }
+    scheduler.speculative_copies = result["speculative-copies"].as<int>();
+    scheduler.min_split_size = result["min-split-size"].as<int>();
+    if (scheduler.speculative_copies < 0 || scheduler.min_split_size < 0) {
+        std::cerr << "Speculative copies and min split size must not be negative." << std::endl;
+        return 1;
+    }
+    const std::string tile_order = result["tile-order"].as<std::string>();
+    if (tile_order != "cost" && tile_order != "raster") {
+        std::cerr << "Unknown tile order '" << tile_order << "' (expected cost or raster)." << std::endl;
+        return 1;
+    }
+    scheduler.cost_order = tile_order == "cost";
+
+    SimulationSettings simulation;
+    simulation.workers = result["simulate-workers"].as<int>();
+    simulation.tile_time = std::chrono::microseconds(result["simulate-tile-us"].as<int>());
+    simulation.slow_workers = result["simulate-slow-workers"].as<int>();
+    if (simulation.workers < 0 || simulation.tile_time.count() < 0 || simulation.slow_workers < 0) {
+        std::cerr << "Simulated workers, tile time and slow workers must not be negative." << std::endl;
+        return 1;
+    }
+
+    bvh_build_options bvh_options;
+    if (!parse_bvh_build_method(result["bvh"].as<std::string>(), bvh_options.method)) {
+        std::cerr << "Unknown BVH builder '" << result["bvh"].as<std::string>() << "' (expected sah or median)." << std::endl;
+        return 1;
+    }
+    bvh_options.max_leaf_size = result["bvh-leaf-size"].as<int>();
+    if (bvh_options.max_leaf_size <= 0) {
+        std::cerr << "BVH leaf size must be positive." << std::endl;
+        return 1;
+    }
+
     std::string scene_path = result["scene"].as<std::string>();
-    scene current_scene = parse_scene(scene_path);
-    hittable_list world_bvh;
-    world_bvh.add(std::make_shared<bvh_node>(current_scene.world));
-    current_scene.world = world_bvh;
+    scene current_scene = parse_scene(scene_path, bvh_options);
+    current_scene.accel = std::make_shared<bvh>(current_scene.world, bvh_options);
+    std::cout << "BVH constructed: " << current_scene.accel->stats() << std::endl;
+    // the BVH keeps its own copy of the primitives
+    current_scene.world.clear();
 
     std::string address = "0.0.0.0:" + std::to_string(result["port"].as<int>());
     std::string output_path = result["output"].as<std::string>();
 
     try {
+        if (simulation.workers > 0) {
+            RunSimulation(
+                current_scene,
+                image_width,
+                image_height,
+                tile_size,
+                result["samples"].as<int>(),
+                result["depth"].as<int>(),
+                roulette_depth,
+                noise_threshold,
+                sampler,
+                progressive,
+                scheduler,
+                simulation,
+                output_path
+            );
+            return 0;
+        }
         RunServer(
             current_scene,
             image_width,
@@ -57,6 +163,11 @@ int main(int argc, char** argv) {
             tile_size,
             result["samples"].as<int>(),
             result["depth"].as<int>(),
+            roulette_depth,
+            noise_threshold,
+            sampler,
+            progressive,
+            scheduler,
             address,
             output_path
         );
@@ -1,28 +1,151 @@
 #include "master.hpp"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <utility>
 #include <grpcpp/grpcpp.h>
 
 #include "serialization.hpp"
 #include "color.hpp"
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "renderer.hpp"
 
 using grpc::Server;
 using grpc::ServerBuilder;
 
-RaytracerServiceImpl::RaytracerServiceImpl(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, std::string output_path)
-    : scene_data_(serialize_scene(sc)), 
-      work_queue_(create_work_queue(image_width, image_height, tile_size, samples, depth)),
-      total_tiles_(static_cast<int>(work_queue_.size())), 
-      tiles_completed_(0), 
+namespace {
+
+int tiles_along(int extent, int tile_size) {
+    return (extent + tile_size - 1) / tile_size;
+}
+
+// Writes one line to std::cout in a single call, so that lines printed by concurrent
+// handlers do not run into each other
+template <class... Args>
+void print_line(const Args&... args) {
+    std::ostringstream line;
+    (line << ... << args) << '\n';
+    std::cout << line.str() << std::flush;
+}
+
+// Same measure as adaptive sampling in the renderer: standard error of the mean luminance
+// after the gamma 2 transform of write_color, floored near black.
+constexpr double noise_luminance_floor = 1e-3;
+
+double luminance(double r, double g, double b) {
+    return 0.2126 * r + 0.7152 * g + 0.0722 * b;
+}
+
+// Weight of the newest batch in a worker's moving average time per tile
+constexpr double tile_time_smoothing = 0.3;
+
+// A lease runs out after lease_slack times the work the worker holds, plus minimum_lease for
+// round trips and hiccups, so only a worker well behind its own pace loses its tasks
+constexpr double lease_slack = 3.0;
+constexpr std::chrono::milliseconds minimum_lease{2000};
+
+// The cost probe of a tile renders one sample for each of up to probe_size x probe_size
+// pixels spread over it
+constexpr int probe_size = 4;
+
+// How long a worker with nothing to do waits before asking again while the frame is unfinished
+constexpr std::chrono::milliseconds idle_poll{50};
+
+// How long the server waits for open RPCs to end when it shuts down
+constexpr std::chrono::seconds shutdown_grace{2};
+
+// Lease deadlines are seconds long, so tasks in flight are looked through for expired ones
+// at most this often rather than on every request
+constexpr std::chrono::milliseconds reclaim_interval{50};
+
+// Holds a mutex like std::lock_guard and adds how long it held it to the calling RPC's stats
+class TimedLock {
+public:
+    TimedLock(std::mutex& mtx, SchedulerStats& stats)
+        : lock_(mtx), stats_(stats), locked_at_(std::chrono::steady_clock::now()) {}
+    ~TimedLock() {
+        ++stats_.lock_acquisitions;
+        stats_.lock_held += std::chrono::steady_clock::now() - locked_at_;
+    }
+
+private:
+    std::lock_guard<std::mutex> lock_;
+    SchedulerStats& stats_;
+    const std::chrono::steady_clock::time_point locked_at_;
+};
+
+SchedulerStats& operator+=(SchedulerStats& total, const SchedulerStats& stats) {
+    total.request_task_calls += stats.request_task_calls;
+    total.submit_result_calls += stats.submit_result_calls;
+    total.tasks_leased += stats.tasks_leased;
+    total.results_recorded += stats.results_recorded;
+    total.results_superseded += stats.results_superseded;
+    total.deadline_requeues += stats.deadline_requeues;
+    total.speculative_leases += stats.speculative_leases;
+    total.speculative_wins += stats.speculative_wins;
+    total.tasks_split += stats.tasks_split;
+    total.lock_acquisitions += stats.lock_acquisitions;
+    total.lock_held += stats.lock_held;
+    return total;
+}
+
+}
+
+std::ostream& operator<<(std::ostream& out, const SchedulerStats& stats) {
+    out << stats.request_task_calls << " RequestTask calls leasing " << stats.tasks_leased << " tasks, "
+        << stats.submit_result_calls << " SubmitResult calls, " << stats.results_recorded << " results recorded, "
+        << stats.results_superseded << " superseded, " << stats.deadline_requeues << " tasks queued again after their deadline, "
+        << stats.speculative_leases << " speculative copies of which " << stats.speculative_wins << " finished first, "
+        << stats.tasks_split << " tasks split, lock taken "
+        << stats.lock_acquisitions << " times and held "
+        << std::chrono::duration<double, std::milli>(stats.lock_held).count() << " ms";
+    return out;
+}
+
+RaytracerServiceImpl::RaytracerServiceImpl(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, int roulette_depth, double noise_threshold, sampler_kind sampler, const ProgressiveSettings& progressive, const SchedulerSettings& scheduler, std::string output_path)
+    : scene_data_(serialize_scene(sc)),
+      settings_{image_width, image_height, tile_size, samples, depth, roulette_depth, noise_threshold, sampler,
+                progressive.pass_samples > 0 ? std::min(progressive.pass_samples, samples) : samples,
+                progressive.pass_samples > 0 ? (samples + progressive.pass_samples - 1) / progressive.pass_samples : 1},
+      progressive_(progressive),
+      scheduler_(scheduler),
+      task_costs_(estimate_task_costs(sc, settings_, scheduler.cost_order)),
+      work_queue_(create_work_queue(settings_, scheduler.cost_order ? &task_costs_ : nullptr), task_costs_),
+      worker_count_(0),
+      tile_count_(tiles_along(image_width, tile_size) * tiles_along(image_height, tile_size)),
+      total_tasks_(static_cast<int>(work_queue_.size())),
+      tasks_completed_(0),
+      samples_used_(0),
+      pass_tiles_done_(settings_.passes),
+      stopped_(false),
+      next_reclaim_(0),
       image_width_(image_width),
       image_height_(image_height),
-      settings_{image_width, image_height, tile_size, samples, depth},
       output_path_(std::move(output_path)),
       next_worker_id_(1),
-      lease_timeout_(std::chrono::seconds(120)) {
-    
-    final_image_pixels_.resize(static_cast<size_t>(image_width) * static_cast<size_t>(image_height));
-    std::cout << "Master: " << total_tiles_ << " tiles created." << std::endl;
+      lease_timeout_(std::chrono::seconds(120)),
+      requeued_count_(0),
+      requeued_cost_(0.0),
+      passes_complete_(0),
+      tile_mutexes_(tile_count_) {
+
+    const size_t pixels = static_cast<size_t>(image_width) * static_cast<size_t>(image_height);
+    radiance_sums_.resize(pixels * 3);
+    luminance_sq_sums_.resize(pixels);
+    pixel_samples_.resize(pixels);
+    pixel_passes_.resize(pixels);
+    std::cout << "Master: " << tile_count_ << " tiles created";
+    if (settings_.passes > 1) {
+        std::cout << ", rendered in " << settings_.passes << " passes of " << settings_.pass_samples << " samples";
+    }
+    std::cout << "." << std::endl;
 }
 
 grpc::Status RaytracerServiceImpl::HealthCheck(grpc::ServerContext* context, const google::protobuf::Empty* request, HealthCheckResponse* response) {
@@ -41,14 +164,15 @@ grpc::Status RaytracerServiceImpl::RegisterWorker(grpc::ServerContext*,
     std::string worker_id = "worker-" + std::to_string(id);
 
     {
-        std::lock_guard<std::mutex> lock(mtx_);
-        registered_workers_.insert(worker_id);
+        std::unique_lock<std::shared_mutex> lock(workers_mtx_);
+        registered_workers_[worker_id].cores = std::max(0, request->cores());
     }
+    ++worker_count_;
 
     response->set_worker_id(worker_id);
     response->mutable_scene()->CopyFrom(scene_data_);
     response->mutable_config()->CopyFrom(build_config_proto());
-    std::cout << "Registered " << worker_id << " (" << request->hostname() << ")" << std::endl;
+    print_line("Registered ", worker_id, " (", request->hostname(), ")");
 
     return grpc::Status::OK;
 }
@@ -64,28 +188,27 @@ grpc::Status RaytracerServiceImpl::RequestTask(grpc::ServerContext*,
         return grpc::Status(grpc::StatusCode::UNAUTHENTICATED, "missing worker id");
     }
 
-    std::lock_guard<std::mutex> lock(mtx_);
-    if (!validate_worker(request->worker_id())) {
+    SchedulerStats stats;
+    ++stats.request_task_calls;
+    WorkerState* worker = find_worker(request->worker_id());
+    if (!worker) {
+        add_stats(stats);
         return grpc::Status(grpc::StatusCode::UNAUTHENTICATED, "worker not registered");
     }
-    reclaim_expired_tasks_locked();
 
-    if (work_queue_.empty()) {
-        response->set_has_assignment(false);
-        return grpc::Status::OK;
+    reclaim_expired_tasks(stats);
+    const int batch = batch_size(*worker);
+    RenderTask task;
+    while (response->tasks_size() < batch && lease_task(request->worker_id(), *worker, task, stats)) {
+        *response->add_tasks() = std::move(task);
     }
-
-    RenderTask task = work_queue_.front();
-    work_queue_.pop();
-    const int32_t task_id = task.tile().task_id();
-    in_progress_[task_id] = AssignedTask{
-        task,
-        request->worker_id(),
-        std::chrono::steady_clock::now()
-    };
-
-    response->set_has_assignment(true);
-    response->mutable_task()->CopyFrom(task);
+    stats.tasks_leased += response->tasks_size();
+    response->set_has_assignment(response->tasks_size() > 0);
+    if (!response->has_assignment() && !finished()) {
+        // the last tasks are out with other workers, but may yet need a copy or be queued again
+        response->set_retry_after_ms(static_cast<int32_t>(idle_poll.count()));
+    }
+    add_stats(stats);
     return grpc::Status::OK;
 }
 
@@ -101,62 +224,356 @@ grpc::Status RaytracerServiceImpl::SubmitResult(grpc::ServerContext*,
         return grpc::Status(grpc::StatusCode::UNAUTHENTICATED, "worker not registered");
     }
 
-    const auto& tile = request->result().tile();
-    const int32_t task_id = tile.task_id();
+    SchedulerStats stats;
+    ++stats.submit_result_calls;
+    WorkerState* worker = find_worker(worker_id);
+    if (!worker) {
+        add_stats(stats);
+        return grpc::Status(grpc::StatusCode::UNAUTHENTICATED, "worker not registered");
+    }
 
-    std::unique_lock<std::mutex> lock(mtx_);
-    if (!validate_worker(worker_id)) {
+    // every result is recorded even if an earlier one is rejected; the first error is returned
+    grpc::Status status = grpc::Status::OK;
+    int recorded = 0;
+    int32_t last_tile_task = 0;
+    auto first_leased = std::chrono::steady_clock::time_point::max();
+    for (const auto& result : request->results()) {
+        auto leased_at = std::chrono::steady_clock::time_point::max();
+        int32_t tile_task = 0;
+        grpc::Status result_status = record_result(worker_id, result, stats, leased_at, tile_task);
+        if (result_status.ok()) {
+            ++recorded;
+            last_tile_task = tile_task;
+            first_leased = std::min(first_leased, leased_at);
+        } else if (result_status.error_code() == grpc::StatusCode::NOT_FOUND ||
+                   result_status.error_code() == grpc::StatusCode::PERMISSION_DENIED) {
+            ++stats.results_superseded; // another copy of the task finished first
+        } else if (status.ok()) {
+            status = result_status;
+        }
+    }
+    time_results(*worker, first_leased, request->results_size());
+    add_stats(stats);
+    if (recorded > 0) {
+        report_progress(last_tile_task);
+    }
+    return status;
+}
+
+grpc::Status RaytracerServiceImpl::StreamTasks(grpc::ServerContext* context,
+                                               grpc::ServerReaderWriter<RenderTask, TaskStreamRequest>* stream) {
+    TaskStreamRequest request;
+    if (!stream->Read(&request) || !request.has_open()) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "task stream must start with an open message");
+    }
+    const std::string worker_id = request.open().worker_id();
+    const int window = std::clamp(request.open().window(), 1, max_task_window);
+    WorkerState* worker = worker_id.empty() ? nullptr : find_worker(worker_id);
+    if (!worker) {
         return grpc::Status(grpc::StatusCode::UNAUTHENTICATED, "worker not registered");
     }
-    auto it = in_progress_.find(task_id);
-    if (it == in_progress_.end()) {
-        return grpc::Status(grpc::StatusCode::NOT_FOUND, "task not leased or already completed");
+
+    // task ids leased over this stream and not yet returned
+    std::vector<int32_t> outstanding;
+    std::vector<RenderTask> leased;
+    // added to the master's counters after every result
+    SchedulerStats stats;
+    grpc::Status status = grpc::Status::OK;
+    while (true) {
+        reclaim_expired_tasks(stats);
+        RenderTask task;
+        while (static_cast<int>(outstanding.size() + leased.size()) < window &&
+               lease_task(worker_id, *worker, task, stats)) {
+            leased.push_back(std::move(task));
+        }
+        bool written = true;
+        for (const auto& task : leased) {
+            outstanding.push_back(task.tile().task_id());
+            written = written && stream->Write(task);
+        }
+        leased.clear();
+        if (!written) {
+            status = grpc::Status(grpc::StatusCode::UNAVAILABLE, "task stream closed");
+            break;
+        }
+        if (outstanding.empty()) {
+            // the last tasks are out with other workers, but may yet need a copy or be queued again
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (idle_cv_.wait_for(lock, idle_poll, [this] { return finished(); })) {
+                break;
+            }
+            if (context && context->IsCancelled()) {
+                status = grpc::Status(grpc::StatusCode::CANCELLED, "task stream cancelled");
+                break;
+            }
+            continue;
+        }
+
+        if (!stream->Read(&request)) {
+            status = grpc::Status(grpc::StatusCode::UNAVAILABLE, "task stream closed");
+            break;
+        }
+        if (!request.has_result()) {
+            status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "expected a tile result");
+            break;
+        }
+        auto it = std::find(outstanding.begin(), outstanding.end(), request.result().tile().task_id());
+        if (it == outstanding.end()) {
+            status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "result for a task not leased over this stream");
+            break;
+        }
+        outstanding.erase(it);
+
+        auto leased_at = std::chrono::steady_clock::time_point::max();
+        int32_t tile_task = 0;
+        grpc::Status recorded = record_result(worker_id, request.result(), stats, leased_at, tile_task);
+        time_results(*worker, leased_at, 1);
+        // NOT_FOUND and PERMISSION_DENIED mean another copy of the task finished first
+        const bool superseded = recorded.error_code() == grpc::StatusCode::NOT_FOUND ||
+                                recorded.error_code() == grpc::StatusCode::PERMISSION_DENIED;
+        stats.results_superseded += superseded;
+        add_stats(std::exchange(stats, SchedulerStats{}));
+        if (recorded.ok()) {
+            report_progress(tile_task);
+        } else if (!superseded) {
+            status = recorded;
+            break;
+        }
+    }
+
+    if (!outstanding.empty()) {
+        // the worker is gone or misbehaved, so its tiles need not wait for the lease timeout
+        release_tasks(worker_id, outstanding, stats);
+    }
+    add_stats(stats);
+    return status;
+}
+
+// Adds a result to the image if its task is leased to worker_id and no other copy of it has
+// finished, and reports when it was leased and the tile task it is a part of. Only claiming
+// the task takes a lock, that of its lease shard; the frame lock is taken for the last part of
+// a split task and the last tile of a pass.
+grpc::Status RaytracerServiceImpl::record_result(const std::string& worker_id, const TileResult& result, SchedulerStats& stats,
+                                                 std::chrono::steady_clock::time_point& leased_at, int32_t& tile_task) {
+    const auto& tile = result.tile();
+    const int32_t task_id = tile.task_id();
+    int weight;
+    {
+        LeaseShard& shard = lease_shard(task_id);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.tasks.find(task_id);
+        if (it == shard.tasks.end()) {
+            return grpc::Status(grpc::StatusCode::NOT_FOUND, "task not leased or already completed");
+        }
+
+        auto& leases = it->second.leases;
+        auto lease = std::find_if(leases.begin(), leases.end(), [&](const Lease& l) { return l.worker_id == worker_id; });
+        if (lease == leases.end()) {
+            return grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "task not leased to this worker");
+        }
+
+        // results are written without the frame lock, so they must keep to their tile
+        const auto& leased_tile = it->second.task.tile();
+        if (tile.x0() != leased_tile.x0() || tile.y0() != leased_tile.y0() ||
+            tile.width() != leased_tile.width() || tile.height() != leased_tile.height()) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "tile does not match its task");
+        }
+        const size_t expected_values =
+            static_cast<size_t>(tile.width()) * static_cast<size_t>(tile.height()) * 3;
+        if (static_cast<size_t>(result.radiance().size()) != expected_values) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "radiance size mismatch");
+        }
+
+        leased_at = lease->leased_at;
+        stats.speculative_wins += lease->speculative;
+        // every copy is settled by the first result, deterministic sampling making them identical
+        for (const auto& settled : leases) {
+            --settled.worker->leases;
+        }
+        weight = it->second.task.samples_per_pixel();
+        shard.tasks.erase(it);
+    }
+
+    add_radiance(result, weight);
+    samples_used_ += result.samples_used();
+    ++stats.results_recorded;
+    if (!finish_task(task_id, tile_task, stats)) {
+        return grpc::Status::OK; // other parts of its tile are still out
     }
 
-    if (it->second.worker_id != worker_id) {
-        return grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "task owned by another worker");
+    const int pass = tile_task / tile_count_;
+    const int completed_count = ++tasks_completed_;
+    if (++pass_tiles_done_[pass] < tile_count_ && completed_count < total_tasks_) {
+        return grpc::Status::OK;
     }
 
-    const std::string& pixels = request->result().pixel_data();
-    const size_t expected_pixels =
-        static_cast<size_t>(tile.width()) * static_cast<size_t>(tile.height()) * 3;
-    if (pixels.size() != expected_pixels) {
-        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "pixel data size mismatch");
+    TimedLock lock(mtx_, stats);
+    const int passes_before = passes_complete_;
+    while (passes_complete_ < settings_.passes && pass_tiles_done_[passes_complete_] == tile_count_) {
+        ++passes_complete_;
     }
 
+    if (passes_complete_ != passes_before) {
+        if (passes_complete_ >= 2) {
+            print_line("Pass ", passes_complete_, " / ", settings_.passes, " complete, mean noise ", mean_noise_locked(), ".");
+        } else {
+            print_line("Pass ", passes_complete_, " / ", settings_.passes, " complete.");
+        }
+        if (progressive_.target_noise > 0.0 && passes_complete_ >= 2 && passes_complete_ < settings_.passes &&
+            mean_noise_locked() < progressive_.target_noise) {
+            stop_locked("noise target reached");
+        }
+    }
+
+    all_done_cv_.notify_one();
+    if (completed_count == total_tasks_) {
+        idle_cv_.notify_all();
+    }
+    return grpc::Status::OK;
+}
+
+// Adds the radiance of a result to its pixels, weighted by the pass's samples per pixel so
+// that a shorter last pass counts for less. Only results for other passes of the same tile
+// wait for each other.
+void RaytracerServiceImpl::add_radiance(const TileResult& result, int weight) {
+    const auto& tile = result.tile();
+    const auto& radiance = result.radiance();
+    const int tile_index = tile.y0() / settings_.tile_size * tiles_along(image_width_, settings_.tile_size) +
+                           tile.x0() / settings_.tile_size;
+    std::shared_lock<std::shared_mutex> pixels(pixels_mtx_);
+    std::lock_guard<std::mutex> lock(tile_mutexes_[tile_index]);
     size_t i = 0;
     for (int y = 0; y < tile.height(); ++y) {
         for (int x = 0; x < tile.width(); ++x) {
             size_t index = static_cast<size_t>(tile.y0() + y) * static_cast<size_t>(image_width_) +
                            static_cast<size_t>(tile.x0() + x);
-            final_image_pixels_[index] = color(
-                static_cast<unsigned char>(pixels[i]) / 255.999,
-                static_cast<unsigned char>(pixels[i + 1]) / 255.999,
-                static_cast<unsigned char>(pixels[i + 2]) / 255.999
-            );
+            const float r = radiance[i];
+            const float g = radiance[i + 1];
+            const float b = radiance[i + 2];
+            const float l = static_cast<float>(luminance(r, g, b));
+            radiance_sums_[index * 3] += weight * r;
+            radiance_sums_[index * 3 + 1] += weight * g;
+            radiance_sums_[index * 3 + 2] += weight * b;
+            luminance_sq_sums_[index] += weight * l * l;
+            pixel_samples_[index] += weight;
+            ++pixel_passes_[index];
             i += 3;
         }
     }
+}
 
-    in_progress_.erase(it);
+// Prints the completed tile count after a part of the tile task_id was recorded; called without any lock so
+// that writing to the console does not hold up other workers
+void RaytracerServiceImpl::report_progress(int32_t task_id) const {
+    const int completed_count = tasks_completed_;
+    if (settings_.passes > 1) {
+        print_line("Progress: pass ", task_id / tile_count_ + 1, ", ", completed_count, " / ", total_tasks_, " tiles completed.");
+    } else {
+        print_line("Progress: ", completed_count, " / ", total_tasks_, " tiles completed.");
+    }
+}
 
-    int completed_count = ++tiles_completed_;
-    std::cout << "Progress: " << completed_count << " / " << total_tiles_ << " tiles completed." << std::endl;
-    
-    if (completed_count == total_tiles_) {
-        all_done_cv_.notify_one();
+bool RaytracerServiceImpl::finished() const {
+    return stopped_ || tasks_completed_ == total_tasks_;
+}
+
+// Hands out no more tasks; results of tasks already leased are still accepted until the
+// server shuts down.
+void RaytracerServiceImpl::stop_locked(const char* reason) {
+    if (stopped_) return;
+    stopped_ = true;
+    work_queue_.clear();
+    requeued_.clear();
+    requeued_count_ = 0;
+    requeued_cost_ = 0.0;
+    print_line("Stopping after ", passes_complete_, " passes: ", reason, ".");
+    all_done_cv_.notify_one();
+    idle_cv_.notify_all();
+}
+
+// Noise of every pixel from the spread of its pass results, averaged over the image
+double RaytracerServiceImpl::mean_noise_locked() const {
+    std::unique_lock<std::shared_mutex> pixels(pixels_mtx_);
+    double total = 0.0;
+    size_t counted = 0;
+    for (size_t index = 0; index < pixel_samples_.size(); ++index) {
+        const double n = pixel_samples_[index];
+        if (pixel_passes_[index] < 2) continue;
+        const double mean = luminance(radiance_sums_[index * 3], radiance_sums_[index * 3 + 1], radiance_sums_[index * 3 + 2]) / n;
+        // per sample variance estimated from the weighted pass means
+        const double variance = std::max(0.0, (luminance_sq_sums_[index] - n * mean * mean) / (pixel_passes_[index] - 1));
+        total += std::sqrt(variance / n) / (2.0 * std::sqrt(std::max(mean, noise_luminance_floor)));
+        ++counted;
     }
-    return grpc::Status::OK;
+    return counted > 0 ? total / counted : std::numeric_limits<double>::infinity();
+}
+
+std::vector<color> RaytracerServiceImpl::resolve_image_locked() const {
+    std::unique_lock<std::shared_mutex> lock(pixels_mtx_);
+    std::vector<color> pixels(pixel_samples_.size());
+    for (size_t index = 0; index < pixels.size(); ++index) {
+        if (pixel_samples_[index] == 0) continue;
+        pixels[index] = color(radiance_sums_[index * 3], radiance_sums_[index * 3 + 1], radiance_sums_[index * 3 + 2])
+                      / pixel_samples_[index];
+    }
+    return pixels;
 }
 
 void RaytracerServiceImpl::wait_for_completion() {
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+    const auto deadline = start + progressive_.time_budget;
+    auto next_preview = start + progressive_.preview_interval;
+
     std::unique_lock<std::mutex> lock(mtx_);
-    all_done_cv_.wait(lock, [this]{ return tiles_completed_.load() == total_tiles_; });
-    std::cout << "All tiles rendered. Saving image to " << output_path_ << std::endl;
-    save_image();
+    while (!finished()) {
+        // wakes on every finished pass, and for the next preview or the deadline
+        auto wake = clock::time_point::max();
+        if (progressive_.preview_interval.count() > 0) {
+            wake = next_preview;
+        }
+        if (progressive_.time_budget.count() > 0 && clock::now() < deadline) {
+            wake = std::min(wake, deadline);
+        }
+        const int passes_seen = passes_complete_;
+        all_done_cv_.wait_until(lock, wake, [&] { return finished() || passes_complete_ != passes_seen; });
+        if (finished()) break;
+
+        const auto now = clock::now();
+        // a time budget only stops a render whose first pass covers the whole image
+        if (progressive_.time_budget.count() > 0 && now >= deadline && passes_complete_ >= 1) {
+            stop_locked("time budget used");
+            break;
+        }
+        if (progressive_.preview_interval.count() > 0 && now >= next_preview) {
+            next_preview = now + progressive_.preview_interval;
+            std::vector<color> preview = resolve_image_locked();
+            lock.unlock();
+            save_image(preview);
+            print_line("Preview written to ", output_path_);
+            lock.lock();
+        }
+    }
+
+    print_line("Rendering finished after ", passes_complete_, " / ", settings_.passes, " passes, ",
+               static_cast<double>(samples_used_) / (static_cast<double>(image_width_) * image_height_),
+               " samples per pixel on average. Saving image to ", output_path_);
+    std::vector<color> pixels = resolve_image_locked();
+    lock.unlock();
+    save_image(pixels);
+}
+
+SchedulerStats RaytracerServiceImpl::scheduler_stats() {
+    std::lock_guard<std::mutex> lock(stats_mtx_);
+    return stats_;
 }
 
-void RaytracerServiceImpl::save_image() {
+void RaytracerServiceImpl::add_stats(const SchedulerStats& stats) {
+    std::lock_guard<std::mutex> lock(stats_mtx_);
+    stats_ += stats;
+}
+
+void RaytracerServiceImpl::save_image(const std::vector<color>& pixels) const {
     std::ofstream out_file(output_path_);
     if (!out_file) {
         std::cerr << "Error: Could not open output file " << output_path_ << std::endl;
@@ -164,26 +581,119 @@ void RaytracerServiceImpl::save_image() {
     }
 
     out_file << "P3\n" << image_width_ << ' ' << image_height_ << "\n255\n";
-    for (const auto& pixel : final_image_pixels_) {
+    for (const auto& pixel : pixels) {
         write_color(out_file, pixel);
     }
 }
 
-std::queue<RenderTask> RaytracerServiceImpl::create_work_queue(int image_width, int image_height, int tile_size, int samples, int depth) {
-    std::queue<RenderTask> queue;
-    int32_t task_id = 0;
-    for (int y = 0; y < image_height; y += tile_size) {
-        for (int x = 0; x < image_width; x += tile_size) {
+// Times a probe render of every tile: one sample for each pixel of a camera with
+// probe_size pixels across a tile, over the pixels that fall within it. Russian roulette
+// and the sampler are as in the render, so the probe sees the same paths.
+std::vector<double> RaytracerServiceImpl::probe_tile_costs(const scene& sc, const RenderSettings& settings) {
+    const auto start = std::chrono::steady_clock::now();
+    const int tiles_x = tiles_along(settings.image_width, settings.tile_size);
+    const int tiles_y = tiles_along(settings.image_height, settings.tile_size);
+    const int scale = std::max(1, settings.tile_size / probe_size);
+    const int probe_width = tiles_along(settings.image_width, scale);
+    const int probe_height = tiles_along(settings.image_height, scale);
+    const camera probe_camera(sc.camera.position, sc.camera.look_at, sc.camera.up, sc.camera.vfov,
+                              static_cast<double>(settings.image_width) / settings.image_height,
+                              probe_width, probe_height);
+    render_options options;
+    options.roulette_depth = settings.roulette_depth;
+    options.sampler = settings.sampler;
+    options.show_progress = false;
+    const hittable& world = sc.accel ? static_cast<const hittable&>(*sc.accel) : sc.world;
+    const renderer probe(probe_camera, world, options);
+
+    std::vector<double> costs(static_cast<size_t>(tiles_x) * static_cast<size_t>(tiles_y));
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            const int x0 = tx * settings.tile_size;
+            const int y0 = ty * settings.tile_size;
+            const int width = std::min(settings.tile_size, settings.image_width - x0);
+            const int height = std::min(settings.tile_size, settings.image_height - y0);
+            const int px0 = x0 / scale;
+            const int py0 = y0 / scale;
+            const int probe_w = std::min(probe_width, tiles_along(x0 + width, scale)) - px0;
+            const int probe_h = std::min(probe_height, tiles_along(y0 + height, scale)) - py0;
+            render_stats stats;
+            probe.render_tile(px0, py0, probe_w, probe_h, 1, settings.max_depth, 0, &stats);
+            costs[static_cast<size_t>(ty) * tiles_x + tx] = stats.seconds / (probe_w * probe_h) * width * height;
+        }
+    }
+
+    std::vector<double> sorted = costs;
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    const double median = sorted[sorted.size() / 2];
+    const double costliest = *std::max_element(costs.begin(), costs.end());
+    std::cout << "Probed tile costs in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+              << " ms; the costliest tile is " << (median > 0.0 ? costliest / median : 0.0) << " times the median." << std::endl;
+    return costs;
+}
+
+// The cost of every task: its tile's probed time per sample or, without the probe, its
+// pixel count, times the samples of its pass
+std::vector<double> RaytracerServiceImpl::estimate_task_costs(const scene& sc, const RenderSettings& settings, bool probe) {
+    std::vector<double> tile_costs;
+    if (probe) {
+        tile_costs = probe_tile_costs(sc, settings);
+    } else {
+        for (int y = 0; y < settings.image_height; y += settings.tile_size) {
+            for (int x = 0; x < settings.image_width; x += settings.tile_size) {
+                tile_costs.push_back(std::min(settings.tile_size, settings.image_width - x) *
+                                     std::min(settings.tile_size, settings.image_height - y));
+            }
+        }
+    }
+
+    std::vector<double> costs;
+    costs.reserve(tile_costs.size() * settings.passes);
+    for (int pass = 0; pass < settings.passes; ++pass) {
+        const int samples = std::min(settings.pass_samples, settings.samples_per_pixel - pass * settings.pass_samples);
+        for (double cost : tile_costs) {
+            costs.push_back(cost * samples);
+        }
+    }
+    return costs;
+}
+
+// Every pass of every tile, pass by pass. Within a pass the tiles come costliest first when
+// task_costs is given, so the long ones are not left for the end, else in raster order.
+// Task ids are pass * tile count + raster index either way.
+std::vector<RenderTask> RaytracerServiceImpl::create_work_queue(const RenderSettings& settings,
+                                                               const std::vector<double>* task_costs) {
+    const int tiles_x = tiles_along(settings.image_width, settings.tile_size);
+    const int tile_count = tiles_x * tiles_along(settings.image_height, settings.tile_size);
+    std::vector<int> order(tile_count);
+    std::iota(order.begin(), order.end(), 0);
+    if (task_costs) {
+        // the first pass's costs order every pass
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return (*task_costs)[a] > (*task_costs)[b]; });
+    }
+
+    std::vector<RenderTask> queue;
+    queue.reserve(static_cast<size_t>(tile_count) * settings.passes);
+    for (int pass = 0; pass < settings.passes; ++pass) {
+        const int first_sample = pass * settings.pass_samples;
+        for (int index : order) {
+            const int x = index % tiles_x * settings.tile_size;
+            const int y = index / tiles_x * settings.tile_size;
             RenderTask task;
             auto* tile = task.mutable_tile();
             tile->set_x0(x);
             tile->set_y0(y);
-            tile->set_width(std::min(tile_size, image_width - x));
-            tile->set_height(std::min(tile_size, image_height - y));
-            tile->set_task_id(task_id++);
-            task.set_samples_per_pixel(samples);
-            task.set_max_depth(depth);
-            queue.push(task);
+            tile->set_width(std::min(settings.tile_size, settings.image_width - x));
+            tile->set_height(std::min(settings.tile_size, settings.image_height - y));
+            tile->set_task_id(pass * tile_count + index);
+            task.set_samples_per_pixel(std::min(settings.pass_samples, settings.samples_per_pixel - first_sample));
+            task.set_max_depth(settings.max_depth);
+            task.set_roulette_depth(settings.roulette_depth);
+            task.set_noise_threshold(settings.noise_threshold);
+            task.set_sampler(static_cast<RenderTask::Sampler>(settings.sampler));
+            task.set_first_sample(first_sample);
+            queue.push_back(task);
         }
     }
     return queue;
@@ -199,30 +709,410 @@ RenderConfig RaytracerServiceImpl::build_config_proto() const {
     return config;
 }
 
-void RaytracerServiceImpl::reclaim_expired_tasks_locked() {
+RaytracerServiceImpl::TaskQueue::TaskQueue(std::vector<RenderTask> tasks, const std::vector<double>& task_costs)
+    : tasks_(std::move(tasks)), cost_from_(tasks_.size() + 1, 0.0) {
+    for (size_t i = tasks_.size(); i-- > 0;) {
+        cost_from_[i] = cost_from_[i + 1] + task_costs[tasks_[i].tile().task_id()];
+    }
+}
+
+const RenderTask* RaytracerServiceImpl::TaskQueue::pop() {
+    // checked first so that polling an empty queue does not move the cursor on
+    if (next_.load(std::memory_order_relaxed) >= tasks_.size()) {
+        return nullptr;
+    }
+    const size_t next = next_.fetch_add(1, std::memory_order_relaxed);
+    return next < tasks_.size() ? &tasks_[next] : nullptr;
+}
+
+size_t RaytracerServiceImpl::TaskQueue::size() const {
+    return tasks_.size() - std::min(next_.load(std::memory_order_relaxed), tasks_.size());
+}
+
+double RaytracerServiceImpl::TaskQueue::cost() const {
+    return cost_from_[tasks_.size() - size()];
+}
+
+void RaytracerServiceImpl::TaskQueue::clear() {
+    next_ = tasks_.size();
+}
+
+// The worker registered as worker_id, nullptr if there is none. Workers are never removed,
+// so the pointer stays valid.
+RaytracerServiceImpl::WorkerState* RaytracerServiceImpl::find_worker(const std::string& worker_id) {
+    std::shared_lock<std::shared_mutex> lock(workers_mtx_);
+    auto worker = registered_workers_.find(worker_id);
+    return worker != registered_workers_.end() ? &worker->second : nullptr;
+}
+
+// Queues every task whose leases are all past their deadlines again, at the front since it
+// holds up the frame. The leases stay, so a late worker's result still counts if it is first.
+// Deadlines are seconds apart, so the shards are looked through at most every reclaim_interval.
+void RaytracerServiceImpl::reclaim_expired_tasks(SchedulerStats& stats) {
+    if (stopped_) return;
+    const auto now = std::chrono::steady_clock::now();
+    auto next = next_reclaim_.load();
+    if (now.time_since_epoch().count() < next ||
+        !next_reclaim_.compare_exchange_strong(next, (now + reclaim_interval).time_since_epoch().count())) {
+        return; // too soon, or another thread is at it
+    }
+
+    std::vector<QueuedTask> expired;
+    for (auto& shard : in_progress_) {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        for (auto& [task_id, assigned] : shard.tasks) {
+            if (assigned.queued || assigned.leases.empty()) continue;
+            const bool all_late = std::none_of(assigned.leases.begin(), assigned.leases.end(),
+                                               [&](const Lease& lease) { return lease.deadline > now; });
+            if (!all_late) continue;
+            assigned.queued = true;
+            expired.push_back({task_id, assigned.cost});
+        }
+    }
+    if (expired.empty()) return;
+
+    {
+        TimedLock lock(mtx_, stats);
+        requeue_locked(expired);
+    }
+    stats.deadline_requeues += expired.size();
+    for (const auto& queued : expired) {
+        print_line("Task ", queued.task_id, " ran past its lease deadline, queued again");
+    }
+}
+
+// Puts tasks at the front of the queue, in their order
+void RaytracerServiceImpl::requeue_locked(const std::vector<QueuedTask>& tasks) {
+    if (stopped_) return;
+    for (auto queued = tasks.rbegin(); queued != tasks.rend(); ++queued) {
+        requeued_.push_front(*queued);
+        requeued_cost_ += queued->cost;
+    }
+    requeued_count_ = static_cast<int>(requeued_.size());
+}
+
+// Takes the next task to lease off the queue: a task queued again, which is in in_progress_, or
+// else the next one of work_queue_ as fresh; false when both are empty. Only the first needs the
+// frame lock.
+bool RaytracerServiceImpl::pop_task(QueuedTask& queued, const RenderTask*& fresh, SchedulerStats& stats) {
+    if (requeued_count_ > 0) {
+        TimedLock lock(mtx_, stats);
+        if (!requeued_.empty()) {
+            queued = requeued_.front();
+            requeued_.pop_front();
+            requeued_count_ = static_cast<int>(requeued_.size());
+            // exactly 0 when empty, whatever the rounding of the sums
+            requeued_cost_ = requeued_.empty() ? 0.0 : requeued_cost_ - queued.cost;
+            fresh = nullptr;
+            return true;
+        }
+    }
+    fresh = work_queue_.pop();
+    return fresh != nullptr;
+}
+
+double RaytracerServiceImpl::queued_cost() const {
+    return work_queue_.cost() + requeued_cost_;
+}
+
+// Leases the next queued task to worker_id or, with none queued, a copy of a task another
+// worker lags behind on; false when there is neither. Callers reclaim expired leases first.
+bool RaytracerServiceImpl::lease_task(const std::string& worker_id, WorkerState& worker, RenderTask& task,
+                                      SchedulerStats& stats) {
+    QueuedTask queued;
+    const RenderTask* fresh;
+    while (pop_task(queued, fresh, stats)) {
+        const int32_t task_id = fresh ? fresh->tile().task_id() : queued.task_id;
+        LeaseShard& shard = lease_shard(task_id);
+        std::unique_lock<std::mutex> lock(shard.mtx);
+        AssignedTask* assigned = nullptr;
+        if (!fresh) {
+            auto it = shard.tasks.find(task_id);
+            if (it == shard.tasks.end()) continue; // a late lease finished it after all
+            assigned = &it->second;
+            assigned->queued = false;
+        }
+
+        // nobody is rendering a fresh task, a part of a split one or a released one, so it may
+        // be split in turn
+        const RenderTask& next = fresh ? *fresh : assigned->task;
+        const double cost = fresh ? task_costs_[task_id] : assigned->cost;
+        if ((!assigned || assigned->leases.empty()) && should_split(next, cost)) {
+            RenderTask whole = next;
+            if (assigned) {
+                shard.tasks.erase(task_id);
+            }
+            lock.unlock();
+            split_task(whole, cost, stats);
+            continue; // its parts are queued first
+        }
+
+        if (!assigned) {
+            assigned = &shard.tasks.try_emplace(task_id, AssignedTask{*fresh, cost, {}, false}).first->second;
+        }
+        auto own = std::find_if(assigned->leases.begin(), assigned->leases.end(),
+                                [&](const Lease& lease) { return lease.worker_id == worker_id; });
+        if (own != assigned->leases.end()) {
+            // its own lease ran late, but it is still asking for work: give it the time again
+            own->deadline = std::chrono::steady_clock::now() + (own->deadline - own->leased_at);
+            continue;
+        }
+        add_lease(worker_id, worker, *assigned, false);
+        task = assigned->task;
+        return true;
+    }
+    return lease_copy(worker_id, worker, task, stats);
+}
+
+// Whether a task just taken off the queue would take more than an even share of the work left
+// in the queue, so that a worker could still be busy with it once the others run out. As the
+// queue runs low near the end of the frame that holds for every task, and parts are split
+// again until they are small. Never with adaptive sampling, which shares its budget over
+// the tile's rows and clips its noise estimates at the tile's edges, so a split tile would
+// get other samples than the whole one.
+bool RaytracerServiceImpl::should_split(const RenderTask& task, double cost) const {
+    const auto& tile = task.tile();
+    const int min_size = scheduler_.min_split_size;
+    return min_size > 0 && settings_.noise_threshold <= 0.0 &&
+           (tile.width() >= 2 * min_size || tile.height() >= 2 * min_size) &&
+           cost * worker_count_ > queued_cost() + cost;
+}
+
+// Queues the quarters (or halves) of a task in its place
+void RaytracerServiceImpl::split_task(const RenderTask& task, double cost, SchedulerStats& stats) {
+    const auto& tile = task.tile();
+    const int min_size = scheduler_.min_split_size;
+    const int columns = tile.width() >= 2 * min_size ? 2 : 1;
+    const int rows = tile.height() >= 2 * min_size ? 2 : 1;
+    const int32_t parent = tile.task_id();
+    std::vector<QueuedTask> parts;
+
+    TimedLock lock(mtx_, stats);
+    parts_left_[parent] = columns * rows;
+    for (int part = 0; part < columns * rows; ++part) {
+        const int column = part % columns;
+        const int row = part / columns;
+        const int x0 = tile.x0() + column * (tile.width() / columns);
+        const int y0 = tile.y0() + row * (tile.height() / rows);
+        RenderTask split = task;
+        auto* split_tile = split.mutable_tile();
+        split_tile->set_x0(x0);
+        split_tile->set_y0(y0);
+        split_tile->set_width(column + 1 == columns ? tile.x0() + tile.width() - x0 : tile.width() / columns);
+        split_tile->set_height(row + 1 == rows ? tile.y0() + tile.height() - y0 : tile.height() / rows);
+        const double part_cost = cost * split_tile->width() * split_tile->height() / (tile.width() * tile.height());
+        const int32_t part_id = total_tasks_ + static_cast<int32_t>(part_parents_.size());
+        split_tile->set_task_id(part_id);
+        part_parents_.push_back(parent);
+        {
+            LeaseShard& shard = lease_shard(part_id);
+            std::lock_guard<std::mutex> shard_lock(shard.mtx);
+            shard.tasks.try_emplace(part_id, AssignedTask{std::move(split), part_cost, {}, true});
+        }
+        parts.push_back({part_id, part_cost});
+    }
+    requeue_locked(parts);
+    ++stats.tasks_split;
+}
+
+// The tile task that task_id is a part of, task_id itself if it was never split
+int32_t RaytracerServiceImpl::tile_task_locked(int32_t task_id) const {
+    while (task_id >= total_tasks_) {
+        task_id = part_parents_[task_id - total_tasks_];
+    }
+    return task_id;
+}
+
+// Marks task_id finished, and the task it is a part of once all its parts are, and sets
+// tile_task to the tile task it belongs to; true when that whole tile task is finished
+bool RaytracerServiceImpl::finish_task(int32_t task_id, int32_t& tile_task, SchedulerStats& stats) {
+    if (task_id < total_tasks_) {
+        tile_task = task_id;
+        return true;
+    }
+
+    TimedLock lock(mtx_, stats);
+    tile_task = tile_task_locked(task_id);
+    while (task_id >= total_tasks_) {
+        const int32_t parent = part_parents_[task_id - total_tasks_];
+        auto left = parts_left_.find(parent);
+        if (--left->second > 0) {
+            return false;
+        }
+        parts_left_.erase(left);
+        task_id = parent;
+    }
+    return true;
+}
+
+// Leases an idle worker a copy of the task whose leases are expected to finish last, if it
+// would finish it sooner, so that a slow worker's last tiles do not hold up the frame
+bool RaytracerServiceImpl::lease_copy(const std::string& worker_id, WorkerState& worker, RenderTask& task,
+                                      SchedulerStats& stats) {
+    if (stopped_ || scheduler_.speculative_copies <= 0 || worker.leases > 0) {
+        return false;
+    }
+
+    // a copy is only worth rendering if it saves at least the time it takes, which is not
+    // known before some worker has been timed
+    const double tile_seconds = estimated_tile_seconds(worker);
+    if (tile_seconds <= 0.0) {
+        return false;
+    }
     const auto now = std::chrono::steady_clock::now();
-    std::vector<int32_t> expired;
-    for (const auto& [task_id, assigned] : in_progress_) {
-        if (now - assigned.leased_at > lease_timeout_) {
-            expired.push_back(task_id);
+    auto latest = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(2.0 * tile_seconds));
+    const auto copies = static_cast<size_t>(scheduler_.speculative_copies);
+    std::optional<int32_t> straggler;
+    for (auto& shard : in_progress_) {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        for (const auto& [task_id, assigned] : shard.tasks) {
+            if (assigned.leases.empty() || assigned.leases.size() > copies) {
+                continue;
+            }
+            // a lease given before any worker was timed has no expected finish to beat
+            auto finish = std::chrono::steady_clock::time_point::max();
+            for (const auto& lease : assigned.leases) {
+                if (!lease.expected) {
+                    finish = std::chrono::steady_clock::time_point::min();
+                    break;
+                }
+                // an overdue lease is assumed to run as late again
+                finish = std::min(finish, *lease.expected > now ? *lease.expected : now + (now - *lease.expected));
+            }
+            if (finish > latest) {
+                latest = finish;
+                straggler = task_id;
+            }
         }
     }
+    if (!straggler) {
+        return false;
+    }
 
-    for (int32_t task_id : expired) {
-        auto it = in_progress_.find(task_id);
-        if (it == in_progress_.end()) continue;
-        work_queue_.push(it->second.task);
-        in_progress_.erase(it);
-        std::cout << "Reclaimed timed-out task " << task_id << std::endl;
+    LeaseShard& shard = lease_shard(*straggler);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.tasks.find(*straggler);
+    // it may have finished or been copied since the shards were looked through
+    if (it == shard.tasks.end() || it->second.leases.empty() || it->second.leases.size() > copies) {
+        return false;
     }
+    add_lease(worker_id, worker, it->second, true);
+    task = it->second.task;
+    ++stats.speculative_leases;
+    return true;
 }
 
-bool RaytracerServiceImpl::validate_worker(const std::string& worker_id) const {
-    return registered_workers_.contains(worker_id);
+// Leases assigned to worker_id, expecting it done once it has worked through every task it
+// holds at its time per tile. Until that time is known the fixed lease timeout applies.
+void RaytracerServiceImpl::add_lease(const std::string& worker_id, WorkerState& worker, AssignedTask& assigned,
+                                     bool speculative) {
+    using duration = std::chrono::steady_clock::duration;
+    const auto now = std::chrono::steady_clock::now();
+    const int leases = ++worker.leases;
+    Lease lease{worker_id, &worker, now, std::nullopt, now + lease_timeout_, speculative};
+    const double tile_seconds = estimated_tile_seconds(worker);
+    if (tile_seconds > 0.0) {
+        const std::chrono::duration<double> work(tile_seconds * leases);
+        lease.expected = now + std::chrono::duration_cast<duration>(work);
+        lease.deadline = now + std::min<duration>(lease_timeout_,
+                                                  minimum_lease + std::chrono::duration_cast<duration>(work * lease_slack));
+    }
+    assigned.leases.push_back(std::move(lease));
+}
+
+// The worker's measured time per tile or, before it is timed, the other workers' time per
+// tile and core spread over its cores; 0 when neither is known
+double RaytracerServiceImpl::estimated_tile_seconds(const WorkerState& worker) {
+    const double tile_seconds = worker.tile_seconds;
+    if (tile_seconds > 0.0) {
+        return tile_seconds;
+    }
+    if (worker.cores == 0) {
+        return 0.0;
+    }
+    double core_seconds = 0.0;
+    int timed = 0;
+    std::shared_lock<std::shared_mutex> lock(workers_mtx_);
+    for (const auto& [id, other] : registered_workers_) {
+        const double other_seconds = other.tile_seconds;
+        if (other_seconds > 0.0 && other.cores > 0) {
+            core_seconds += other_seconds * other.cores;
+            ++timed;
+        }
+    }
+    if (timed == 0) {
+        return 0.0;
+    }
+    return core_seconds / timed / worker.cores;
+}
+
+// Tasks for the worker's next batch: about batch_target of its work, but no more than its
+// share of the queue, so the end of a frame stays spread over all workers
+int RaytracerServiceImpl::batch_size(const WorkerState& worker) {
+    if (scheduler_.max_batch <= 1) {
+        return 1;
+    }
+
+    const double tile_seconds = estimated_tile_seconds(worker);
+    if (tile_seconds <= 0.0) {
+        return 1;
+    }
+
+    const double target_seconds = std::chrono::duration<double>(scheduler_.batch_target).count();
+    const double batch = std::min(target_seconds / tile_seconds, static_cast<double>(scheduler_.max_batch));
+    const size_t workers = std::max(1, worker_count_.load());
+    const size_t share = (work_queue_.size() + requeued_count_ + workers - 1) / workers;
+    return std::max(1, std::min(static_cast<int>(batch), static_cast<int>(share)));
+}
+
+// Moves the worker's time per tile towards that of the tiles results it just returned, which
+// it rendered one after the other since started: their lease, or its previous results if it
+// was still busy with those. started is time_point::max() if none of them was recorded. Only
+// the worker's own RPCs call this, one at a time.
+void RaytracerServiceImpl::time_results(WorkerState& worker, std::chrono::steady_clock::time_point started, int tiles) {
+    const auto now = std::chrono::steady_clock::now();
+    if (tiles > 0 && started != std::chrono::steady_clock::time_point::max()) {
+        const double tile_seconds =
+            std::chrono::duration<double>(now - std::max(started, worker.last_results)).count() / tiles;
+        const double average = worker.tile_seconds;
+        worker.tile_seconds = average > 0.0 ? average + tile_time_smoothing * (tile_seconds - average) : tile_seconds;
+    }
+    worker.last_results = now;
+}
+
+// Drops worker_id's leases among task_ids, and queues those tasks no other worker holds again
+void RaytracerServiceImpl::release_tasks(const std::string& worker_id, const std::vector<int32_t>& task_ids,
+                                         SchedulerStats& stats) {
+    std::vector<int32_t> dropped;
+    std::vector<QueuedTask> released;
+    for (int32_t task_id : task_ids) {
+        LeaseShard& shard = lease_shard(task_id);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.tasks.find(task_id);
+        if (it == shard.tasks.end()) continue;
+        auto& leases = it->second.leases;
+        auto lease = std::find_if(leases.begin(), leases.end(), [&](const Lease& l) { return l.worker_id == worker_id; });
+        if (lease == leases.end()) continue;
+        --lease->worker->leases;
+        leases.erase(lease);
+        dropped.push_back(task_id);
+        if (leases.empty() && !it->second.queued && !stopped_) {
+            it->second.queued = true;
+            released.push_back({task_id, it->second.cost});
+        }
+    }
+    if (!released.empty()) {
+        TimedLock lock(mtx_, stats);
+        requeue_locked(released);
+    }
+    for (int32_t task_id : dropped) {
+        print_line("Released task ", task_id, " of ", worker_id);
+    }
 }
 
-void RunServer(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, const std::string& address, const std::string& output_path) {
-    RaytracerServiceImpl service(sc, image_width, image_height, tile_size, samples, depth, output_path);
+void RunServer(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, int roulette_depth, double noise_threshold, sampler_kind sampler, const ProgressiveSettings& progressive, const SchedulerSettings& scheduler, const std::string& address, const std::string& output_path) {
+    RaytracerServiceImpl service(sc, image_width, image_height, tile_size, samples, depth, roulette_depth, noise_threshold, sampler, progressive, scheduler, output_path);
 
     ServerBuilder builder;
     builder.AddListeningPort(address, grpc::InsecureServerCredentials());
@@ -236,5 +1126,10 @@ void RunServer(const scene& sc, int image_width, int image_height, int tile_size
     std::cout << "Master server listening on " << address << std::endl;
 
     service.wait_for_completion();
-    server->Shutdown();
+    // idle workers poll for work until they hear the frame is finished
+    std::this_thread::sleep_for(2 * idle_poll);
+    // a worker that stopped responding keeps its task stream open, which is cancelled after
+    // shutdown_grace rather than waited for
+    server->Shutdown(std::chrono::system_clock::now() + shutdown_grace);
+    std::cout << "Scheduler: " << service.scheduler_stats() << std::endl;
 }
@@ -4,18 +4,67 @@
 #include <grpcpp/grpcpp.h>
 #include "raytracer.grpc.pb.h"
 #include "scene.hpp"
-#include <queue>
+#include "sampler.hpp"
+#include <array>
+#include <deque>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <condition_variable>
 #include <atomic>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
+#include <iosfwd>
 #include <chrono>
 #include "color.hpp"
 
 using namespace raytracer;
 
+// Progressive rendering: every tile is rendered in passes of pass_samples samples, all tiles
+// of one pass before the next, and the master averages the passes as they arrive.
+struct ProgressiveSettings {
+    int pass_samples = 0;                     // 0 renders all samples in a single pass
+    std::chrono::seconds preview_interval{0}; // rewrite the output image this often, 0 never
+    std::chrono::seconds time_budget{0};      // stop after this long, 0 never
+    double target_noise = 0.0;                // stop once the mean pixel noise is below this, 0 never
+};
+
+// How RequestTask batches tasks: a batch holds about batch_target of a worker's work, timed
+// from its earlier batches or, before that, estimated from its cores and the other workers'
+// times, and at most max_batch tasks. Once no task is left to lease, an idle worker gets a
+// copy of a task another worker is expected to finish later than it would, as long as the
+// task has fewer than speculative_copies copies besides the original.
+// With cost_order the tiles of each pass are handed out costliest first, by a quick probe
+// render of every tile on the master, else by pixels and samples. A task estimated to cost
+// more than an even share of the queued work per worker is split into quarters when it is
+// leased, down to min_split_size pixels a side, which splits the last tasks of a frame and
+// any tile far costlier than the rest.
+struct SchedulerSettings {
+    int max_batch = 16; // 1 leases a single task per RequestTask
+    std::chrono::milliseconds batch_target{500};
+    int speculative_copies = 1; // 0 never duplicates a task
+    bool cost_order = true;     // false hands out the tiles in raster order
+    int min_split_size = 8;     // 0 never splits a task
+};
+
+// Counters of the scheduling work done by the RPC handlers; the lock is the master's frame
+// lock, taken for tasks queued again or split and for finished passes
+struct SchedulerStats {
+    uint64_t request_task_calls = 0;
+    uint64_t submit_result_calls = 0;
+    uint64_t tasks_leased = 0;
+    uint64_t results_recorded = 0;
+    uint64_t results_superseded = 0; // arrived after another copy of their task
+    uint64_t deadline_requeues = 0;
+    uint64_t speculative_leases = 0;
+    uint64_t speculative_wins = 0;
+    uint64_t tasks_split = 0;
+    uint64_t lock_acquisitions = 0;
+    std::chrono::nanoseconds lock_held{0};
+};
+
+std::ostream& operator<<(std::ostream& out, const SchedulerStats& stats);
+
 class RaytracerServiceImpl final : public RaytracerService::Service {
 private:
     struct RenderSettings {
@@ -24,50 +73,173 @@ private:
         int tile_size;
         int samples_per_pixel;
         int max_depth;
+        int roulette_depth;
+        double noise_threshold;
+        sampler_kind sampler;
+        int pass_samples;
+        int passes;
     };
 
-    struct AssignedTask {
-        RenderTask task;
+    struct WorkerState {
+        int cores = 0;                         // 0 if the worker did not say
+        std::atomic<double> tile_seconds{0.0}; // moving average of its time per tile, 0 until timed
+        std::atomic<int> leases{0};            // tasks it holds
+        std::chrono::steady_clock::time_point last_results; // when it last returned results, set by its own RPCs only
+    };
+
+    struct Lease {
         std::string worker_id;
+        WorkerState* worker; // registered workers are never removed
         std::chrono::steady_clock::time_point leased_at;
+        // when the worker should be done, from its tile time; unknown until some worker is timed
+        std::optional<std::chrono::steady_clock::time_point> expected;
+        std::chrono::steady_clock::time_point deadline; // the task is queued again after this
+        bool speculative;                               // a copy of a task another worker holds
+    };
+
+    // A task out with one or more workers, or queued again; the first result from any of
+    // them is kept
+    struct AssignedTask {
+        RenderTask task;
+        double cost; // estimated, as in task_costs_
+        std::vector<Lease> leases;
+        bool queued = false; // in requeued_, every lease being past its deadline or none left
     };
 
-    static std::queue<RenderTask> create_work_queue(int image_width, int image_height, int tile_size, int samples, int depth);
+    // Tasks in flight, sharded by task id so that workers leasing and returning different
+    // tasks do not wait for each other
+    struct LeaseShard {
+        std::mutex mtx;
+        std::unordered_map<int32_t, AssignedTask> tasks;
+    };
+    static constexpr int lease_shards = 16;
+
+    struct QueuedTask {
+        int32_t task_id;
+        double cost;
+    };
+
+    // The tasks of a frame in the order they are handed out. Each is taken only once, so the
+    // queue is an atomic cursor over a fixed list, which any number of threads pop from
+    // without a lock.
+    class TaskQueue {
+    public:
+        TaskQueue(std::vector<RenderTask> tasks, const std::vector<double>& task_costs);
+        const RenderTask* pop(); // nullptr once empty
+        size_t size() const;
+        double cost() const; // of the tasks left
+        void clear();
+
+    private:
+        const std::vector<RenderTask> tasks_;
+        std::vector<double> cost_from_; // of tasks_[i] and the tasks after it, and 0 at the end
+        std::atomic<size_t> next_{0};
+    };
+
+    static std::vector<double> probe_tile_costs(const scene& sc, const RenderSettings& settings);
+    static std::vector<double> estimate_task_costs(const scene& sc, const RenderSettings& settings, bool probe);
+    static std::vector<RenderTask> create_work_queue(const RenderSettings& settings, const std::vector<double>* task_costs);
     RenderConfig build_config_proto() const;
-    void reclaim_expired_tasks_locked();
-    bool validate_worker(const std::string& worker_id) const;
+    LeaseShard& lease_shard(int32_t task_id) { return in_progress_[static_cast<uint32_t>(task_id) % lease_shards]; }
+    WorkerState* find_worker(const std::string& worker_id);
+    void reclaim_expired_tasks(SchedulerStats& stats);
+    void requeue_locked(const std::vector<QueuedTask>& tasks);
+    bool pop_task(QueuedTask& queued, const RenderTask*& fresh, SchedulerStats& stats);
+    double queued_cost() const;
+    bool lease_task(const std::string& worker_id, WorkerState& worker, RenderTask& task, SchedulerStats& stats);
+    bool should_split(const RenderTask& task, double cost) const;
+    void split_task(const RenderTask& task, double cost, SchedulerStats& stats);
+    int32_t tile_task_locked(int32_t task_id) const;
+    bool finish_task(int32_t task_id, int32_t& tile_task, SchedulerStats& stats);
+    bool lease_copy(const std::string& worker_id, WorkerState& worker, RenderTask& task, SchedulerStats& stats);
+    void add_lease(const std::string& worker_id, WorkerState& worker, AssignedTask& assigned, bool speculative);
+    double estimated_tile_seconds(const WorkerState& worker);
+    int batch_size(const WorkerState& worker);
+    grpc::Status record_result(const std::string& worker_id, const TileResult& result, SchedulerStats& stats,
+                               std::chrono::steady_clock::time_point& leased_at, int32_t& tile_task);
+    void add_radiance(const TileResult& result, int weight);
+    void time_results(WorkerState& worker, std::chrono::steady_clock::time_point started, int tiles);
+    void release_tasks(const std::string& worker_id, const std::vector<int32_t>& task_ids, SchedulerStats& stats);
+    void add_stats(const SchedulerStats& stats);
+    void report_progress(int32_t task_id) const;
 
 public:
-    RaytracerServiceImpl(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, std::string output_path);
+    RaytracerServiceImpl(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, int roulette_depth, double noise_threshold, sampler_kind sampler, const ProgressiveSettings& progressive, const SchedulerSettings& scheduler, std::string output_path);
 
     grpc::Status HealthCheck(grpc::ServerContext* context, const google::protobuf::Empty* request, HealthCheckResponse* response) override;
     grpc::Status RegisterWorker(grpc::ServerContext* context, const WorkerRegistrationRequest* request, WorkerRegistrationResponse* response) override;
     grpc::Status RequestTask(grpc::ServerContext* context, const WorkRequest* request, TaskAssignment* response) override;
     grpc::Status SubmitResult(grpc::ServerContext* context, const SubmitResultRequest* request, google::protobuf::Empty* response) override;
+    grpc::Status StreamTasks(grpc::ServerContext* context, grpc::ServerReaderWriter<RenderTask, TaskStreamRequest>* stream) override;
 
+    // Largest task window a worker may ask for on a task stream
+    static constexpr int max_task_window = 16;
+
+    // Returns once every pass is rendered or a budget ran out, writing previews meanwhile
     void wait_for_completion();
 
+    SchedulerStats scheduler_stats();
+
 private:
-    void save_image();
+    bool finished() const;
+    void stop_locked(const char* reason);
+    double mean_noise_locked() const;
+    std::vector<color> resolve_image_locked() const;
+    void save_image(const std::vector<color>& pixels) const;
 
     const SceneData scene_data_;
-    std::queue<RenderTask> work_queue_;
-    std::unordered_map<int32_t, AssignedTask> in_progress_;
-    std::unordered_set<std::string> registered_workers_;
-    const int total_tiles_;
-    std::atomic<int> tiles_completed_;
+    const RenderSettings settings_;
+    const ProgressiveSettings progressive_;
+    const SchedulerSettings scheduler_;
+    const std::vector<double> task_costs_; // estimated, by tile task id
+    TaskQueue work_queue_;
+    std::array<LeaseShard, lease_shards> in_progress_;
+    std::shared_mutex workers_mtx_;
+    std::unordered_map<std::string, WorkerState> registered_workers_; // guarded by workers_mtx_
+    std::atomic<int> worker_count_;
+    const int tile_count_; // per pass; task ids are pass * tile_count_ + tile
+    const int total_tasks_;
+    std::atomic<int> tasks_completed_;
+    std::atomic<uint64_t> samples_used_;
+    std::vector<std::atomic<int>> pass_tiles_done_; // per pass
+    std::atomic<bool> stopped_;
+    std::atomic<std::chrono::steady_clock::rep> next_reclaim_; // expired leases are looked for again from then
     const int image_width_;
     const int image_height_;
-    const RenderSettings settings_;
     const std::string output_path_;
     std::atomic<int> next_worker_id_;
     const std::chrono::seconds lease_timeout_;
-    
+
+    // The frame lock, for what is rare in a frame: tasks queued again, split tasks and
+    // finished passes
     std::mutex mtx_;
+    // Tasks queued again go before work_queue_: parts of split tasks, and tasks whose leases
+    // ran past their deadlines or were released. All of them are in in_progress_ too.
+    std::deque<QueuedTask> requeued_;  // guarded by mtx_
+    std::atomic<int> requeued_count_;  // size of requeued_, read without the lock
+    std::atomic<double> requeued_cost_;
+    // Parts of split tasks take the ids from total_tasks_ up
+    std::vector<int32_t> part_parents_;           // by id - total_tasks_, guarded by mtx_
+    std::unordered_map<int32_t, int> parts_left_; // of every split task not finished yet, guarded by mtx_
+    int passes_complete_; // every tile has finished passes [0, passes_complete_), guarded by mtx_
     std::condition_variable all_done_cv_;
-    std::vector<color> final_image_pixels_;
+    std::condition_variable idle_cv_; // task streams with nothing to hand out wait on it
+
+    std::mutex stats_mtx_;
+    SchedulerStats stats_; // guarded by stats_mtx_, added to once per RPC
+
+    // Results are added to the pixels without the frame lock: tiles of one pass never overlap,
+    // and those of different passes take turns on their tile's lock. Reading the whole image
+    // takes pixels_mtx_ exclusively, and adding a result takes it shared.
+    mutable std::shared_mutex pixels_mtx_;
+    std::vector<std::mutex> tile_mutexes_; // by tile index
+    // Linear radiance of the finished passes, each weighted by its samples per pixel
+    std::vector<float> radiance_sums_;     // RGB
+    std::vector<float> luminance_sq_sums_; // squared pass luminance, same weights
+    std::vector<uint32_t> pixel_samples_;
+    std::vector<uint32_t> pixel_passes_;
 };
 
-void RunServer(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, const std::string& address, const std::string& output_path);
+void RunServer(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, int roulette_depth, double noise_threshold, sampler_kind sampler, const ProgressiveSettings& progressive, const SchedulerSettings& scheduler, const std::string& address, const std::string& output_path);
 
-#endif 
+#endif
@@ -0,0 +1,76 @@
+#include "simulation.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void simulate_worker(RaytracerServiceImpl& service, const SimulationSettings& simulation, int index) {
+    WorkerRegistrationRequest registration;
+    registration.set_hostname("simulated-" + std::to_string(index));
+    registration.set_cores(simulation.cores);
+    WorkerRegistrationResponse registered;
+    if (!service.RegisterWorker(nullptr, &registration, &registered).ok()) {
+        return;
+    }
+
+    const auto tile_time = index < simulation.slow_workers ? simulation.tile_time * simulation.slow_factor : simulation.tile_time;
+    WorkRequest request;
+    request.set_worker_id(registered.worker_id());
+    while (true) {
+        TaskAssignment assignment;
+        if (!service.RequestTask(nullptr, &request, &assignment).ok()) {
+            break;
+        }
+        if (!assignment.has_assignment()) {
+            if (assignment.retry_after_ms() == 0) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(assignment.retry_after_ms()));
+            continue;
+        }
+
+        SubmitResultRequest submit;
+        submit.set_worker_id(registered.worker_id());
+        for (const auto& task : assignment.tasks()) {
+            std::this_thread::sleep_for(tile_time);
+            const auto& tile = task.tile();
+            const int pixels = tile.width() * tile.height();
+            auto* result = submit.add_results();
+            result->mutable_tile()->CopyFrom(tile);
+            result->mutable_radiance()->Resize(pixels * 3, 0.0f);
+            result->set_samples_used(static_cast<uint64_t>(pixels) * task.samples_per_pixel());
+        }
+        google::protobuf::Empty empty;
+        service.SubmitResult(nullptr, &submit, &empty);
+    }
+}
+
+}
+
+void RunSimulation(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, int roulette_depth, double noise_threshold, sampler_kind sampler, const ProgressiveSettings& progressive, const SchedulerSettings& scheduler, const SimulationSettings& simulation, const std::string& output_path) {
+    RaytracerServiceImpl service(sc, image_width, image_height, tile_size, samples, depth, roulette_depth, noise_threshold, sampler, progressive, scheduler, output_path);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    workers.reserve(simulation.workers);
+    for (int i = 0; i < simulation.workers; ++i) {
+        workers.emplace_back(simulate_worker, std::ref(service), std::cref(simulation), i);
+    }
+    service.wait_for_completion();
+    // workers may still be busy with copies of tasks that finished elsewhere
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    const SchedulerStats stats = service.scheduler_stats();
+    std::cout << "Scheduler: " << stats << std::endl;
+    const uint64_t rpcs = stats.request_task_calls + stats.submit_result_calls;
+    std::cout << "Simulated " << simulation.workers << " workers in " << seconds << " s: " << rpcs << " RPCs, "
+              << static_cast<double>(stats.results_recorded) / seconds << " tiles per second, frame lock held "
+              << std::chrono::duration<double, std::micro>(stats.lock_held).count() / std::max<uint64_t>(1, stats.results_recorded)
+              << " us per tile." << std::endl;
+}
@@ -0,0 +1,23 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <chrono>
+#include <string>
+#include "master.hpp"
+
+// Simulated workers for load testing the master's scheduling in one process, without a
+// network or rendering: each worker registers, then leases task batches with RequestTask,
+// "renders" each tile by sleeping for tile_time and hands back black tiles with SubmitResult.
+struct SimulationSettings {
+    int workers = 100;
+    std::chrono::microseconds tile_time{2000};
+    int cores = 8; // reported by every simulated worker
+    int slow_workers = 0; // this many of the workers take slow_factor times as long per tile
+    int slow_factor = 20;
+};
+
+// Like RunServer, but serves the simulated workers instead of listening on a port, and prints
+// the scheduler counters and the wall time at the end
+void RunSimulation(const scene& sc, int image_width, int image_height, int tile_size, int samples, int depth, int roulette_depth, double noise_threshold, sampler_kind sampler, const ProgressiveSettings& progressive, const SchedulerSettings& scheduler, const SimulationSettings& simulation, const std::string& output_path);
+
+#endif
@@ -25,23 +25,32 @@ public:
     const point3& max() const { return max_point; }
 
     bool hit(const ray& r, interval ray_t) const {
-        for (int a = 0; a < 3; ++a) {
-            auto invD = 1.0f / r.direction()[a];
-            auto t0 = (min_point[a] - r.origin()[a]) * invD;
-            auto t1 = (max_point[a] - r.origin()[a]) * invD;
+        return hit(traversal_ray(r), ray_t);
+    }
 
-            if (invD < 0.0f) {
-                std::swap(t0, t1);
-            }
+    // Branchless slab test. The near plane is chosen by direction sign instead of ordering
+    // the two distances, and the running interval is only updated by comparisons that fail
+    // on NaN, so a ray parallel to an axis with its origin on a slab plane (0 * inf) keeps
+    // its interval instead of being rejected or accepted by accident.
+    bool hit(const traversal_ray& r, interval ray_t) const {
+        for (int a = 0; a < 3; ++a) {
+            const real near_plane = r.dir_is_neg(a) ? max_point[a] : min_point[a];
+            const real far_plane = r.dir_is_neg(a) ? min_point[a] : max_point[a];
+            const real t0 = (near_plane - r.origin()[a]) * r.inv_direction()[a];
+            const real t1 = (far_plane - r.origin()[a]) * r.inv_direction()[a];
+            ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+            ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+        }
+        return ray_t.min < ray_t.max;
+    }
 
-            if (t0 > ray_t.min) ray_t.min = t0;
-            if (t1 < ray_t.max) ray_t.max = t1;
+    real surface_area() const {
+        vec3 extent = max_point - min_point;
+        return 2.0 * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+    }
 
-            if (ray_t.max <= ray_t.min) {
-                return false;
-            }
-        }
-        return true;
+    point3 centroid() const {
+        return 0.5 * (min_point + max_point);
     }
 
     // Return the index of the longest axis
@@ -0,0 +1,29 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <iosfwd>
+#include <string>
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "renderer.hpp"
+
+// Everything a microbenchmark may need from the standalone renderer's setup.
+struct benchmark_context {
+    const bvh& accel;       // binary BVH over the scene
+    const hittable& world;  // what the renderer would traverse (binary or wide BVH)
+    const camera& cam;
+    int image_width;
+    int image_height;
+    int ray_count;
+    int max_depth;
+    render_options render; // as given on the command line
+    std::string reference_path; // --bench-reference, used by `precision`
+};
+
+// Runs the microbenchmark called `name` (see `render --help`) and writes its report to
+// `out`. Returns false if there is no benchmark with that name.
+bool run_benchmark(const std::string& name, const benchmark_context& ctx, std::ostream& out);
+
+#endif
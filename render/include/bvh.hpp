@@ -3,28 +3,113 @@
 
 #include "hittable.hpp"
 #include "hittable_list.hpp"
+#include "primitive_store.hpp"
 #include <vector>
 #include <memory>
-#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <iosfwd>
 
-class bvh_node : public hittable {
+// One node of the linearized BVH. Nodes are stored depth-first, so the first child of an
+// interior node always sits at index + 1 and only the second child needs an explicit index.
+// Bounds are single precision (rounded outward) to keep a node at 32 bytes.
+struct alignas(32) bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;          // leaf: first primitive index, interior: second child index
+    uint16_t primitive_count; // 0 for interior nodes
+    uint8_t axis;             // split axis, used to visit the nearer child first
+    uint8_t pad;
+
+    bool is_leaf() const { return primitive_count > 0; }
+
+    // Same slab test as aabb::hit(const traversal_ray&, interval), on the float bounds
+    bool hit(const traversal_ray& r, real tmin, real tmax) const {
+        for (int a = 0; a < 3; ++a) {
+            const real near_plane = r.dir_is_neg(a) ? bounds_max[a] : bounds_min[a];
+            const real far_plane = r.dir_is_neg(a) ? bounds_min[a] : bounds_max[a];
+            const real t0 = (near_plane - r.origin()[a]) * r.inv_direction()[a];
+            const real t1 = (far_plane - r.origin()[a]) * r.inv_direction()[a];
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+        }
+        return tmin < tmax;
+    }
+
+    aabb bounds() const {
+        return aabb(point3(bounds_min[0], bounds_min[1], bounds_min[2]),
+                    point3(bounds_max[0], bounds_max[1], bounds_max[2]));
+    }
+};
+
+static_assert(sizeof(bvh_node) == 32, "bvh_node must stay 32 bytes");
+
+enum class bvh_build_method {
+    median, // split at the median along the longest axis
+    sah     // binned surface area heuristic
+};
+
+struct bvh_build_options {
+    bvh_build_method method = bvh_build_method::sah;
+    int max_leaf_size = 4;
+    int sah_bins = 16;
+    // Relative costs of one node visit and one primitive test, used by the SAH
+    double traversal_cost = 1.0;
+    double intersection_cost = 4.0;
+    // Primitives the leaf kernels test together (sphere_soa::lanes); the SAH charges
+    // intersection_cost once per started block. 1 charges every primitive separately.
+    int intersection_block = static_cast<int>(sphere_soa::lanes);
+};
+
+struct bvh_build_stats {
+    double sah_cost = 0.0;
+    double build_ms = 0.0;
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    int depth = 0;
+};
+
+// Accepts "sah" or "median"
+bool parse_bvh_build_method(const std::string& name, bvh_build_method& method);
+std::ostream& operator<<(std::ostream& out, const bvh_build_stats& stats);
+
+class bvh : public hittable {
 public:
-    bvh_node(const hittable_list& list);
-    // This constructor is for building the BVH
-    bvh_node(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end);
+    // Size of the traversal stack, and so the deepest tree traversal supports
+    static constexpr int max_depth = 64;
+    // Rays traversed together by hit_batch; larger batches are split into packets this size
+    static constexpr int max_packet_size = 16;
+
+    bvh(const hittable_list& list, const bvh_build_options& options = {});
+    // A mesh's BLAS, built over the indices of its triangles
+    bvh(std::shared_ptr<const triangle_mesh> mesh, const bvh_build_options& options = {});
     // This constructor is for deserialization
-    bvh_node(std::shared_ptr<hittable> left, std::shared_ptr<hittable> right, aabb bbox);
+    bvh(std::vector<primitive> primitives, std::vector<bvh_node> nodes);
 
-    bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override;
+    bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const override;
+    void hit_batch(const ray* rays, int count, real ray_tmin, real ray_tmax,
+                   hit_record* recs, bool* hits) const override;
     aabb bounding_box() const override;
 
-    std::shared_ptr<hittable> left_child() const { return left; }
-    std::shared_ptr<hittable> right_child() const { return right; }
+    const std::vector<bvh_node>& nodes() const { return _nodes; }
+    // Empty for a mesh's BLAS
+    const std::vector<primitive>& primitives() const { return _store->primitives(); }
+    // Leaf primitives in SoA form; shared with the wide BVHs collapsed from this tree
+    const std::shared_ptr<const primitive_store>& store() const { return _store; }
+    const bvh_build_stats& stats() const { return _stats; }
+    // The options the tree was built with; the defaults for a deserialized tree
+    const bvh_build_options& build_options() const { return _options; }
 
 private:
-    std::shared_ptr<hittable> left;
-    std::shared_ptr<hittable> right;
-    aabb bbox;
+    void compute_stats(const bvh_build_options& options);
+    void group_leaves(std::vector<primitive>& primitives) const;
+    void hit_packet(const ray* rays, int count, real ray_tmin, real ray_tmax,
+                    hit_record* recs, bool* hits) const;
+
+    std::shared_ptr<const primitive_store> _store;
+    std::vector<bvh_node> _nodes;
+    bvh_build_options _options;
+    bvh_build_stats _stats;
 };
 
 #endif
@@ -3,7 +3,7 @@
 
 #include "ray.hpp"
 #include "vec3.hpp"
-#include "../third_party/pcg_random_helper.hpp"
+#include "sampler.hpp"
 
 class camera {
 public:
@@ -17,10 +17,11 @@ public:
         int image_height
     );
 
-    ray get_ray(int i, int j, pcg32& rng) const;
+    // A ray through pixel (i, j), jittered within the pixel by the stream's first two dimensions
+    ray get_ray(int i, int j, sample_stream& samples) const;
 
 private:
-    vec3 pixel_sample_square(pcg32& rng) const;
+    vec3 pixel_sample_square(sample_stream& samples) const;
 
     // configuration (scene-level)
     point3 position;
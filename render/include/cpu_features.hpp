@@ -0,0 +1,28 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RT_X86 1
+#if defined(__GNUC__)
+// Kernels marked RT_TARGET_AVX2 are compiled for AVX2 whatever the global flags are, and
+// must only be called after cpu_supports_avx2() returned true.
+#define RT_HAVE_AVX2_KERNELS 1
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Whether the running CPU can execute the AVX2 kernels. Always false when they were not
+// compiled in (non-x86 targets or compilers without target attributes).
+inline bool cpu_supports_avx2() {
+#if defined(RT_HAVE_AVX2_KERNELS)
+    static const bool supported = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+#endif
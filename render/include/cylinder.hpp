@@ -3,26 +3,52 @@
 
 #include "hittable.hpp"
 #include "vec3.hpp"
+#include <cstdint>
 #include <memory>
 
-class cylinder : public hittable {
+class cylinder {
 public:
-    cylinder(const point3& p1, const point3& p2, double radius, std::shared_ptr<material> mat)
-        : _p1(p1), _p2(p2), _radius(radius), _mat(mat) {}
+    cylinder(const point3& p1, const point3& p2, real radius, std::shared_ptr<material> mat)
+        : _p1(p1), _p2(p2), _radius(radius), _mat(mat),
+          _axis(unit_vector(p2 - p1)), _length((p2 - p1).length()), _radius2(radius * radius) {}
 
-    bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override;
-    
-    aabb bounding_box() const override;
+    bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const;
+
+    // The parts of a capped cylinder a ray can hit
+    enum class part : uint8_t { none, body, bottom, top };
+
+    // Distances at which a ray meets the body (both roots) and the bottom (p1) and top caps,
+    // infinity where it misses a part. They don't depend on the ray's interval, so the SoA
+    // kernel computes them for a block of cylinders at once and picks with closest().
+    struct crossings {
+        real body_near, body_far, bottom, top;
+    };
+    static crossings intersect(const point3& p1, const vec3& axis, real length, real radius2, const ray& r);
+
+    // The closest crossing in (ray_tmin, ray_tmax), stored in t
+    static part closest(const crossings& x, real ray_tmin, real ray_tmax, real& t);
+
+    // Outward unit normal at point p on the given part
+    static vec3 outward_normal(part hit_part, const point3& p1, const vec3& axis, real radius, const point3& p);
+
+    aabb bounding_box() const;
 
     point3 p1() const { return _p1; }
     point3 p2() const { return _p2; }
-    double radius() const { return _radius; }
-    std::shared_ptr<material> get_material() const { return _mat; }
+    real radius() const { return _radius; }
+    const vec3& axis() const { return _axis; }
+    real length() const { return _length; }
+    real radius2() const { return _radius2; }
+    const std::shared_ptr<material>& get_material() const { return _mat; }
 
 private:
     point3 _p1, _p2;
-    double _radius;
+    real _radius;
     std::shared_ptr<material> _mat;
+    // precomputed for intersection
+    vec3 _axis; // unit, p1 towards p2
+    real _length;
+    real _radius2;
 };
 
 #endif
@@ -12,8 +12,8 @@ class hit_record {
   public:
     point3 p;
     vec3 normal;
-    std::shared_ptr<material> mat;
-    double t;
+    const material* mat = nullptr; // owned by the primitives, which outlive every hit_record
+    real t;
     bool front_face;
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
@@ -27,7 +27,17 @@ class hittable {
   public:
     virtual ~hittable() = default;
 
-    virtual bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const = 0;
+    virtual bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const = 0;
+
+    // Closest hits of `count` rays: hits[i] tells whether recs[i] was filled. Acceleration
+    // structures override this to traverse the rays together; by default they are traced
+    // one at a time.
+    virtual void hit_batch(const ray* rays, int count, real ray_tmin, real ray_tmax,
+                           hit_record* recs, bool* hits) const {
+        for (int i = 0; i < count; ++i) {
+            hits[i] = hit(rays[i], ray_tmin, ray_tmax, recs[i]);
+        }
+    }
     
     virtual aabb bounding_box() const = 0;
 };
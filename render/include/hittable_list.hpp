@@ -2,23 +2,24 @@
 #define HITTABLE_LIST_H
 
 #include "hittable.hpp"
+#include "primitive.hpp"
 #include <vector>
-#include <memory>
 
+// The primitives of a scene, tested one after the other. Acceleration structures are built
+// from one.
 class hittable_list : public hittable {
   public:
-    std::vector<std::shared_ptr<hittable>> objects;
+    std::vector<primitive> objects;
 
     hittable_list() {}
-    hittable_list(std::shared_ptr<hittable> object) { add(object); }
 
     void clear() { objects.clear(); }
 
-    void add(std::shared_ptr<hittable> object) {
+    void add(const primitive& object) {
         objects.push_back(object);
     }
 
-    bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override;
+    bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const override;
     
     aabb bounding_box() const override;
 };
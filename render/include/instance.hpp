@@ -0,0 +1,50 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.hpp"
+#include "transform.hpp"
+#include "triangle_mesh.hpp"
+#include <memory>
+
+class bvh;
+struct bvh_build_options;
+
+// An object placed in the scene by an affine transform. An object is a bottom-level BVH
+// (BLAS) over its own primitives, built once in the object's space and shared by all of its
+// instances; the top-level BVH over the scene holds the instances. A ray is moved into object
+// space instead of the primitives into the world. The direction is mapped without
+// renormalising, so hit distances are the same in both spaces.
+class instance {
+  public:
+    // `blas` is the object's BVH and object_to_world must be invertible
+    instance(std::shared_ptr<const bvh> blas, const transform& object_to_world);
+    // An instance of a whole mesh, whose BLAS must be build_blas(mesh); serialization sends
+    // such a BLAS as the mesh's buffers
+    instance(std::shared_ptr<const triangle_mesh> mesh, std::shared_ptr<const bvh> blas,
+             const transform& object_to_world);
+
+    // A BVH over the indices of the triangles of `mesh`, which it shares rather than copies
+    static std::shared_ptr<const bvh> build_blas(const std::shared_ptr<const triangle_mesh>& mesh,
+                                                 const bvh_build_options& options);
+
+    bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const;
+    aabb bounding_box() const { return _data->world_box; }
+
+    const std::shared_ptr<const bvh>& blas() const { return _data->blas; }
+    // The mesh the BLAS was built from, or null for other objects
+    const std::shared_ptr<const triangle_mesh>& mesh() const { return _data->mesh; }
+    const transform& object_to_world() const { return _data->object_to_world; }
+
+  private:
+    // behind a pointer so primitive stays small
+    struct data {
+        std::shared_ptr<const bvh> blas;
+        std::shared_ptr<const triangle_mesh> mesh;
+        transform object_to_world;
+        transform world_to_object;
+        aabb world_box;
+    };
+    std::shared_ptr<const data> _data;
+};
+
+#endif
@@ -3,23 +3,25 @@
 
 #include <limits>
 
+#include "precision.hpp"
+
 class interval {
   public:
-    double min, max;
+    real min, max;
 
-    interval() : min(+std::numeric_limits<double>::infinity()), max(-std::numeric_limits<double>::infinity()) {} // Default interval is empty
+    interval() : min(+std::numeric_limits<real>::infinity()), max(-std::numeric_limits<real>::infinity()) {} // Default interval is empty
 
-    interval(double min, double max) : min(min), max(max) {}
+    interval(real min, real max) : min(min), max(max) {}
 
-    bool contains(double x) const {
+    bool contains(real x) const {
         return min <= x && x <= max;
     }
 
-    bool surrounds(double x) const {
+    bool surrounds(real x) const {
         return min < x && x < max;
     }
 
-    double clamp(double x) const {
+    real clamp(real x) const {
         if (x < min) return min;
         if (x > max) return max;
         return x;
@@ -28,7 +30,7 @@ class interval {
     static const interval empty, universe;
 };
 
-const inline interval interval::empty    = interval(+std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity());
-const inline interval interval::universe = interval(-std::numeric_limits<double>::infinity(), +std::numeric_limits<double>::infinity());
+const inline interval interval::empty    = interval(+std::numeric_limits<real>::infinity(), -std::numeric_limits<real>::infinity());
+const inline interval interval::universe = interval(-std::numeric_limits<real>::infinity(), +std::numeric_limits<real>::infinity());
 
 #endif
\ No newline at end of file
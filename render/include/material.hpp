@@ -1,60 +1,89 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <cstdint>
+#include <variant>
+
 #include "ray.hpp"
 #include "hittable.hpp"
 #include "color.hpp"
+#include "sampler.hpp"
 
-class material {
-  public:
-    virtual ~material() = default;
-
-    virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng
-    ) const = 0;
-
-    virtual color emitted(const hit_record&) const { return color(0, 0, 0); }
-};
+// The material types. scatter() takes the ray that hit, whose direction must be unit length,
+// and draws its random decisions from samples, at most sample_stream::roulette_dimension
+// dimensions of them.
 
-class lambertian : public material {
+class lambertian {
   public:
     lambertian(const color& albedo) : _albedo(albedo) {}
-    bool scatter(const ray&, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng) const override;
+    bool scatter(const ray&, const hit_record& rec, color& attenuation, ray& scattered, sample_stream& samples) const;
     color albedo() const { return _albedo; }
   private:
     color _albedo;
 };
 
-class metal : public material {
+class metal {
   public:
-    metal(const color& albedo, double fuzz) : _albedo(albedo), _fuzz(fuzz < 1 ? fuzz : 1) {}
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng) const override;
+    metal(const color& albedo, real fuzz) : _albedo(albedo), _fuzz(fuzz < 1 ? fuzz : 1) {}
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sample_stream& samples) const;
     color albedo() const { return _albedo; }
-    double fuzz() const { return _fuzz; }
+    real fuzz() const { return _fuzz; }
   private:
     color _albedo;
-    double _fuzz;
+    real _fuzz;
 };
 
-class dielectric : public material {
+class dielectric {
   public:
-    dielectric(double refractive_index) : _ir(refractive_index) {}
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng) const override;
-    double ir() const { return _ir; }
+    dielectric(real refractive_index) : _ir(refractive_index) {}
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sample_stream& samples) const;
+    real ir() const { return _ir; }
   private:
-    double _ir; // Index of Refraction
-    static double reflectance(double cosine, double ref_idx);
+    real _ir; // Index of Refraction
+    static real reflectance(real cosine, real ref_idx);
 };
 
-class diffuse_light : public material {
+class diffuse_light {
   public:
     diffuse_light(const color& emit_color) : _emit(emit_color) {}
-    bool scatter(const ray&, const hit_record&, color&, ray&, pcg32&) const override {
+    color emit() const { return _emit; }
+  private:
+    color _emit;
+};
+
+// One of the material types above. The set is closed, so a material is stored by value and
+// dispatched with a switch on its kind instead of a virtual call per hit.
+class material {
+  public:
+    enum class kind : uint8_t { lambertian, metal, dielectric, diffuse_light };
+
+    material(const lambertian& m) : _impl(m) {}
+    material(const metal& m) : _impl(m) {}
+    material(const dielectric& m) : _impl(m) {}
+    material(const diffuse_light& m) : _impl(m) {}
+
+    kind type() const { return static_cast<kind>(_impl.index()); }
+    // The material as type T, which must be its type()
+    template <class T>
+    const T& as() const { return *std::get_if<T>(&_impl); }
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sample_stream& samples) const {
+        switch (type()) {
+            case kind::lambertian: return as<lambertian>().scatter(r_in, rec, attenuation, scattered, samples);
+            case kind::metal: return as<metal>().scatter(r_in, rec, attenuation, scattered, samples);
+            case kind::dielectric: return as<dielectric>().scatter(r_in, rec, attenuation, scattered, samples);
+            case kind::diffuse_light: break;
+        }
         return false;
     }
-    color emitted(const hit_record&) const override { return _emit; }
+
+    color emitted(const hit_record&) const {
+        return type() == kind::diffuse_light ? as<diffuse_light>().emit() : color(0, 0, 0);
+    }
+
   private:
-    color _emit;
+    // alternatives in the order of kind
+    std::variant<lambertian, metal, dielectric, diffuse_light> _impl;
 };
 
 #endif
@@ -3,9 +3,33 @@
 
 
 #include <cmath>
+#include <utility>
+
+#include "vec3.hpp"
 
 inline double degrees_to_radians(double degrees) {
     return degrees * M_PI / 180.0;
 }
 
-#endif
\ No newline at end of file
+// Distances t at which |oc + t d| equals the radius whose square is radius2: where a ray
+// meets a sphere centred oc behind its origin, or, with both vectors projected across the
+// axis, an infinite cylinder. The discriminant comes from the ray's distance to the centre
+// and the near root from the stable quadratic formula, so neither loses precision to
+// cancellation on large radii (such as a ground plane) or in single precision. Every sphere
+// and cylinder kernel uses it, so they all pick the same roots.
+inline bool solve_radius_quadratic(const vec3& oc, const vec3& d, real radius2, real& near_root, real& far_root) {
+    const real a = d.length_squared();
+    const real half_b = dot(oc, d);
+    const vec3 l = oc - (half_b / a) * d;
+    const real discriminant = a * (radius2 - l.length_squared());
+    if (discriminant < 0) return false;
+    const real c = oc.length_squared() - radius2;
+    const real q = -half_b - std::copysign(std::sqrt(discriminant), half_b);
+    if (q == 0) return false; // grazing the centre's closest point at the origin
+    near_root = c / q;
+    far_root = q / a;
+    if (near_root > far_root) std::swap(near_root, far_root);
+    return true;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+#include <limits>
+
+// Floating point type of the geometry and shading math (vec3, rays, hit distances and
+// primitive data). Double by default; configuring with -DRAYTRACER_SINGLE_PRECISION=ON
+// switches it to float, which halves the memory traffic of rays, hit records and leaf
+// data and doubles the lanes of the sphere kernel. Sampling, statistics and build costs
+// stay in double either way.
+#if defined(RAYTRACER_SINGLE_PRECISION)
+using real = float;
+#else
+using real = double;
+#endif
+
+// How far a ray leaving a surface starts off it, relative to the magnitude of the hit point
+// (see offset_ray_origin). Rounding of hit points grows with both, so a scale relative to
+// the precision keeps float and double builds equally free of self-intersection.
+constexpr real ray_offset_scale = 1024 * std::numeric_limits<real>::epsilon();
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef PRIMITIVE_H
+#define PRIMITIVE_H
+
+#include <cstdint>
+#include <memory>
+#include <variant>
+
+#include "cylinder.hpp"
+#include "instance.hpp"
+#include "sphere.hpp"
+
+// A scene primitive. The set of shapes is closed, so primitives are stored by value and
+// dispatched with a switch on their kind instead of virtual calls. Mesh triangles are not
+// primitives: meshes enter the scene through instances of their bottom-level BVHs.
+class primitive {
+  public:
+    enum class kind : uint8_t { sphere, cylinder, instance };
+
+    primitive(const sphere& s) : _shape(s) {}
+    primitive(const cylinder& c) : _shape(c) {}
+    primitive(const instance& i) : _shape(i) {}
+
+    kind type() const { return static_cast<kind>(_shape.index()); }
+    // The shape as type T, which must be its type()
+    template <class T>
+    const T& as() const { return *std::get_if<T>(&_shape); }
+
+    bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const {
+        switch (type()) {
+            case kind::sphere: return as<sphere>().hit(r, ray_tmin, ray_tmax, rec);
+            case kind::cylinder: return as<cylinder>().hit(r, ray_tmin, ray_tmax, rec);
+            case kind::instance: return as<instance>().hit(r, ray_tmin, ray_tmax, rec);
+        }
+        return false;
+    }
+
+    aabb bounding_box() const {
+        switch (type()) {
+            case kind::sphere: return as<sphere>().bounding_box();
+            case kind::cylinder: return as<cylinder>().bounding_box();
+            case kind::instance: return as<instance>().bounding_box();
+        }
+        return aabb();
+    }
+
+    // Null for instances, whose objects may have any number of materials
+    const std::shared_ptr<material>& get_material() const {
+        static const std::shared_ptr<material> none;
+        switch (type()) {
+            case kind::sphere: return as<sphere>().get_material();
+            case kind::cylinder: return as<cylinder>().get_material();
+            case kind::instance: break;
+        }
+        return none;
+    }
+
+  private:
+    // alternatives in the order of kind
+    std::variant<sphere, cylinder, instance> _shape;
+};
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef PRIMITIVE_STORE_H
+#define PRIMITIVE_STORE_H
+
+#include "hittable.hpp"
+#include "primitive.hpp"
+#include <vector>
+#include <memory>
+#include <bit>
+#include <cstdint>
+
+class material;
+struct bvh_node;
+
+// Spheres stored in blocks of `lanes` (one 256-bit register of reals: 4 doubles or 8
+// floats), each block structure-of-arrays, so one vector instruction tests a whole block
+// and a block's data spans only a few cache lines.
+// Every leaf starts a new block; unused lanes at the end of a leaf's last block are padding.
+class sphere_soa {
+  public:
+    static constexpr uint32_t lanes = 32 / sizeof(real);
+
+    struct alignas(32) block {
+        real cx[lanes];
+        real cy[lanes];
+        real cz[lanes];
+        real radius2[lanes];
+    };
+
+    // Starts a new block for the next leaf and returns its index
+    uint32_t begin_leaf();
+    void add(const sphere& s);
+
+    // Tests the `count` spheres starting at block `first_block` and updates rec and
+    // closest_so_far on a closer hit
+    bool hit(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const;
+
+  private:
+    bool hit_scalar(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far, uint32_t& best, real& best_t) const;
+    bool hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far, uint32_t& best, real& best_t) const;
+
+    std::vector<block> blocks;
+    // per lane, only needed once the closest hit is known; the materials are owned by the
+    // primitives in primitive_store
+    std::vector<real> radius;
+    std::vector<const material*> mat;
+    uint32_t slots = 0; // lanes used or skipped so far
+    bool simd = false;  // whether the CPU supports the vector kernel, checked once
+};
+
+// Cylinders in blocks of `lanes` like sphere_soa, each lane holding what cylinder::intersect
+// needs: the bottom centre, unit axis, length and squared radius.
+class cylinder_soa {
+  public:
+    static constexpr uint32_t lanes = 32 / sizeof(real);
+
+    struct alignas(32) block {
+        real p1x[lanes];
+        real p1y[lanes];
+        real p1z[lanes];
+        real ax[lanes];
+        real ay[lanes];
+        real az[lanes];
+        real length[lanes];
+        real radius2[lanes];
+    };
+
+    // Starts a new block for the next leaf and returns its index
+    uint32_t begin_leaf();
+    void add(const cylinder& c);
+
+    // Tests the `count` cylinders starting at block `first_block` and updates rec and
+    // closest_so_far on a closer hit
+    bool hit(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const;
+
+  private:
+    bool hit_scalar(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                    uint32_t& best, real& best_t, cylinder::part& best_part) const;
+    bool hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                  uint32_t& best, real& best_t, cylinder::part& best_part) const;
+
+    std::vector<block> blocks;
+    // per lane, only needed once the closest hit is known
+    std::vector<real> radius;
+    std::vector<const material*> mat;
+    uint32_t slots = 0;
+    bool simd = false;
+};
+
+// Triangles of one mesh in blocks of `lanes` like sphere_soa, each lane holding the first
+// corner and the two edges from it that triangle::intersect takes. The corners are copied out
+// of the mesh buffers so a block is tested without gathering vertices. Every triangle has the
+// mesh's material.
+class triangle_soa {
+  public:
+    static constexpr uint32_t lanes = 32 / sizeof(real);
+
+    explicit triangle_soa(const material* mat = nullptr) : mat(mat) {}
+
+    struct alignas(32) block {
+        real v0x[lanes];
+        real v0y[lanes];
+        real v0z[lanes];
+        real e1x[lanes];
+        real e1y[lanes];
+        real e1z[lanes];
+        real e2x[lanes];
+        real e2y[lanes];
+        real e2z[lanes];
+    };
+
+    // Starts a new block for the next leaf and returns its index
+    uint32_t begin_leaf();
+    // Adds triangle t of mesh
+    void add(const triangle_mesh& mesh, uint32_t t);
+
+    // Tests the `count` triangles starting at block `first_block` and updates rec and
+    // closest_so_far on a closer hit
+    bool hit(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const;
+
+  private:
+    bool hit_scalar(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                    uint32_t& best, real& best_t) const;
+    bool hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                  uint32_t& best, real& best_t) const;
+
+    std::vector<block> blocks;
+    const material* mat; // owned by the mesh
+    uint32_t slots = 0;
+    bool simd = false;
+};
+
+// What the leaves of a BVH hold. Either scene primitives in BVH order, with the spheres and
+// cylinders of every leaf copied into per-type SoA arrays and instances tested in place, or
+// the triangles of one mesh, copied into triangle_soa. Within each leaf the primitives must
+// be grouped by kind in the order of primitive::kind (see type_rank).
+class primitive_store {
+  public:
+    primitive_store(std::vector<primitive> primitives, const std::vector<bvh_node>& nodes);
+    // A mesh's BLAS, whose leaves index `triangles`: the indices of the mesh's triangles in
+    // BVH order. Only the SoA copies are kept.
+    primitive_store(std::shared_ptr<const triangle_mesh> mesh, const std::vector<uint32_t>& triangles,
+                    const std::vector<bvh_node>& nodes);
+
+    // Sort key for grouping a leaf: the primitive's kind
+    static int type_rank(const primitive& object) { return static_cast<int>(object.type()); }
+
+    // Tests the leaf whose primitives (or triangles) are [offset, offset + count)
+    bool hit(uint32_t offset, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const;
+
+    // Empty for a mesh's BLAS
+    const std::vector<primitive>& primitives() const { return _primitives; }
+
+  private:
+    // Where a leaf's primitives live in the SoA arrays
+    struct leaf_ranges {
+        uint32_t sphere_block;
+        uint32_t cylinder_block;
+        uint32_t triangle_block;
+        uint16_t spheres;
+        uint16_t cylinders;
+        uint16_t triangles;
+        uint16_t instances; // the last primitives of the leaf
+    };
+
+    // One bit per primitive, set where a leaf starts, 64 to a word, with the count of bits
+    // set in the words before it
+    struct leaf_start_word {
+        uint64_t bits;
+        uint32_t before;
+    };
+
+    // Sizes _leaves and _leaf_starts for the leaves of `nodes`, over `count` primitives
+    void index_leaves(size_t count, const std::vector<bvh_node>& nodes);
+    // Index into _leaves of the leaf starting at primitive `offset`
+    uint32_t leaf_index(uint32_t offset) const {
+        const leaf_start_word& word = _leaf_starts[offset / 64];
+        return word.before + static_cast<uint32_t>(std::popcount(word.bits & ((uint64_t{1} << (offset % 64)) - 1)));
+    }
+
+    std::vector<primitive> _primitives;
+    std::vector<leaf_ranges> _leaves; // one per leaf, by first primitive
+    std::vector<leaf_start_word> _leaf_starts;
+    std::shared_ptr<const triangle_mesh> _mesh; // owns the triangles' material
+    sphere_soa _spheres;
+    cylinder_soa _cylinders;
+    triangle_soa _triangles;
+};
+
+// Inline so BVH traversal reaches the type kernels without extra calls
+inline bool primitive_store::hit(uint32_t offset, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const {
+    const leaf_ranges& leaf = _leaves[leaf_index(offset)];
+    bool hit_anything = false;
+
+    if (leaf.spheres > 0) {
+        hit_anything |= _spheres.hit(leaf.sphere_block, leaf.spheres, r, ray_tmin, closest_so_far, rec);
+    }
+    if (leaf.cylinders > 0) {
+        hit_anything |= _cylinders.hit(leaf.cylinder_block, leaf.cylinders, r, ray_tmin, closest_so_far, rec);
+    }
+    if (leaf.triangles > 0) {
+        hit_anything |= _triangles.hit(leaf.triangle_block, leaf.triangles, r, ray_tmin, closest_so_far, rec);
+    }
+    for (uint32_t i = offset + count - leaf.instances; i < offset + count; ++i) {
+        if (_primitives[i].as<instance>().hit(r, ray_tmin, closest_so_far, rec)) {
+            closest_so_far = rec.t;
+            hit_anything = true;
+        }
+    }
+    return hit_anything;
+}
+
+#endif
@@ -3,6 +3,9 @@
 
 #include "vec3.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 class ray {
   public:
     ray() {}
@@ -11,11 +14,44 @@ class ray {
 
     const point3& origin() const  { return orig; }
     const vec3& direction() const { return dir; }
-    point3 at(double t) const { return orig + t*dir; }
+    point3 at(real t) const { return orig + t*dir; }
 
   private:
     point3 orig;
     vec3 dir;
 };
 
+// Moves the origin of a ray leaving a surface at p off the surface, along the normal to the
+// side `direction` points to, by ray_offset_scale times the point's largest coordinate (at
+// least 1). The rounding error of a computed hit point grows with its magnitude, so this
+// keeps the new ray from hitting the surface it starts on again without the fixed minimum
+// hit distance that used to skip nearby geometry and scaled badly with the scene.
+inline point3 offset_ray_origin(const point3& p, const vec3& normal, const vec3& direction) {
+    const real magnitude = std::max({std::fabs(p.x()), std::fabs(p.y()), std::fabs(p.z()), real(1)});
+    const vec3 offset = (ray_offset_scale * magnitude) * normal;
+    return dot(direction, normal) >= 0 ? p + offset : p - offset;
+}
+
+// A ray prepared for box tests: the reciprocal direction and the direction signs are
+// computed once per ray instead of once per box. The sign comes from the sign bit, so a
+// -0 component is negative just like its reciprocal (-inf).
+class traversal_ray {
+  public:
+    traversal_ray() {}
+
+    explicit traversal_ray(const ray& r)
+      : orig(r.origin()),
+        inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z()),
+        neg{std::signbit(r.direction().x()), std::signbit(r.direction().y()), std::signbit(r.direction().z())} {}
+
+    const point3& origin() const { return orig; }
+    const vec3& inv_direction() const { return inv_dir; }
+    bool dir_is_neg(int axis) const { return neg[axis]; }
+
+  private:
+    point3 orig;
+    vec3 inv_dir;
+    bool neg[3];
+};
+
 #endif
\ No newline at end of file
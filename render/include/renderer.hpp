@@ -2,27 +2,90 @@
 
 #include <vector>
 #include <cstdint>
+#include <iosfwd>
+#include <string>
 
 #include "camera.hpp"
 #include "color.hpp"
 #include "hittable.hpp"
-#include "../third_party/pcg_random_helper.hpp"
+#include "sampler.hpp"
+
+// How the wavefront integrator intersects and shades the paths in flight
+enum class trace_mode {
+    single, // one ray at a time, in path order
+    packet, // through hittable::hit_batch in packets, so camera rays of a pixel share traversal
+    stream  // sorted by direction before intersection and by material before shading
+};
+
+// Accepts "single", "packet" or "stream"
+bool parse_trace_mode(const std::string& name, trace_mode& mode);
+
+struct render_options {
+    static constexpr int max_packet_size = 16;
+
+    trace_mode mode = trace_mode::single;
+    // Rays handed to hittable::hit_batch at once in packet and stream mode
+    int packet_size = 8;
+    // Bounces after which paths are terminated by Russian roulette on their throughput;
+    // 0 keeps every path until it misses, is absorbed or reaches max_depth
+    int roulette_depth = 0;
+    // Adaptive sampling stops sampling a pixel once the standard error of its gamma corrected
+    // luminance (0 to 1) drops below this and spends the samples saved on noisier pixels of
+    // the same row; 0 gives every pixel exactly samples_per_pixel samples
+    double noise_threshold = 0.0;
+    // Where the camera, materials and roulette take their random numbers from
+    sampler_kind sampler = sampler_kind::independent;
+    // Draw a progress bar on std::clog while rendering a tile
+    bool show_progress = true;
+};
+
+struct render_stats {
+    uint64_t primary_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t roulette_kills = 0; // paths ended by Russian roulette
+    uint64_t samples = 0;        // camera samples taken, which adaptive sampling varies per pixel
+    double seconds = 0.0;
+
+    uint64_t rays() const { return primary_rays + secondary_rays; }
+    double rays_per_second() const { return seconds > 0.0 ? rays() / seconds : 0.0; }
+};
+
+std::ostream& operator<<(std::ostream& out, const render_stats& stats);
 
 class renderer {
 public:
-    renderer(const camera& cam, const hittable& world);
+    renderer(const camera& cam, const hittable& world, const render_options& options = {});
 
+    // When stats is given it receives the rays traced and the time taken. Every sample draws
+    // its random numbers from its own sample_stream, chosen by seed, the pixel's image
+    // coordinates, first_sample and the sample's index within the call, so the result does
+    // not depend on the tile layout, the thread count or the trace mode. The exception is the
+    // tile layout when noise_threshold > 0: adaptive sampling shares its budget over each row
+    // of the tile and clips its noise estimates at the tile's edges.
     std::vector<color> render_tile(
         int x0, int y0,
         int tile_width, int tile_height,
         int samples_per_pixel,
         int max_depth,
-        uint64_t seed
+        uint64_t seed,
+        render_stats* stats = nullptr,
+        int first_sample = 0
     ) const;
 
 private:
-    color ray_color(const ray& r, int depth, pcg32& rng) const;
+    struct path_states;
+    struct row_context;
+
+    void render_row(row_context& row, path_states& paths) const;
+    void trace_round(row_context& row, path_states& paths) const;
+    // Wavefront stages, each applied to every path in flight
+    void generate(row_context& row, path_states& paths) const;
+    void extend(row_context& row, path_states& paths) const;
+    void shade(row_context& row, path_states& paths) const;
+    void terminate(row_context& row, path_states& paths) const;
+
     void print_progress(int current_scanline, int total_scanlines) const;
     const camera& cam;
     const hittable& world;
+    render_options options;
 };
@@ -0,0 +1,81 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "../third_party/pcg_random_helper.hpp"
+
+// How the samples of a pixel are spread over the unit hypercube of its random decisions
+enum class sampler_kind {
+    independent, // uniform random numbers, the same for every dimension
+    stratified,  // jittered: each dimension (pair) split into one stratum per sample
+    sobol,       // Owen-scrambled Sobol points, scrambled per pixel
+    blue_noise   // one Owen-scrambled Sobol sequence for the whole image, shifted per pixel
+                 // by a blue-noise mask so neighbouring pixels make different errors
+};
+
+// Accepts "independent", "stratified", "sobol" or "bluenoise"
+bool parse_sampler_kind(const std::string& name, sampler_kind& kind);
+const char* sampler_kind_name(sampler_kind kind);
+
+class sampler;
+
+// The random numbers of one sample of one pixel, drawn one dimension after the other. The
+// camera uses the first camera_dimensions, then every bounce starts at a fixed dimension
+// (see start_bounce), so a dimension means the same decision in every sample of a pixel.
+struct sample_stream {
+    static constexpr uint32_t camera_dimensions = 2;
+    static constexpr uint32_t bounce_dimensions = 4;
+    static constexpr uint32_t roulette_dimension = 3; // within a bounce, after the material's
+
+    const sampler* source = nullptr;
+    int x = 0;                // pixel in image coordinates
+    int y = 0;
+    uint64_t pixel_seed = 0;  // differs per pixel and render
+    uint64_t image_seed = 0;  // shared by the pixels of a render
+    uint32_t index = 0;       // sample within the pixel
+    uint32_t dimension = 0;   // next dimension to draw
+    pcg32 rng;                // the sample's own stream, for independent numbers and jitter
+
+    sample_stream() = default;
+    sample_stream(const sampler& s, int x_, int y_, uint64_t pixel_seed_, uint64_t image_seed_, uint32_t index_)
+        : source(&s), x(x_), y(y_), pixel_seed(pixel_seed_), image_seed(image_seed_), index(index_),
+          rng(pixel_seed_, index_) {}
+
+    double next_1d();
+    void next_2d(double& u, double& v);
+
+    void start_bounce(int bounce, uint32_t offset = 0) {
+        dimension = camera_dimensions + static_cast<uint32_t>(bounce) * bounce_dimensions + offset;
+    }
+};
+
+// Maps (pixel, sample index, dimension) to numbers in [0, 1). Implementations are immutable
+// and shared by every thread of a render; all per-sample state lives in sample_stream.
+class sampler {
+  public:
+    virtual ~sampler() = default;
+
+    virtual double get_1d(sample_stream& s, uint32_t dimension) const = 0;
+    // Two dimensions drawn together, which lets the low-discrepancy samplers stratify them
+    // jointly (pixel position, scatter direction)
+    virtual void get_2d(sample_stream& s, uint32_t dimension, double& u, double& v) const = 0;
+};
+
+// samples_per_pixel sets the number of strata of the stratified sampler
+std::unique_ptr<sampler> make_sampler(sampler_kind kind, int samples_per_pixel);
+
+inline double sample_stream::next_1d() {
+    const double u = source->get_1d(*this, dimension);
+    dimension += 1;
+    return u;
+}
+
+inline void sample_stream::next_2d(double& u, double& v) {
+    source->get_2d(*this, dimension, u, v);
+    dimension += 2;
+}
+
+#endif
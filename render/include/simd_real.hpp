@@ -0,0 +1,59 @@
+#ifndef SIMD_REAL_H
+#define SIMD_REAL_H
+
+#include "cpu_features.hpp"
+#include "precision.hpp"
+
+#if defined(RT_HAVE_AVX2_KERNELS)
+#include <immintrin.h>
+
+// The 256-bit operations the AVX2 kernels are written with, on 4 doubles or 8 floats
+// depending on `real`. Only callable from RT_TARGET_AVX2 functions.
+namespace simd {
+
+constexpr int lanes = 32 / sizeof(real);
+
+#if defined(RAYTRACER_SINGLE_PRECISION)
+using vreal = __m256;
+RT_TARGET_AVX2 inline vreal vset1(real x) { return _mm256_set1_ps(x); }
+RT_TARGET_AVX2 inline vreal vload(const real* p) { return _mm256_load_ps(p); }
+RT_TARGET_AVX2 inline void vstore(real* p, vreal x) { _mm256_store_ps(p, x); }
+RT_TARGET_AVX2 inline vreal vadd(vreal x, vreal y) { return _mm256_add_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vsub(vreal x, vreal y) { return _mm256_sub_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vmul(vreal x, vreal y) { return _mm256_mul_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vdiv(vreal x, vreal y) { return _mm256_div_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vsqrt(vreal x) { return _mm256_sqrt_ps(x); }
+RT_TARGET_AVX2 inline vreal vmin(vreal x, vreal y) { return _mm256_min_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vand(vreal x, vreal y) { return _mm256_and_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vandnot(vreal x, vreal y) { return _mm256_andnot_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vor(vreal x, vreal y) { return _mm256_or_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vxor(vreal x, vreal y) { return _mm256_xor_ps(x, y); }
+RT_TARGET_AVX2 inline vreal vblend(vreal x, vreal y, vreal mask) { return _mm256_blendv_ps(x, y, mask); }
+template <int predicate>
+RT_TARGET_AVX2 inline vreal vcmp(vreal x, vreal y) { return _mm256_cmp_ps(x, y, predicate); }
+RT_TARGET_AVX2 inline int vmovemask(vreal x) { return _mm256_movemask_ps(x); }
+#else
+using vreal = __m256d;
+RT_TARGET_AVX2 inline vreal vset1(real x) { return _mm256_set1_pd(x); }
+RT_TARGET_AVX2 inline vreal vload(const real* p) { return _mm256_load_pd(p); }
+RT_TARGET_AVX2 inline void vstore(real* p, vreal x) { _mm256_store_pd(p, x); }
+RT_TARGET_AVX2 inline vreal vadd(vreal x, vreal y) { return _mm256_add_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vsub(vreal x, vreal y) { return _mm256_sub_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vmul(vreal x, vreal y) { return _mm256_mul_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vdiv(vreal x, vreal y) { return _mm256_div_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vsqrt(vreal x) { return _mm256_sqrt_pd(x); }
+RT_TARGET_AVX2 inline vreal vmin(vreal x, vreal y) { return _mm256_min_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vand(vreal x, vreal y) { return _mm256_and_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vandnot(vreal x, vreal y) { return _mm256_andnot_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vor(vreal x, vreal y) { return _mm256_or_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vxor(vreal x, vreal y) { return _mm256_xor_pd(x, y); }
+RT_TARGET_AVX2 inline vreal vblend(vreal x, vreal y, vreal mask) { return _mm256_blendv_pd(x, y, mask); }
+template <int predicate>
+RT_TARGET_AVX2 inline vreal vcmp(vreal x, vreal y) { return _mm256_cmp_pd(x, y, predicate); }
+RT_TARGET_AVX2 inline int vmovemask(vreal x) { return _mm256_movemask_pd(x); }
+#endif
+
+}
+#endif
+
+#endif
@@ -7,22 +7,22 @@
 #include <cmath>
 #include <memory>
 
-class sphere : public hittable {
+class sphere {
   public:
-    sphere(const point3& center, double radius, std::shared_ptr<material> mat)
+    sphere(const point3& center, real radius, std::shared_ptr<material> mat)
       : center(center), radius(std::fmax(0,radius)), mat(mat) {}
 
-    bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override;
+    bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const;
 
-    aabb bounding_box() const override;
+    aabb bounding_box() const;
 
     const point3& center_point() const { return center; }
-    double radius_value() const { return radius; }
-    std::shared_ptr<material> get_material() const { return mat; }
+    real radius_value() const { return radius; }
+    const std::shared_ptr<material>& get_material() const { return mat; }
 
   private:
     point3 center;
-    double radius;
+    real radius;
     std::shared_ptr<material> mat;
 };
 
@@ -0,0 +1,39 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.hpp"
+#include "vec3.hpp"
+
+// An affine map p -> M p + t, stored as the 3x4 matrix [M | t]. Instances keep one from
+// object to world space and its inverse.
+class transform {
+  public:
+    // The identity
+    transform();
+
+    static transform translate(const vec3& offset);
+    static transform scale(const vec3& factors);
+    // By `degrees` about `axis` through the origin, counter-clockwise seen from the axis tip
+    static transform rotate(const vec3& axis, double degrees);
+
+    // This map followed by `next`
+    transform then(const transform& next) const;
+    // False, leaving out unchanged, when the linear part is singular
+    bool inverse(transform& out) const;
+
+    point3 point(const point3& p) const;
+    vec3 vector(const vec3& v) const;
+    // M^T v; the inverse's transposed linear part maps normals from object to world space
+    vec3 transposed_vector(const vec3& v) const;
+    // A box enclosing the image of `box`
+    aabb box(const aabb& box) const;
+
+    // Entry (row, column) of [M | t]
+    real operator()(int row, int column) const { return m[row][column]; }
+    real& operator()(int row, int column) { return m[row][column]; }
+
+  private:
+    real m[3][4];
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef TRIANGLE_H
+#define TRIANGLE_H
+
+#include "hittable.hpp"
+#include "triangle_mesh.hpp"
+#include "vec3.hpp"
+#include <cstdint>
+
+// Tests and bounds for the triangles of a triangle_mesh. A triangle is not a primitive of
+// its own: the mesh's bottom-level BVH refers to its triangles by index and the scene places
+// the mesh with instances of that BVH.
+class triangle {
+public:
+    // Möller-Trumbore test of the triangle with corner v0 and edges e1 = v1 - v0 and
+    // e2 = v2 - v0, shared with the SoA leaf kernel. Needs no epsilon: a ray in the
+    // triangle's plane makes the barycentrics infinite or NaN, which the tests reject.
+    static bool intersect(const point3& v0, const vec3& e1, const vec3& e2, const ray& r,
+                          real ray_tmin, real ray_tmax, real& t);
+
+    // Unit geometric normal, facing the side the corners wind counter-clockwise around
+    static vec3 outward_normal(const vec3& e1, const vec3& e2) { return unit_vector(cross(e1, e2)); }
+
+    // Bounds of triangle t of mesh
+    static aabb bounding_box(const triangle_mesh& mesh, uint32_t t);
+};
+
+#endif
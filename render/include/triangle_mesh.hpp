@@ -0,0 +1,49 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "vec3.hpp"
+
+class material;
+
+// Vertex and index buffers of a triangle mesh, shared by its triangles and every instance of
+// it. Positions are single precision whatever `real` is (x, y, z per vertex) and each
+// triangle is three vertex indices, so a triangle costs 12 bytes plus its share of vertices.
+class triangle_mesh {
+  public:
+    // Every index must be below positions.size() / 3 (see indices_in_range)
+    triangle_mesh(std::vector<float> positions, std::vector<uint32_t> indices, std::shared_ptr<material> mat)
+        : _positions(std::move(positions)), _indices(std::move(indices)), _mat(std::move(mat)) {}
+
+    uint32_t vertex_count() const { return static_cast<uint32_t>(_positions.size() / 3); }
+    uint32_t triangle_count() const { return static_cast<uint32_t>(_indices.size() / 3); }
+
+    point3 vertex(uint32_t v) const {
+        return point3(_positions[3 * v], _positions[3 * v + 1], _positions[3 * v + 2]);
+    }
+    // Corner k (0, 1 or 2) of triangle t
+    point3 corner(uint32_t t, int k) const { return vertex(_indices[3 * t + k]); }
+
+    const std::vector<float>& positions() const { return _positions; }
+    const std::vector<uint32_t>& indices() const { return _indices; }
+    const std::shared_ptr<material>& get_material() const { return _mat; }
+
+    static bool indices_in_range(const std::vector<float>& positions, const std::vector<uint32_t>& indices) {
+        const size_t vertices = positions.size() / 3;
+        for (uint32_t i : indices) {
+            if (i >= vertices) return false;
+        }
+        return true;
+    }
+
+  private:
+    std::vector<float> _positions;
+    std::vector<uint32_t> _indices;
+    std::shared_ptr<material> _mat;
+};
+
+#endif
@@ -1,24 +1,26 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include "precision.hpp"
 #include "../third_party/pcg_random_helper.hpp"
 
 class vec3 {
   public:
-    double e[3];
+    real e[3];
 
     vec3() : e{0,0,0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    real x() const { return e[0]; }
+    real y() const { return e[1]; }
+    real z() const { return e[2]; }
 
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    real operator[](int i) const { return e[i]; }
+    real& operator[](int i) { return e[i]; }
 
     vec3& operator+=(const vec3& v) {
         e[0] += v.e[0];
@@ -27,26 +29,26 @@ class vec3 {
         return *this;
     }
 
-    vec3& operator*=(double t) {
+    vec3& operator*=(real t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    vec3& operator/=(double t) {
+    vec3& operator/=(real t) {
         return *this *= 1/t;
     }
 
-    double length() const {
+    real length() const {
         return std::sqrt(length_squared());
     }
 
-    double length_squared() const {
+    real length_squared() const {
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
     }
 
-    inline static vec3 random(double min, double max, pcg32& rng) {
+    inline static vec3 random(real min, real max, pcg32& rng) {
         return vec3(nextDouble(rng, min, max), nextDouble(rng, min, max), nextDouble(rng, min, max));
     }
 };
@@ -71,19 +73,19 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
+inline vec3 operator*(real t, const vec3& v) {
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t) {
+inline vec3 operator/(const vec3& v, real t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
+inline real dot(const vec3& u, const vec3& v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
@@ -99,16 +101,18 @@ inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_sphere(pcg32& rng) {
-    while (true) {
-        auto p = vec3::random(-1, 1, rng);
-        if (p.length_squared() < 1)
-            return p;
-    }
+// Maps three uniform numbers in [0, 1) to a uniformly distributed point inside the unit
+// sphere: (u1, u2) pick the direction and u3 the radius, so stratified inputs stay stratified.
+inline vec3 sample_in_unit_sphere(real u1, real u2, real u3) {
+    real z = 1 - 2 * u1;
+    real r = std::sqrt(std::max(real(0), 1 - z*z));
+    real phi = 2 * real(M_PI) * u2;
+    real radius = std::cbrt(u3);
+    return radius * vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
-inline vec3 random_in_hemisphere(const vec3& normal, pcg32& rng) {
-    vec3 in_unit_sphere = random_in_unit_sphere(rng);
+inline vec3 sample_in_hemisphere(const vec3& normal, real u1, real u2, real u3) {
+    vec3 in_unit_sphere = sample_in_unit_sphere(u1, u2, u3);
     if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -125,10 +129,10 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
+    auto cos_theta = std::fmin(dot(-uv, n), real(1));
     vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);
-    vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
@@ -0,0 +1,42 @@
+#ifndef VEC3_BUNDLE_H
+#define VEC3_BUNDLE_H
+
+#include "vec3.hpp"
+
+// Eight vec3s structure-of-arrays, for applying the same vector math to many rays or
+// samples at once. The kernels below run on AVX2 when the CPU has it (one register per
+// component in float builds, two in double builds) and otherwise lane by lane through the
+// scalar vec3 functions. Both compute every lane with the same operations in the same order
+// as the scalar functions, so their results are bit-identical to them (unless the compiler
+// is allowed to contract multiplies and adds into FMAs, e.g. with -march=native).
+struct alignas(32) vec3_bundle {
+    static constexpr int width = 8;
+
+    real x[width];
+    real y[width];
+    real z[width];
+
+    vec3 get(int lane) const { return vec3(x[lane], y[lane], z[lane]); }
+    void set(int lane, const vec3& v) {
+        x[lane] = v.x();
+        y[lane] = v.y();
+        z[lane] = v.z();
+    }
+};
+
+// One real per lane of a bundle
+struct alignas(32) real_bundle {
+    real v[vec3_bundle::width];
+
+    real operator[](int lane) const { return v[lane]; }
+    real& operator[](int lane) { return v[lane]; }
+};
+
+// Lane-wise versions of the vec3 functions of the same name. Outputs may alias inputs.
+void dot(const vec3_bundle& u, const vec3_bundle& v, real_bundle& out);
+void cross(const vec3_bundle& u, const vec3_bundle& v, vec3_bundle& out);
+void unit_vector(const vec3_bundle& v, vec3_bundle& out);
+void reflect(const vec3_bundle& v, const vec3_bundle& n, vec3_bundle& out);
+void refract(const vec3_bundle& uv, const vec3_bundle& n, const real_bundle& etai_over_etat, vec3_bundle& out);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "bvh.hpp"
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+// Node of an N-wide BVH. Child bounds are stored structure-of-arrays (one row of N floats
+// per plane) so a single SIMD slab test covers every child. Unused slots carry inverted
+// bounds and never test as hit.
+template <int N>
+struct alignas(32) wide_bvh_node {
+    float bounds_min[3][N];
+    float bounds_max[3][N];
+    uint32_t child[N];           // interior child: node index, leaf child: first primitive
+    uint16_t primitive_count[N]; // primitives in a leaf child, 0 for an interior child
+};
+
+// BVH4 / BVH8 collapsed from a binary bvh. Leaves and primitive order are shared with the
+// binary tree; only the interior levels are merged.
+template <int N>
+class wide_bvh : public hittable {
+    static_assert(N == 4 || N == 8, "wide_bvh supports 4 and 8 children");
+
+public:
+    explicit wide_bvh(const bvh& binary);
+
+    bool hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const override;
+    aabb bounding_box() const override;
+
+    const std::vector<wide_bvh_node<N>>& nodes() const { return _nodes; }
+    // Name of the slab test kernel traversal dispatches to ("sse", "avx2" or "scalar")
+    const char* kernel_name() const;
+
+private:
+    uint32_t collapse(const bvh& binary, uint32_t binary_index);
+
+    std::shared_ptr<const primitive_store> _store;
+    std::vector<wide_bvh_node<N>> _nodes;
+    aabb _bbox;
+    bool _simd = false; // whether the CPU supports the vector kernel, checked once
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+
+// Returns `binary` itself for width 2, or a BVH4 / BVH8 collapsed from it.
+// Returns nullptr for any other width.
+std::shared_ptr<hittable> make_wide_bvh(const std::shared_ptr<bvh>& binary, int width);
+
+#endif
@@ -0,0 +1,834 @@
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "../third_party/pcg_random_helper.hpp"
+#include "cpu_features.hpp"
+#include "material.hpp"
+#include "sampler.hpp"
+#include "vec3_bundle.hpp"
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+namespace {
+
+using bench_clock = std::chrono::steady_clock;
+
+double elapsed_ns(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+int threads() {
+#if defined(_OPENMP)
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Camera rays through random pixels, the same distribution the renderer starts from.
+std::vector<ray> primary_rays(const benchmark_context& ctx, uint64_t seed) {
+    pcg32 rng(seed);
+    const auto independent = make_sampler(sampler_kind::independent, 1);
+    std::vector<ray> rays;
+    rays.reserve(ctx.ray_count);
+    for (int n = 0; n < ctx.ray_count; ++n) {
+        int i = static_cast<int>(rng(static_cast<uint32_t>(ctx.image_width)));
+        int j = static_cast<int>(rng(static_cast<uint32_t>(ctx.image_height)));
+        sample_stream samples(*independent, i, j, seed, seed, static_cast<uint32_t>(n));
+        rays.push_back(ctx.cam.get_ray(i, j, samples));
+    }
+    return rays;
+}
+
+// The slab test the BVH used before traversal_ray: one reciprocal per axis per box,
+// computed from a float literal, with a branch per axis.
+bool reference_slab_hit(const aabb& box, const ray& r, interval ray_t) {
+    for (int a = 0; a < 3; ++a) {
+        auto invD = 1.0f / r.direction()[a];
+        auto t0 = (box.min()[a] - r.origin()[a]) * invD;
+        auto t1 = (box.max()[a] - r.origin()[a]) * invD;
+
+        if (invD < 0.0f) {
+            std::swap(t0, t1);
+        }
+
+        if (t0 > ray_t.min) ray_t.min = t0;
+        if (t1 < ray_t.max) ray_t.max = t1;
+
+        if (ray_t.max <= ray_t.min) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// bvh::hit as it was before traversal_ray, for a like-for-like traversal comparison. When
+// hit_materials is given, the material of every closer primitive hit is appended to it.
+bool reference_traverse(const bvh& accel, const ray& r, real ray_tmin, real ray_tmax, hit_record& rec,
+                        std::vector<const material*>* hit_materials = nullptr) {
+    const auto& nodes = accel.nodes();
+    if (nodes.empty()) return false;
+
+    uint32_t stack[bvh::max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+    bool hit_anything = false;
+    real closest_so_far = ray_tmax;
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        if (reference_slab_hit(node.bounds(), r, interval(ray_tmin, closest_so_far))) {
+            if (node.is_leaf()) {
+                for (uint32_t i = 0; i < node.primitive_count; ++i) {
+                    if (accel.primitives()[node.offset + i].hit(r, ray_tmin, closest_so_far, rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                        if (hit_materials) hit_materials->push_back(rec.mat);
+                    }
+                }
+            } else {
+                if (r.direction()[node.axis] < 0) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+    return hit_anything;
+}
+
+// cylinder::intersect as it was before cylinders kept their unit axis, length and squared
+// radius: the axis normalised again at every use, a naive quadratic and its own cap tests.
+bool reference_cylinder_hit(const point3& p1, const point3& p2, real radius, const ray& r, real ray_tmin,
+                            real ray_tmax, real& t) {
+    constexpr real infinity = std::numeric_limits<real>::infinity();
+    vec3 ro = r.origin();
+    vec3 rd = r.direction();
+    vec3 ba = p2 - p1;
+    vec3 oc = ro - p1;
+
+    real a = dot(rd, rd) - dot(rd, unit_vector(ba)) * dot(rd, unit_vector(ba));
+    real b = 2.0 * (dot(rd, oc) - dot(rd, unit_vector(ba)) * dot(oc, unit_vector(ba)));
+    real c = dot(oc, oc) - dot(oc, unit_vector(ba)) * dot(oc, unit_vector(ba)) - radius*radius;
+
+    real t0_body = infinity, t1_body = infinity;
+    real discriminant = b*b - 4*a*c;
+    if (discriminant >= 0) {
+        real sqrt_discriminant = std::sqrt(discriminant);
+        t0_body = (-b - sqrt_discriminant) / (2*a);
+        t1_body = (-b + sqrt_discriminant) / (2*a);
+        if (t0_body > t1_body) std::swap(t0_body, t1_body);
+    }
+
+    real t_final = infinity;
+    if (t0_body > ray_tmin && t0_body < ray_tmax) {
+        real height = dot(r.at(t0_body) - p1, unit_vector(ba));
+        if (height >= 0.0 && height <= ba.length()) t_final = t0_body;
+    }
+    if (t1_body > ray_tmin && t1_body < ray_tmax && t1_body < t_final) {
+        real height = dot(r.at(t1_body) - p1, unit_vector(ba));
+        if (height >= 0.0 && height <= ba.length()) t_final = t1_body;
+    }
+
+    real denom1 = dot(rd, -unit_vector(ba));
+    if (std::fabs(denom1) > 1e-8) {
+        real t_cap1 = dot(p1 - ro, -unit_vector(ba)) / denom1;
+        if (t_cap1 > ray_tmin && t_cap1 < ray_tmax && t_cap1 < t_final &&
+            (r.at(t_cap1) - p1).length_squared() <= radius*radius) {
+            t_final = t_cap1;
+        }
+    }
+    real denom2 = dot(rd, unit_vector(ba));
+    if (std::fabs(denom2) > 1e-8) {
+        real t_cap2 = dot(p2 - ro, unit_vector(ba)) / denom2;
+        if (t_cap2 > ray_tmin && t_cap2 < ray_tmax && t_cap2 < t_final &&
+            (r.at(t_cap2) - p2).length_squared() <= radius*radius) {
+            t_final = t_cap2;
+        }
+    }
+
+    if (t_final == infinity) return false;
+    t = t_final;
+    return true;
+}
+
+// Tests every ray against every BVH node box with each slab test variant, then runs
+// full closest-hit traversal with the reference and current tests.
+void bench_slab(const benchmark_context& ctx, std::ostream& out) {
+    const auto rays = primary_rays(ctx, 1);
+    // the all-pairs part uses the top of the tree only, so huge scenes stay quick
+    constexpr size_t max_boxes = 4096;
+    const auto& all_nodes = ctx.accel.nodes();
+    const std::vector<bvh_node> nodes(all_nodes.begin(), all_nodes.begin() + std::min(all_nodes.size(), max_boxes));
+    std::vector<aabb> boxes;
+    boxes.reserve(nodes.size());
+    for (const auto& node : nodes) {
+        boxes.push_back(node.bounds());
+    }
+
+    const real tmin = 0.005;
+    const real tmax = std::numeric_limits<real>::infinity();
+    const double tests = static_cast<double>(rays.size()) * static_cast<double>(boxes.size());
+
+    auto report = [&](const char* label, double ns, size_t hits) {
+        out << "  " << label << ": " << ns / tests << " ns/box, "
+            << ns / rays.size() << " ns/ray, " << hits << " hits\n";
+    };
+
+    out << "slab: " << rays.size() << " rays x " << boxes.size() << " boxes\n";
+
+    size_t hits = 0;
+    auto start = bench_clock::now();
+    for (const auto& r : rays) {
+        for (const auto& box : boxes) {
+            hits += reference_slab_hit(box, r, interval(tmin, tmax));
+        }
+    }
+    report("per-box reciprocal (reference)", elapsed_ns(start), hits);
+
+    hits = 0;
+    start = bench_clock::now();
+    for (const auto& r : rays) {
+        const traversal_ray tr(r);
+        for (const auto& box : boxes) {
+            hits += box.hit(tr, interval(tmin, tmax));
+        }
+    }
+    report("aabb + traversal_ray", elapsed_ns(start), hits);
+
+    hits = 0;
+    start = bench_clock::now();
+    for (const auto& r : rays) {
+        const traversal_ray tr(r);
+        for (const auto& node : nodes) {
+            hits += node.hit(tr, tmin, tmax);
+        }
+    }
+    report("bvh_node + traversal_ray", elapsed_ns(start), hits);
+
+    hit_record rec;
+    auto report_traversal = [&](const char* label, double ns, size_t hits) {
+        out << "  " << label << ": " << ns / rays.size() << " ns/ray, " << hits << " hits\n";
+    };
+
+    hits = 0;
+    start = bench_clock::now();
+    for (const auto& r : rays) {
+        hits += reference_traverse(ctx.accel, r, tmin, tmax, rec);
+    }
+    report_traversal("binary traversal, reference slab", elapsed_ns(start), hits);
+
+    hits = 0;
+    start = bench_clock::now();
+    for (const auto& r : rays) {
+        hits += ctx.accel.hit(r, tmin, tmax, rec);
+    }
+    report_traversal("binary traversal, traversal_ray", elapsed_ns(start), hits);
+
+    if (&ctx.world != &ctx.accel) {
+        hits = 0;
+        start = bench_clock::now();
+        for (const auto& r : rays) {
+            hits += ctx.world.hit(r, tmin, tmax, rec);
+        }
+        report_traversal("wide traversal", elapsed_ns(start), hits);
+    }
+}
+
+// Tests every ray against the primitives of every leaf, once through primitive::hit of each
+// primitive and once through the SoA leaf kernels.
+void bench_leaf(const benchmark_context& ctx, std::ostream& out) {
+    const auto rays = primary_rays(ctx, 1);
+    constexpr size_t max_leaves = 4096;
+    std::vector<bvh_node> leaves;
+    size_t primitive_count = 0;
+    for (const auto& node : ctx.accel.nodes()) {
+        if (!node.is_leaf()) continue;
+        leaves.push_back(node);
+        primitive_count += node.primitive_count;
+        if (leaves.size() == max_leaves) break;
+    }
+
+    const real tmin = 0.005;
+    const real tmax = std::numeric_limits<real>::infinity();
+    const double tests = static_cast<double>(rays.size()) * static_cast<double>(primitive_count);
+    const auto& primitives = ctx.accel.primitives();
+    const primitive_store& store = *ctx.accel.store();
+    hit_record rec;
+
+    auto report = [&](const char* label, double ns, size_t hits) {
+        out << "  " << label << ": " << ns / tests << " ns/primitive, " << hits << " hits\n";
+    };
+
+    out << "leaf: " << rays.size() << " rays x " << leaves.size() << " leaves ("
+        << primitive_count << " primitives)\n";
+
+    size_t hits = 0;
+    auto start = bench_clock::now();
+    for (const auto& r : rays) {
+        for (const auto& leaf : leaves) {
+            real closest_so_far = tmax;
+            for (uint32_t i = 0; i < leaf.primitive_count; ++i) {
+                if (primitives[leaf.offset + i].hit(r, tmin, closest_so_far, rec)) {
+                    closest_so_far = rec.t;
+                    ++hits;
+                }
+            }
+        }
+    }
+    report("per primitive", elapsed_ns(start), hits);
+
+    hits = 0;
+    start = bench_clock::now();
+    for (const auto& r : rays) {
+        for (const auto& leaf : leaves) {
+            real closest_so_far = tmax;
+            hits += store.hit(leaf.offset, leaf.primitive_count, r, tmin, closest_so_far, rec);
+        }
+    }
+    report("SoA leaf kernels", elapsed_ns(start), hits);
+}
+
+// Traces the camera rays of a block of pixels, each pixel's samples one packet, one ray at a
+// time and through hit_batch with every packet size, and checks both find the same hits.
+void bench_packet(const benchmark_context& ctx, std::ostream& out) {
+    constexpr int samples = bvh::max_packet_size;
+    const int pixels = std::max(1, ctx.ray_count / samples);
+    pcg32 rng(1);
+    const auto independent = make_sampler(sampler_kind::independent, samples);
+    std::vector<ray> rays;
+    rays.reserve(static_cast<size_t>(pixels) * samples);
+    for (int p = 0; p < pixels; ++p) {
+        int i = static_cast<int>(rng(static_cast<uint32_t>(ctx.image_width)));
+        int j = static_cast<int>(rng(static_cast<uint32_t>(ctx.image_height)));
+        for (int s = 0; s < samples; ++s) {
+            sample_stream stream(*independent, i, j, static_cast<uint64_t>(p), 1, static_cast<uint32_t>(s));
+            rays.push_back(ctx.cam.get_ray(i, j, stream));
+        }
+    }
+
+    const real tmin = 0.005;
+    const real tmax = std::numeric_limits<real>::infinity();
+    std::vector<hit_record> reference(rays.size());
+    std::vector<char> reference_hit(rays.size());
+
+    out << "packet: " << pixels << " pixels x " << samples << " camera rays\n";
+
+    size_t hits = 0;
+    auto start = bench_clock::now();
+    for (size_t k = 0; k < rays.size(); ++k) {
+        reference_hit[k] = ctx.accel.hit(rays[k], tmin, tmax, reference[k]);
+        hits += reference_hit[k];
+    }
+    out << "  single rays: " << elapsed_ns(start) / rays.size() << " ns/ray, " << hits << " hits\n";
+
+    for (int size : {4, 8, 16}) {
+        std::vector<hit_record> recs(rays.size());
+        std::unique_ptr<bool[]> packet_hit(new bool[rays.size()]);
+        start = bench_clock::now();
+        for (size_t first = 0; first < rays.size(); first += size) {
+            ctx.accel.hit_batch(&rays[first], size, tmin, tmax, &recs[first], &packet_hit[first]);
+        }
+        const double ns = elapsed_ns(start);
+
+        hits = 0;
+        size_t mismatches = 0;
+        for (size_t k = 0; k < rays.size(); ++k) {
+            hits += packet_hit[k];
+            if (packet_hit[k] != static_cast<bool>(reference_hit[k]) || (packet_hit[k] && recs[k].t != reference[k].t)) {
+                ++mismatches;
+            }
+        }
+        out << "  packets of " << size << ": " << ns / rays.size() << " ns/ray, " << hits << " hits, "
+            << mismatches << " differ from single rays\n";
+    }
+}
+
+// Renders the central tile of the image in independent passes with and without Russian
+// roulette and compares the rays traced and the mean radiance of the passes.
+void bench_roulette(const benchmark_context& ctx, std::ostream& out) {
+    constexpr int passes = 8;
+    const int width = std::min(ctx.image_width, 64);
+    const int height = std::min(ctx.image_height, 64);
+    const int x0 = (ctx.image_width - width) / 2;
+    const int y0 = (ctx.image_height - height) / 2;
+    const int samples = std::max(1, ctx.ray_count / (width * height * passes));
+
+    render_options with = ctx.render;
+    if (with.roulette_depth == 0) {
+        with.roulette_depth = 4;
+    }
+    render_options without = ctx.render;
+    without.roulette_depth = 0;
+
+    out << "roulette: " << width << "x" << height << " tile, " << passes << " passes of " << samples
+        << " spp, max depth " << ctx.max_depth << "\n";
+
+    struct totals {
+        render_stats stats;
+        double mean = 0.0;
+        double standard_error = 0.0;
+    };
+    auto run = [&](const render_options& options) {
+        renderer rend(ctx.cam, ctx.world, options);
+        totals result;
+        std::vector<double> means;
+        for (int pass = 0; pass < passes; ++pass) {
+            render_stats stats;
+            std::vector<color> pixels = rend.render_tile(x0, y0, width, height, samples, ctx.max_depth,
+                                                         1000003ULL * static_cast<uint64_t>(pass), &stats);
+            double sum = 0.0;
+            for (const color& p : pixels) {
+                sum += (p.x() + p.y() + p.z()) / 3.0;
+            }
+            means.push_back(sum / pixels.size());
+            result.stats.primary_rays += stats.primary_rays;
+            result.stats.secondary_rays += stats.secondary_rays;
+            result.stats.roulette_kills += stats.roulette_kills;
+            result.stats.seconds += stats.seconds;
+        }
+        for (double m : means) result.mean += m / passes;
+        double variance = 0.0;
+        for (double m : means) variance += (m - result.mean) * (m - result.mean) / (passes - 1);
+        result.standard_error = std::sqrt(variance / passes);
+        return result;
+    };
+
+    const totals off = run(without);
+    const totals on = run(with);
+    for (const auto& [name, t] : {std::pair<const char*, const totals&>{"off", off}, {"on", on}}) {
+        out << "  roulette " << name << ": " << t.stats << "\n"
+            << "    mean radiance " << t.mean << " +- " << t.standard_error << "\n";
+    }
+    out << "  depth " << with.roulette_depth << " saves "
+        << 100.0 * (1.0 - static_cast<double>(on.stats.rays()) / off.stats.rays()) << " % of the rays, mean radiance differs by "
+        << (on.mean - off.mean) / std::sqrt(on.standard_error * on.standard_error + off.standard_error * off.standard_error)
+        << " standard errors\n";
+}
+
+// Renders the central 64x64 tile with every sampler at 1 to 64 spp and reports the RMSE of
+// the gamma corrected pixels against a 1024 spp reference, and the slope of log RMSE over
+// log spp (-0.5 for plain Monte Carlo).
+void bench_convergence(const benchmark_context& ctx, std::ostream& out) {
+    constexpr int max_samples = 64;
+    constexpr int reference_samples = 16 * max_samples;
+    const int width = std::min(ctx.image_width, 64);
+    const int height = std::min(ctx.image_height, 64);
+    const int x0 = (ctx.image_width - width) / 2;
+    const int y0 = (ctx.image_height - height) / 2;
+
+    render_options options = ctx.render;
+    options.noise_threshold = 0.0;
+    auto render = [&](sampler_kind kind, int samples, uint64_t seed) {
+        options.sampler = kind;
+        renderer rend(ctx.cam, ctx.world, options);
+        std::vector<color> pixels = rend.render_tile(x0, y0, width, height, samples, ctx.max_depth, seed);
+        // as write_color displays them
+        for (color& p : pixels) {
+            for (int c = 0; c < 3; ++c) {
+                p[c] = std::sqrt(std::clamp(p[c], real(0), real(1)));
+            }
+        }
+        return pixels;
+    };
+
+    out << "convergence: " << width << "x" << height << " tile, max depth " << ctx.max_depth
+        << ", RMSE against " << reference_samples << " spp (independent)\n";
+    const std::vector<color> reference = render(sampler_kind::independent, reference_samples, 0);
+
+    const sampler_kind kinds[] = {sampler_kind::independent, sampler_kind::stratified, sampler_kind::sobol, sampler_kind::blue_noise};
+    out << "  spp";
+    for (sampler_kind kind : kinds) {
+        out << "  " << std::setw(11) << sampler_kind_name(kind);
+    }
+    out << "\n";
+
+    std::vector<std::vector<double>> errors(std::size(kinds));
+    for (int samples = 1; samples <= max_samples; samples *= 2) {
+        out << "  " << std::setw(3) << samples;
+        for (size_t s = 0; s < std::size(kinds); ++s) {
+            const std::vector<color> pixels = render(kinds[s], samples, 1);
+            double sum = 0.0;
+            for (size_t p = 0; p < pixels.size(); ++p) {
+                sum += (pixels[p] - reference[p]).length_squared() / 3.0;
+            }
+            errors[s].push_back(std::sqrt(sum / pixels.size()));
+            out << "  " << std::setw(11) << std::setprecision(5) << errors[s].back();
+        }
+        out << "\n";
+    }
+
+    // least squares fit of log error against log spp
+    out << "  slope";
+    for (size_t s = 0; s < std::size(kinds); ++s) {
+        double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+        const double n = static_cast<double>(errors[s].size());
+        for (size_t k = 0; k < errors[s].size(); ++k) {
+            const double x = static_cast<double>(k) * std::log(2.0);
+            const double y = std::log(errors[s][k]);
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        out << "  " << std::setw(9) << std::setprecision(3) << (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    }
+    out << "\n";
+}
+
+}
+
+// Renders the central 64x64 tile at --bench-rays camera rays and reports the throughput of
+// this build's precision. With a reference path the tile's linear radiance is saved there
+// if the file does not exist, and otherwise compared against it: run a double build first
+// and a float build second to get the image error of single precision. Both builds draw
+// the same samples, so the difference is rounding alone: mostly paths that took another
+// branch somewhere (a different BVH leaf or dielectric choice), which only adds noise and
+// leaves the mean radiance unchanged.
+void bench_precision(const benchmark_context& ctx, std::ostream& out) {
+    const int width = std::min(ctx.image_width, 64);
+    const int height = std::min(ctx.image_height, 64);
+    const int x0 = (ctx.image_width - width) / 2;
+    const int y0 = (ctx.image_height - height) / 2;
+    const int samples = std::max(1, ctx.ray_count / (width * height));
+    const char* precision = sizeof(real) == sizeof(float) ? "float" : "double";
+
+    renderer rend(ctx.cam, ctx.world, ctx.render);
+    render_stats stats;
+    const std::vector<color> pixels = rend.render_tile(x0, y0, width, height, samples, ctx.max_depth, 0, &stats);
+    out << "precision: " << precision << " build (" << sphere_soa::lanes << " spheres per kernel block), " << width << "x"
+        << height << " tile, " << samples << " spp, max depth " << ctx.max_depth << "\n"
+        << "  " << stats << "\n";
+
+    if (ctx.reference_path.empty()) {
+        return;
+    }
+
+    std::ifstream in(ctx.reference_path);
+    if (!in) {
+        std::ofstream reference(ctx.reference_path);
+        reference << precision << " " << width << " " << height << " " << samples << "\n";
+        reference.precision(17);
+        for (const color& p : pixels) {
+            reference << p.x() << " " << p.y() << " " << p.z() << "\n";
+        }
+        out << "  wrote the " << precision << " tile to " << ctx.reference_path << "\n";
+        return;
+    }
+
+    std::string reference_precision;
+    int reference_width = 0, reference_height = 0, reference_samples = 0;
+    in >> reference_precision >> reference_width >> reference_height >> reference_samples;
+    if (reference_width != width || reference_height != height || reference_samples != samples) {
+        out << "  " << ctx.reference_path << " holds a " << reference_width << "x" << reference_height << " tile at "
+            << reference_samples << " spp; rerun with the same image size and --bench-rays\n";
+        return;
+    }
+    double squared = 0.0, largest = 0.0, energy = 0.0, sum = 0.0, reference_sum = 0.0;
+    size_t differing = 0;
+    for (const color& p : pixels) {
+        double r, g, b;
+        in >> r >> g >> b;
+        const double diff[3] = {p.x() - r, p.y() - g, p.z() - b};
+        double pixel_squared = 0.0;
+        for (double d : diff) {
+            pixel_squared += d * d;
+            largest = std::max(largest, std::fabs(d));
+        }
+        squared += pixel_squared;
+        energy += r * r + g * g + b * b;
+        sum += p.x() + p.y() + p.z();
+        reference_sum += r + g + b;
+        differing += pixel_squared > 0.0;
+    }
+    out << "  against the " << reference_precision << " tile in " << ctx.reference_path << ": RMSE "
+        << std::sqrt(squared / (3.0 * pixels.size())) << " (relative " << std::sqrt(squared / std::max(energy, 1e-300))
+        << "), largest channel difference " << largest << ", " << differing << " of " << pixels.size()
+        << " pixels differ, mean radiance " << sum / (3.0 * pixels.size()) << " vs " << reference_sum / (3.0 * pixels.size())
+        << "\n";
+}
+
+// Runs every vec3_bundle kernel over camera ray directions, random unit normals and
+// refraction ratios, and compares each lane with the scalar vec3 function, which it must
+// match bit for bit, then times both. Single-threaded.
+void bench_vec3(const benchmark_context& ctx, std::ostream& out) {
+    constexpr int width = vec3_bundle::width;
+    const std::vector<ray> rays = primary_rays(ctx, 17);
+    const size_t bundle_count = (rays.size() + width - 1) / width;
+    const size_t count = bundle_count * width;
+
+    std::vector<vec3> directions(count), unit_directions(count), normals(count);
+    std::vector<real> ratios(count);
+    pcg32 rng(23);
+    for (size_t k = 0; k < count; ++k) {
+        directions[k] = rays[k % rays.size()].direction();
+        unit_directions[k] = unit_vector(directions[k]);
+        vec3 n;
+        do {
+            n = sample_in_unit_sphere(nextDouble(rng), nextDouble(rng), nextDouble(rng));
+        } while (n.length_squared() < 1e-6);
+        normals[k] = unit_vector(n);
+        ratios[k] = nextDouble(rng) < 0.5 ? real(1 / 1.5) : real(1.5);
+    }
+
+    auto to_bundles = [&](const std::vector<vec3>& v) {
+        std::vector<vec3_bundle> bundles(bundle_count);
+        for (size_t k = 0; k < count; ++k) bundles[k / width].set(static_cast<int>(k % width), v[k]);
+        return bundles;
+    };
+    const std::vector<vec3_bundle> b_directions = to_bundles(directions);
+    const std::vector<vec3_bundle> b_unit_directions = to_bundles(unit_directions);
+    const std::vector<vec3_bundle> b_normals = to_bundles(normals);
+    std::vector<real_bundle> b_ratios(bundle_count);
+    for (size_t k = 0; k < count; ++k) b_ratios[k / width][static_cast<int>(k % width)] = ratios[k];
+
+    auto same = [](real a, real b) { return a == b || (std::isnan(a) && std::isnan(b)); };
+    auto same_vec = [&](const vec3& a, const vec3& b) { return same(a.x(), b.x()) && same(a.y(), b.y()) && same(a.z(), b.z()); };
+
+    out << "vec3: " << count << " vectors, " << (cpu_supports_avx2() ? "AVX2" : "scalar fallback") << " bundle kernels\n";
+    // scalar(k) gives lane k through vec3, bundle(b, out) bundle b into `out`
+    auto run = [&](const char* name, auto scalar, auto bundle) {
+        using result = decltype(scalar(size_t{0}));
+        std::vector<result> expected(count);
+        auto start = bench_clock::now();
+        for (size_t k = 0; k < count; ++k) expected[k] = scalar(k);
+        const double scalar_ns = elapsed_ns(start);
+
+        using bundle_result = std::conditional_t<std::is_same_v<result, vec3>, vec3_bundle, real_bundle>;
+        std::vector<bundle_result> actual(bundle_count);
+        start = bench_clock::now();
+        for (size_t b = 0; b < bundle_count; ++b) bundle(b, actual[b]);
+        const double bundle_ns = elapsed_ns(start);
+
+        size_t differing = 0;
+        for (size_t k = 0; k < count; ++k) {
+            const int lane = static_cast<int>(k % width);
+            if constexpr (std::is_same_v<result, vec3>) {
+                differing += !same_vec(actual[k / width].get(lane), expected[k]);
+            } else {
+                differing += !same(actual[k / width][lane], expected[k]);
+            }
+        }
+        out << "  " << std::left << std::setw(12) << name << std::right << " scalar " << std::setw(7) << scalar_ns / count
+            << " ns, bundle " << std::setw(7) << bundle_ns / count << " ns per vector, " << differing
+            << " lanes differ\n";
+    };
+
+    out << std::fixed << std::setprecision(2);
+    run("dot", [&](size_t k) { return dot(directions[k], normals[k]); },
+        [&](size_t b, real_bundle& r) { dot(b_directions[b], b_normals[b], r); });
+    run("cross", [&](size_t k) { return cross(directions[k], normals[k]); },
+        [&](size_t b, vec3_bundle& r) { cross(b_directions[b], b_normals[b], r); });
+    run("unit_vector", [&](size_t k) { return unit_vector(directions[k]); },
+        [&](size_t b, vec3_bundle& r) { unit_vector(b_directions[b], r); });
+    run("reflect", [&](size_t k) { return reflect(unit_directions[k], normals[k]); },
+        [&](size_t b, vec3_bundle& r) { reflect(b_unit_directions[b], b_normals[b], r); });
+    run("refract", [&](size_t k) { return refract(unit_directions[k], normals[k], ratios[k]); },
+        [&](size_t b, vec3_bundle& r) { refract(b_unit_directions[b], b_normals[b], b_ratios[b], r); });
+}
+
+// Adds the materials of `primitives`, and of the objects their instances place, to owners
+void collect_materials(const std::vector<primitive>& primitives,
+                       std::unordered_map<const material*, std::shared_ptr<material>>& owners,
+                       std::unordered_set<const bvh*>& visited_objects) {
+    for (const auto& object : primitives) {
+        if (object.type() != primitive::kind::instance) {
+            owners.emplace(object.get_material().get(), object.get_material());
+        } else if (visited_objects.insert(object.as<instance>().blas().get()).second) {
+            const instance& inst = object.as<instance>();
+            if (inst.mesh()) {
+                owners.emplace(inst.mesh()->get_material().get(), inst.mesh()->get_material());
+            }
+            collect_materials(inst.blas()->primitives(), owners, visited_objects);
+        }
+    }
+}
+
+// Measures the reference counting hit_record did while it held a shared_ptr<material>. The
+// reference traversal counts the closer primitive hits of every camera ray, each of which
+// copy-assigned the primitive's material (an atomic increment and decrement), plus one more
+// copy per hit ray out of hittable_list::hit. Those copies are then replayed on every thread
+// on the scene's own materials, whose counters most primitives share, and timed against the
+// raw pointer assignments that replaced them.
+void bench_refcount(const benchmark_context& ctx, std::ostream& out) {
+    const std::vector<ray> rays = primary_rays(ctx, 29);
+    const real tmin = 0;
+    const real tmax = std::numeric_limits<real>::infinity();
+
+    std::unordered_map<const material*, std::shared_ptr<material>> owners;
+    std::unordered_set<const bvh*> visited_objects;
+    collect_materials(ctx.accel.primitives(), owners, visited_objects);
+
+    // the closer hits of ray n are hit_materials[first[n], first[n + 1])
+    std::vector<const material*> hit_materials;
+    std::vector<size_t> first(rays.size() + 1, 0);
+    hit_record rec;
+    size_t hit_rays = 0;
+    for (size_t n = 0; n < rays.size(); ++n) {
+        hit_rays += reference_traverse(ctx.accel, rays[n], tmin, tmax, rec, &hit_materials);
+        first[n + 1] = hit_materials.size();
+    }
+    std::vector<const std::shared_ptr<material>*> hit_owners(hit_materials.size());
+    for (size_t i = 0; i < hit_materials.size(); ++i) {
+        hit_owners[i] = &owners.at(hit_materials[i]);
+    }
+    const size_t copies = hit_materials.size() + hit_rays;
+
+    const int ray_count = static_cast<int>(rays.size());
+    auto start = bench_clock::now();
+    size_t world_hits = 0;
+#pragma omp parallel for schedule(static) firstprivate(rec) reduction(+ : world_hits)
+    for (int n = 0; n < ray_count; ++n) {
+        world_hits += ctx.world.hit(rays[n], tmin, tmax, rec);
+    }
+    const double trace_ns = elapsed_ns(start);
+
+    struct shared_record {
+        std::shared_ptr<material> mat;
+    };
+    start = bench_clock::now();
+#pragma omp parallel for schedule(static)
+    for (int n = 0; n < ray_count; ++n) {
+        shared_record temp_rec, result;
+        for (size_t i = first[n]; i < first[n + 1]; ++i) temp_rec.mat = *hit_owners[i];
+        if (first[n + 1] > first[n]) result = temp_rec;
+    }
+    const double shared_ns = elapsed_ns(start);
+
+    size_t raw_hits = 0;
+    start = bench_clock::now();
+#pragma omp parallel for schedule(static) reduction(+ : raw_hits)
+    for (int n = 0; n < ray_count; ++n) {
+        const material* temp_mat = nullptr;
+        for (size_t i = first[n]; i < first[n + 1]; ++i) temp_mat = hit_materials[i];
+        raw_hits += temp_mat != nullptr;
+    }
+    const double raw_ns = elapsed_ns(start);
+
+    out << "refcount: " << rays.size() << " camera rays, " << owners.size() << " materials, " << threads()
+        << " threads\n"
+        << "  shared_ptr copies the old hit path made: " << copies << " (" << static_cast<double>(copies) / rays.size()
+        << " per ray), " << 2 * copies << " atomic read-modify-writes\n"
+        << "  replayed: shared_ptr " << shared_ns / rays.size() << " ns per ray, raw pointer " << raw_ns / rays.size()
+        << " ns per ray (" << raw_hits << " hit rays)\n"
+        << "  closest-hit traversal of the same rays: " << trace_ns / rays.size() << " ns per ray (" << world_hits
+        << " hits), so the reference counting added " << 100.0 * (shared_ns - raw_ns) / trace_ns << "%\n";
+}
+
+// Tests every camera ray against all of the scene's cylinders for the closest hit, with the
+// reference intersection, cylinder::hit and one cylinder_soa batch of all of them, and
+// compares the hits.
+void bench_cylinder(const benchmark_context& ctx, std::ostream& out) {
+    std::vector<const cylinder*> cylinders;
+    cylinder_soa batch;
+    const uint32_t first_block = batch.begin_leaf();
+    for (const auto& object : ctx.accel.primitives()) {
+        if (object.type() != primitive::kind::cylinder) continue;
+        cylinders.push_back(&object.as<cylinder>());
+        batch.add(object.as<cylinder>());
+    }
+    if (cylinders.empty()) {
+        out << "cylinder: the scene has no cylinders\n";
+        return;
+    }
+
+    const auto rays = primary_rays(ctx, 31);
+    const real tmin = 0.005;
+    const real tmax = std::numeric_limits<real>::infinity();
+    const double tests = static_cast<double>(rays.size()) * static_cast<double>(cylinders.size());
+    const auto count = static_cast<uint32_t>(cylinders.size());
+    std::vector<real> reference(rays.size(), tmax), scalar(rays.size(), tmax), soa(rays.size(), tmax);
+    hit_record rec;
+
+    auto report = [&](const char* label, double ns, const std::vector<real>& closest) {
+        const auto hits = std::count_if(closest.begin(), closest.end(), [&](real t) { return t < tmax; });
+        out << "  " << label << ": " << ns / tests << " ns/intersection, " << hits << " hits\n";
+    };
+
+    out << "cylinder: " << rays.size() << " rays x " << cylinders.size() << " cylinders\n";
+
+    auto start = bench_clock::now();
+    for (size_t k = 0; k < rays.size(); ++k) {
+        for (const cylinder* c : cylinders) {
+            real t;
+            if (reference_cylinder_hit(c->p1(), c->p2(), c->radius(), rays[k], tmin, reference[k], t)) {
+                reference[k] = t;
+            }
+        }
+    }
+    report("reference", elapsed_ns(start), reference);
+
+    start = bench_clock::now();
+    for (size_t k = 0; k < rays.size(); ++k) {
+        for (const cylinder* c : cylinders) {
+            if (c->hit(rays[k], tmin, scalar[k], rec)) scalar[k] = rec.t;
+        }
+    }
+    report("cylinder::hit", elapsed_ns(start), scalar);
+
+    start = bench_clock::now();
+    for (size_t k = 0; k < rays.size(); ++k) {
+        batch.hit(first_block, count, rays[k], tmin, soa[k], rec);
+    }
+    report("SoA batch", elapsed_ns(start), soa);
+
+    size_t moved = 0, differ = 0;
+    for (size_t k = 0; k < rays.size(); ++k) {
+        const bool both = reference[k] < tmax && scalar[k] < tmax;
+        if ((reference[k] < tmax) != (scalar[k] < tmax) ||
+            (both && std::fabs(reference[k] - scalar[k]) > 1e-4 * std::fabs(reference[k]))) {
+            ++moved;
+        }
+        differ += soa[k] != scalar[k];
+    }
+    out << "  " << moved << " hits differ from the reference by more than 1e-4 relative, " << differ
+        << " SoA hits differ from cylinder::hit\n";
+}
+
+bool run_benchmark(const std::string& name, const benchmark_context& ctx, std::ostream& out) {
+    if (name == "slab") {
+        bench_slab(ctx, out);
+    } else if (name == "leaf") {
+        bench_leaf(ctx, out);
+    } else if (name == "packet") {
+        bench_packet(ctx, out);
+    } else if (name == "roulette") {
+        bench_roulette(ctx, out);
+    } else if (name == "convergence") {
+        bench_convergence(ctx, out);
+    } else if (name == "precision") {
+        bench_precision(ctx, out);
+    } else if (name == "vec3") {
+        bench_vec3(ctx, out);
+    } else if (name == "refcount") {
+        bench_refcount(ctx, out);
+    } else if (name == "cylinder") {
+        bench_cylinder(ctx, out);
+    } else {
+        return false;
+    }
+    return true;
+}
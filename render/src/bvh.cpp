@@ -1,79 +1,574 @@
 #include "bvh.hpp"
 
-#include <numeric>
-#include <random>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <ostream>
 
-static bool box_compare(const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b, int axis) {
-    return a->bounding_box().min()[axis] < b->bounding_box().min()[axis];
+#include "triangle.hpp"
+
+namespace {
+
+// Bounds and centroid of one primitive (or mesh triangle), computed once up front so the
+// builder never goes back to the primitives. Partitioning only moves these entries.
+struct build_entry {
+    aabb box;
+    point3 centroid;
+    uint32_t primitive;
+};
+
+// Intermediate binary tree produced by the (parallel) build and flattened afterwards.
+// Children are indices into the same array so nodes can be claimed with one atomic add.
+struct build_node {
+    aabb box;
+    uint32_t start;
+    uint32_t count;     // primitives in a leaf, 0 for interior nodes
+    uint32_t children[2];
+    uint32_t subtree_size;
+    uint8_t axis;
+};
+
+struct build_context {
+    const bvh_build_options& options;
+    std::vector<build_entry>& entries;
+    std::vector<build_node>& build_nodes;
+    std::atomic<uint32_t>& next_node;
+};
+
+// Below this depth the SAH builder hands over to median splits, which at most double the
+// remaining depth, so even degenerate inputs stay inside the traversal stack.
+constexpr int sah_depth_limit = bvh::max_depth / 2;
+
+// Subtrees smaller than this are built by the thread that reached them.
+constexpr size_t parallel_task_threshold = 4096;
+
+constexpr int max_sah_bins = 64;
+
+// Round outward so the single precision node bounds always enclose the primitive bounds.
+float round_down(double x) {
+    float f = static_cast<float>(x);
+    if (f > x) f = std::nextafter(f, -std::numeric_limits<float>::infinity());
+    return f;
+}
+
+float round_up(double x) {
+    float f = static_cast<float>(x);
+    if (f < x) f = std::nextafter(f, std::numeric_limits<float>::infinity());
+    return f;
+}
+
+void set_bounds(bvh_node& node, const aabb& box) {
+    for (int a = 0; a < 3; ++a) {
+        node.bounds_min[a] = round_down(box.min()[a]);
+        node.bounds_max[a] = round_up(box.max()[a]);
+    }
+}
+
+struct sah_split {
+    int axis = -1;     // -1 when no split separates the centroids
+    int bin = 0;       // entries in bins [0, bin] go left
+    double cost = std::numeric_limits<double>::infinity();
+};
+
+int sah_bin_count(const bvh_build_options& options) {
+    return std::clamp(options.sah_bins, 2, max_sah_bins);
+}
+
+// Primitives are charged per leaf-kernel block, so a partly filled block costs a full one
+double intersection_blocks(const bvh_build_options& options, size_t count) {
+    const size_t block = static_cast<size_t>(std::max(options.intersection_block, 1));
+    return static_cast<double>((count + block - 1) / block);
 }
 
-static auto box_compare_lambda(int axis) {
-    return [axis](const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b) {
-        return box_compare(a, b, axis);
+// Bins the centroids on every axis and returns the cheapest bin boundary.
+sah_split find_sah_split(const build_context& ctx, size_t start, size_t end, const aabb& bbox,
+                         const aabb& centroid_bounds) {
+    const int bin_count = sah_bin_count(ctx.options);
+    const double node_area = bbox.surface_area();
+
+    struct bin {
+        aabb box;
+        size_t count = 0;
     };
+    std::array<bin, max_sah_bins> bins;
+    std::array<double, max_sah_bins> right_area;
+    std::array<size_t, max_sah_bins> right_count;
+
+    sah_split best;
+    for (int axis = 0; axis < 3; ++axis) {
+        const double cmin = centroid_bounds.min()[axis];
+        const double extent = centroid_bounds.max()[axis] - cmin;
+        if (!(extent > 0.0)) continue;
+
+        std::fill(bins.begin(), bins.begin() + bin_count, bin{});
+        const double scale = bin_count / extent;
+        for (size_t i = start; i < end; ++i) {
+            int b = std::min(bin_count - 1, static_cast<int>((ctx.entries[i].centroid[axis] - cmin) * scale));
+            bins[b].box = bins[b].count ? aabb(bins[b].box, ctx.entries[i].box) : ctx.entries[i].box;
+            ++bins[b].count;
+        }
+
+        // sweep from the right to get the area and count of every right-hand side
+        aabb acc;
+        size_t acc_count = 0;
+        for (int b = bin_count - 1; b > 0; --b) {
+            if (bins[b].count) {
+                acc = acc_count ? aabb(acc, bins[b].box) : bins[b].box;
+                acc_count += bins[b].count;
+            }
+            right_area[b] = acc_count ? acc.surface_area() : 0.0;
+            right_count[b] = acc_count;
+        }
+
+        // then from the left, evaluating the split after each bin
+        acc_count = 0;
+        for (int b = 0; b < bin_count - 1; ++b) {
+            if (bins[b].count) {
+                acc = acc_count ? aabb(acc, bins[b].box) : bins[b].box;
+                acc_count += bins[b].count;
+            }
+            if (acc_count == 0 || right_count[b + 1] == 0) continue;
+
+            double cost = ctx.options.traversal_cost + ctx.options.intersection_cost *
+                (acc.surface_area() * intersection_blocks(ctx.options, acc_count) +
+                 right_area[b + 1] * intersection_blocks(ctx.options, right_count[b + 1])) / node_area;
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.bin = b;
+                best.cost = cost;
+            }
+        }
+    }
+
+    return best;
 }
 
-// private recursive constructor
-bvh_node::bvh_node(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end) {
+// Builds the subtree for entries [start, end) and returns its build node index. Large
+// subtrees build their left child as an OpenMP task while this thread takes the right.
+uint32_t build_recursive(const build_context& ctx, size_t start, size_t end, int depth) {
+    auto& entries = ctx.entries;
 
-    bbox = objects[start]->bounding_box();
+    aabb bbox = entries[start].box;
+    aabb centroid_bounds(entries[start].centroid, entries[start].centroid);
     for (size_t i = start + 1; i < end; ++i) {
-        bbox = aabb(bbox, objects[i]->bounding_box());
+        bbox = aabb(bbox, entries[i].box);
+        centroid_bounds = aabb(centroid_bounds, aabb(entries[i].centroid, entries[i].centroid));
     }
 
-    int axis = bbox.longest_axis();
-    auto comparator = box_compare_lambda(axis);
+    const uint32_t index = ctx.next_node.fetch_add(1, std::memory_order_relaxed);
+    build_node& node = ctx.build_nodes[index];
+    node.box = bbox;
+    node.start = static_cast<uint32_t>(start);
 
-    size_t object_count = end - start;
+    const size_t object_count = end - start;
+    const size_t max_leaf_size = static_cast<size_t>(ctx.options.max_leaf_size);
+    auto make_leaf = [&]() {
+        node.count = static_cast<uint32_t>(object_count);
+        node.subtree_size = 1;
+        node.axis = 0;
+        return index;
+    };
 
     if (object_count == 1) {
-        left = right = objects[start];
-    } else if (object_count == 2) {
-        if (comparator(objects[start], objects[start+1])) {
-            left = objects[start];
-            right = objects[start+1];
-        } else {
-            left = objects[start+1];
-            right = objects[start];
+        return make_leaf();
+    }
+
+    int axis = -1;
+    size_t mid = start;
+    if (ctx.options.method == bvh_build_method::sah && depth < sah_depth_limit) {
+        sah_split split = find_sah_split(ctx, start, end, bbox, centroid_bounds);
+        const double leaf_cost = ctx.options.intersection_cost * intersection_blocks(ctx.options, object_count);
+        if (object_count <= max_leaf_size && leaf_cost <= split.cost) {
+            return make_leaf();
         }
-    } else {
-        auto mid = start + object_count / 2;
+
+        if (split.axis >= 0) {
+            axis = split.axis;
+            const int bin_count = sah_bin_count(ctx.options);
+            const double cmin = centroid_bounds.min()[axis];
+            const double scale = bin_count / (centroid_bounds.max()[axis] - cmin);
+            auto it = std::partition(entries.begin() + start, entries.begin() + end,
+                [&](const build_entry& e) {
+                    int b = std::min(bin_count - 1, static_cast<int>((e.centroid[axis] - cmin) * scale));
+                    return b <= split.bin;
+                });
+            mid = static_cast<size_t>(it - entries.begin());
+        }
+    } else if (object_count <= max_leaf_size) {
+        return make_leaf();
+    }
+
+    // Median split, also the fallback when the SAH finds nothing to separate
+    if (mid == start || mid == end) {
+        axis = bbox.longest_axis();
+        mid = start + object_count / 2;
         // Partially sort the objects to find the median
-        std::nth_element(objects.begin() + start, objects.begin() + mid, objects.begin() + end, comparator);
-        
-        left = std::make_shared<bvh_node>(objects, start, mid);
-        right = std::make_shared<bvh_node>(objects, mid, end);
+        std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+            [axis](const build_entry& a, const build_entry& b) {
+                return a.box.min()[axis] < b.box.min()[axis];
+            });
+    }
+
+    // the two halves touch disjoint entry ranges, so they can be built concurrently
+    uint32_t left = 0;
+    #pragma omp task default(none) shared(ctx, left) firstprivate(start, mid, depth) if(mid - start > parallel_task_threshold)
+    left = build_recursive(ctx, start, mid, depth + 1);
+    uint32_t right = build_recursive(ctx, mid, end, depth + 1);
+    #pragma omp taskwait
+
+    node.count = 0;
+    node.children[0] = left;
+    node.children[1] = right;
+    node.subtree_size = 1 + ctx.build_nodes[left].subtree_size + ctx.build_nodes[right].subtree_size;
+    node.axis = static_cast<uint8_t>(axis);
+    return index;
+}
+
+// Writes the subtree rooted at build node `from` depth-first starting at nodes[to]. Subtree
+// sizes are known, so the second child's slot is too and both halves can be written at once.
+void flatten(const std::vector<build_node>& build_nodes, uint32_t from, uint32_t to, std::vector<bvh_node>& nodes) {
+    const build_node& node = build_nodes[from];
+    bvh_node& out = nodes[to];
+    set_bounds(out, node.box);
+    out.axis = node.axis;
+    out.pad = 0;
+
+    if (node.count > 0) {
+        out.offset = node.start;
+        out.primitive_count = static_cast<uint16_t>(node.count);
+        return;
+    }
+
+    const uint32_t first_child = node.children[0];
+    const uint32_t second = to + 1 + build_nodes[first_child].subtree_size;
+    out.offset = second;
+    out.primitive_count = 0;
+
+    #pragma omp task default(none) shared(build_nodes, nodes) firstprivate(first_child, to) if(node.subtree_size > parallel_task_threshold)
+    flatten(build_nodes, first_child, to + 1, nodes);
+    flatten(build_nodes, node.children[1], second, nodes);
+    #pragma omp taskwait
+}
+
+bvh_build_options clamped(const bvh_build_options& options) {
+    bvh_build_options opts = options;
+    opts.max_leaf_size = std::clamp(opts.max_leaf_size, 1, static_cast<int>(std::numeric_limits<uint16_t>::max()));
+    return opts;
+}
+
+// Builds the tree over `entries` (at least one) into nodes, leaving the entries in leaf order
+void build_tree(std::vector<build_entry>& entries, const bvh_build_options& options, std::vector<bvh_node>& nodes) {
+    // a binary tree over n leaves has at most 2n - 1 nodes
+    std::vector<build_node> build_nodes(2 * entries.size() - 1);
+    std::atomic<uint32_t> next_node{0};
+    const build_context ctx{options, entries, build_nodes, next_node};
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        build_recursive(ctx, 0, entries.size(), 1);
+        nodes.resize(build_nodes[0].subtree_size);
+        flatten(build_nodes, 0, 0, nodes);
+    }
+}
+
+// Interval bounds on the slab distances of a whole packet. Rays must share their origin;
+// axes where the direction signs disagree or a component is zero are left out. Each ray's
+// reciprocal direction lies in [inv_min, inv_max] and the products are monotonic in it, so
+// a box this test misses is missed by every ray of the packet.
+struct packet_frustum {
+    bool valid = false;
+    point3 origin;
+    bool use_axis[3];
+    bool neg[3];
+    real inv_min[3];
+    real inv_max[3];
+};
+
+packet_frustum make_frustum(const traversal_ray* rays, int count) {
+    packet_frustum f;
+    f.origin = rays[0].origin();
+    for (int i = 1; i < count; ++i) {
+        for (int a = 0; a < 3; ++a) {
+            if (rays[i].origin()[a] != f.origin[a]) return f;
+        }
+    }
+
+    for (int a = 0; a < 3; ++a) {
+        f.neg[a] = rays[0].dir_is_neg(a);
+        f.inv_min[a] = f.inv_max[a] = rays[0].inv_direction()[a];
+        f.use_axis[a] = std::isfinite(f.inv_min[a]);
+        for (int i = 1; i < count && f.use_axis[a]; ++i) {
+            const real inv = rays[i].inv_direction()[a];
+            f.use_axis[a] = rays[i].dir_is_neg(a) == f.neg[a] && std::isfinite(inv);
+            f.inv_min[a] = std::min(f.inv_min[a], inv);
+            f.inv_max[a] = std::max(f.inv_max[a], inv);
+        }
+        f.valid |= f.use_axis[a];
     }
-    
-    // The bounding box for this node is the union of its children's boxes.
-    // This is already computed at the start, so this line is not strictly necessary,
-    // but it is correct and can be a good check.
-    bbox = aabb(left->bounding_box(), right->bounding_box());
+    return f;
+}
+
+// Whether no ray of the packet can hit `node` within [tmin, tmax)
+bool frustum_misses(const packet_frustum& f, const bvh_node& node, real tmin, real tmax) {
+    for (int a = 0; a < 3; ++a) {
+        if (!f.use_axis[a]) continue;
+        const real near_offset = (f.neg[a] ? node.bounds_max[a] : node.bounds_min[a]) - f.origin[a];
+        const real far_offset = (f.neg[a] ? node.bounds_min[a] : node.bounds_max[a]) - f.origin[a];
+        tmin = std::max(tmin, std::min(near_offset * f.inv_min[a], near_offset * f.inv_max[a]));
+        tmax = std::min(tmax, std::max(far_offset * f.inv_min[a], far_offset * f.inv_max[a]));
+    }
+    return tmin >= tmax;
+}
+
+}
+
+bool parse_bvh_build_method(const std::string& name, bvh_build_method& method) {
+    if (name == "sah") {
+        method = bvh_build_method::sah;
+    } else if (name == "median") {
+        method = bvh_build_method::median;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::ostream& operator<<(std::ostream& out, const bvh_build_stats& stats) {
+    return out << stats.node_count << " nodes, " << stats.leaf_count << " leaves, depth " << stats.depth
+               << ", SAH cost " << stats.sah_cost << ", built in " << stats.build_ms << " ms";
+}
+
+// public constructor
+bvh::bvh(const hittable_list& list, const bvh_build_options& options) : _options(clamped(options)) {
+    const auto build_start = std::chrono::steady_clock::now();
+    if (list.objects.empty()) {
+        _store = std::make_shared<primitive_store>(std::vector<primitive>{}, _nodes);
+        return;
+    }
+
+    const bvh_build_options& opts = _options;
+    const size_t count = list.objects.size();
+    std::vector<build_entry> entries(count);
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < count; ++i) {
+        aabb box = list.objects[i].bounding_box();
+        entries[i] = {box, box.centroid(), static_cast<uint32_t>(i)};
+    }
+    build_tree(entries, opts, _nodes);
+
+    std::vector<primitive> primitives;
+    primitives.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        primitives.push_back(list.objects[entries[i].primitive]);
+    }
+    group_leaves(primitives);
+    _store = std::make_shared<primitive_store>(std::move(primitives), _nodes);
+
+    compute_stats(opts);
+    _stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - build_start).count();
+}
+
+bvh::bvh(std::shared_ptr<const triangle_mesh> mesh, const bvh_build_options& options) : _options(clamped(options)) {
+    const auto build_start = std::chrono::steady_clock::now();
+    const uint32_t count = mesh->triangle_count();
+    if (count == 0) {
+        _store = std::make_shared<primitive_store>(std::move(mesh), std::vector<uint32_t>{}, _nodes);
+        return;
+    }
+
+    const bvh_build_options& opts = _options;
+    std::vector<build_entry> entries(count);
+    #pragma omp parallel for schedule(static)
+    for (uint32_t t = 0; t < count; ++t) {
+        aabb box = triangle::bounding_box(*mesh, t);
+        entries[t] = {box, box.centroid(), t};
+    }
+    build_tree(entries, opts, _nodes);
+
+    std::vector<uint32_t> triangles(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        triangles[i] = entries[i].primitive;
+    }
+    entries = {}; // freed before the SoA copies are made
+    _store = std::make_shared<primitive_store>(std::move(mesh), triangles, _nodes);
+
+    compute_stats(opts);
+    _stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - build_start).count();
 }
 
 // Constructor for deserialization
-bvh_node::bvh_node(std::shared_ptr<hittable> left, std::shared_ptr<hittable> right, aabb bbox)
-    : left(left), right(right), bbox(bbox) {}
+bvh::bvh(std::vector<primitive> primitives, std::vector<bvh_node> nodes)
+    : _nodes(std::move(nodes)) {
+    group_leaves(primitives);
+    _store = std::make_shared<primitive_store>(std::move(primitives), _nodes);
+    compute_stats(bvh_build_options{});
+}
 
-// public constructor 
-bvh_node::bvh_node(const hittable_list& list) {
-    auto objects = list.objects;
-    *this = bvh_node(objects, 0, objects.size());
+// Orders each leaf's primitives by type, the layout primitive_store expects
+void bvh::group_leaves(std::vector<primitive>& primitives) const {
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (size_t i = 0; i < _nodes.size(); ++i) {
+        const bvh_node& node = _nodes[i];
+        if (!node.is_leaf()) continue;
+        auto first = primitives.begin() + node.offset;
+        std::stable_sort(first, first + node.primitive_count,
+            [](const primitive& a, const primitive& b) {
+                return primitive_store::type_rank(a) < primitive_store::type_rank(b);
+            });
+    }
 }
 
+void bvh::compute_stats(const bvh_build_options& options) {
+    _stats = bvh_build_stats{};
+    _stats.node_count = _nodes.size();
+    if (_nodes.empty()) {
+        return;
+    }
+
+    const double root_area = _nodes[0].bounds().surface_area();
+    std::vector<int> depth(_nodes.size(), 1);
+    for (size_t i = 0; i < _nodes.size(); ++i) {
+        const bvh_node& node = _nodes[i];
+        // relative probability of a ray that hits the root also hitting this node
+        const double p = root_area > 0.0 ? node.bounds().surface_area() / root_area : 1.0;
+        _stats.depth = std::max(_stats.depth, depth[i]);
+        if (node.is_leaf()) {
+            ++_stats.leaf_count;
+            _stats.sah_cost += p * options.intersection_cost * intersection_blocks(options, node.primitive_count);
+        } else {
+            _stats.sah_cost += p * options.traversal_cost;
+            depth[i + 1] = depth[node.offset] = depth[i] + 1;
+        }
+    }
+}
 
-bool bvh_node::hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const {
-    if (!bbox.hit(r, {ray_tmin, ray_tmax})) {
+bool bvh::hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const {
+    if (_nodes.empty()) {
         return false;
     }
 
-    bool hit_left = left->hit(r, ray_tmin, ray_tmax, rec);
-    bool hit_right = right->hit(r, ray_tmin, hit_left ? rec.t : ray_tmax, rec);
+    const traversal_ray tr(r);
+
+    // Nodes still to visit. The builders keep the tree far shallower than this.
+    uint32_t stack[max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    bool hit_anything = false;
+    real closest_so_far = ray_tmax;
 
-    return hit_left || hit_right;
+    while (true) {
+        const bvh_node& node = _nodes[current];
+        if (node.hit(tr, ray_tmin, closest_so_far)) {
+            if (node.is_leaf()) {
+                if (_store->hit(node.offset, node.primitive_count, r, ray_tmin, closest_so_far, rec)) {
+                    hit_anything = true;
+                }
+            } else {
+                // Visit the child on the near side of the split first, so the far one is
+                // more likely to be culled by the shrunken interval.
+                if (tr.dir_is_neg(node.axis)) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+void bvh::hit_batch(const ray* rays, int count, real ray_tmin, real ray_tmax,
+                    hit_record* recs, bool* hits) const {
+    for (int first = 0; first < count; first += max_packet_size) {
+        const int n = std::min(max_packet_size, count - first);
+        hit_packet(rays + first, n, ray_tmin, ray_tmax, recs + first, hits + first);
+    }
 }
 
-aabb bvh_node::bounding_box() const {
-    return bbox;
+// Traverses the tree once for the whole packet. An interior node is entered as soon as one
+// ray hits it, and a leaf is tested by every ray whose own box test passes, so each ray
+// ends with the same closest hit as bvh::hit. The packet's interval test culls nodes
+// without any per-ray work.
+void bvh::hit_packet(const ray* rays, int count, real ray_tmin, real ray_tmax,
+                     hit_record* recs, bool* hits) const {
+    for (int i = 0; i < count; ++i) {
+        hits[i] = false;
+    }
+    if (_nodes.empty()) {
+        return;
+    }
+
+    traversal_ray tr[max_packet_size];
+    real closest_so_far[max_packet_size];
+    for (int i = 0; i < count; ++i) {
+        tr[i] = traversal_ray(rays[i]);
+        closest_so_far[i] = ray_tmax;
+    }
+    const packet_frustum frustum = make_frustum(tr, count);
+    if (!frustum.valid) {
+        // Without a common origin the rays rarely follow the same path, and the packet
+        // would visit the union of all their paths; trace them one at a time instead.
+        for (int i = 0; i < count; ++i) {
+            hits[i] = hit(rays[i], ray_tmin, ray_tmax, recs[i]);
+        }
+        return;
+    }
+    real packet_tmax = ray_tmax;
+
+    uint32_t stack[max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const bvh_node& node = _nodes[current];
+        if (!frustum_misses(frustum, node, ray_tmin, packet_tmax)) {
+            if (node.is_leaf()) {
+                packet_tmax = ray_tmin;
+                for (int i = 0; i < count; ++i) {
+                    if (node.hit(tr[i], ray_tmin, closest_so_far[i]) &&
+                        _store->hit(node.offset, node.primitive_count, rays[i], ray_tmin, closest_so_far[i], recs[i])) {
+                        hits[i] = true;
+                    }
+                    packet_tmax = std::max(packet_tmax, closest_so_far[i]);
+                }
+            } else {
+                bool any_hit = false;
+                for (int i = 0; i < count && !any_hit; ++i) {
+                    any_hit = node.hit(tr[i], ray_tmin, closest_so_far[i]);
+                }
+                if (any_hit) {
+                    if (tr[0].dir_is_neg(node.axis)) {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+        }
+
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+}
+
+aabb bvh::bounding_box() const {
+    if (_nodes.empty()) {
+        return aabb();
+    }
+    return _nodes[0].bounds();
 }
@@ -48,19 +48,21 @@ camera::camera(
         viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
 }
 
-ray camera::get_ray(int i, int j, pcg32& rng) const {
+ray camera::get_ray(int i, int j, sample_stream& samples) const {
     auto pixel_center =
         pixel00_loc +
         i * pixel_delta_u +
         j * pixel_delta_v;
 
-    auto pixel_sample = pixel_center + pixel_sample_square(rng);
+    auto pixel_sample = pixel_center + pixel_sample_square(samples);
     auto direction = pixel_sample - position;
     return ray(position, direction);
 }
 
-vec3 camera::pixel_sample_square(pcg32& rng) const {
-    auto px = -0.5 + nextDouble(rng);
-    auto py = -0.5 + nextDouble(rng);
+vec3 camera::pixel_sample_square(sample_stream& samples) const {
+    double px, py;
+    samples.next_2d(px, py);
+    px -= 0.5;
+    py -= 0.5;
     return px * pixel_delta_u + py * pixel_delta_v;
 }
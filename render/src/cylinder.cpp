@@ -1,130 +1,82 @@
 #include "cylinder.hpp"
-#include <algorithm>
+#include "math_utils.hpp"
 #include <cmath>
+#include <limits>
 
-static bool solve_quadratic(double a, double b, double c, double& t0, double& t1) {
-    double discriminant = b*b - 4*a*c;
-    if (discriminant < 0) {
+bool cylinder::hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const {
+    real t;
+    const part hit_part = closest(intersect(_p1, _axis, _length, _radius2, r), ray_tmin, ray_tmax, t);
+    if (hit_part == part::none) {
         return false;
     }
-    double sqrt_discriminant = sqrt(discriminant);
-    t0 = (-b - sqrt_discriminant) / (2*a);
-    t1 = (-b + sqrt_discriminant) / (2*a);
-    if (t0 > t1) {
-        std::swap(t0, t1);
-    }
-    return true;
-}
 
-bool cylinder::hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const {
-    vec3 ro = r.origin();
-    vec3 rd = r.direction();
-    vec3 ba = p2() - p1(); // Cylinder axis vector
-    vec3 oc = ro - p1(); // Vector from cylinder base to ray origin
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.set_face_normal(r, outward_normal(hit_part, _p1, _axis, _radius, rec.p));
+    rec.mat = _mat.get();
 
-    // Coefficients for quadratic equation for infinite cylinder body
-    double a = dot(rd, rd) - dot(rd, unit_vector(ba)) * dot(rd, unit_vector(ba));
-    double b = 2.0 * (dot(rd, oc) - dot(rd, unit_vector(ba)) * dot(oc, unit_vector(ba)));
-    double c = dot(oc, oc) - dot(oc, unit_vector(ba)) * dot(oc, unit_vector(ba)) - radius()*radius();
-
-    double t0_body, t1_body;
-    if (!solve_quadratic(a, b, c, t0_body, t1_body)) {
-        // No intersection with infinite cylinder body
-        t0_body = std::numeric_limits<double>::infinity();
-        t1_body = std::numeric_limits<double>::infinity();
-    }
-
-    bool hit_body = false;
-    double t_body = std::numeric_limits<double>::infinity();
-    
-    // Check solutions for cylinder body
-    if (t0_body > ray_tmin && t0_body < ray_tmax) {
-        point3 p = r.at(t0_body);
-        double height = dot(p - p1(), unit_vector(ba));
-        if (height >= 0.0 && height <= ba.length()) {
-            t_body = t0_body;
-            hit_body = true;
-        }
-    }
-    if (t1_body > ray_tmin && t1_body < ray_tmax && t1_body < t_body) {
-        point3 p = r.at(t1_body);
-        double height = dot(p - p1(), unit_vector(ba));
-        if (height >= 0.0 && height <= ba.length()) {
-            t_body = t1_body;
-            hit_body = true;
-        }
-    }
+    return true;
+}
 
-    // Check caps
-    double t_cap1 = std::numeric_limits<double>::infinity();
-    double t_cap2 = std::numeric_limits<double>::infinity();
+cylinder::crossings cylinder::intersect(const point3& p1, const vec3& axis, real length, real radius2, const ray& r) {
+    constexpr real infinity = std::numeric_limits<real>::infinity();
+    const vec3& d = r.direction();
+    const vec3 oc = r.origin() - p1; // from the bottom centre to the ray origin
+    const real d_axis = dot(d, axis);
+    const real oc_axis = dot(oc, axis);
+    crossings x{infinity, infinity, infinity, infinity};
 
-    // Intersection with plane of bottom cap
-    double denom1 = dot(rd, -unit_vector(ba));
-    if (std::fabs(denom1) > 1e-8) { // If ray not parallel to cap plane
-        t_cap1 = dot(p1() - ro, -unit_vector(ba)) / denom1;
-        if (t_cap1 > ray_tmin && t_cap1 < ray_tmax) {
-            point3 p_cap = r.at(t_cap1);
-            if ((p_cap - p1()).length_squared() > radius()*radius()) { // Point outside cap circle
-                t_cap1 = std::numeric_limits<double>::infinity();
-            }
-        } else {
-            t_cap1 = std::numeric_limits<double>::infinity();
-        }
+    // The infinite body is a circle in the plane across the axis, so project onto it
+    const vec3 d_perp = d - d_axis * axis;
+    const vec3 oc_perp = oc - oc_axis * axis;
+    real near_root, far_root;
+    if (solve_radius_quadratic(oc_perp, d_perp, radius2, near_root, far_root)) {
+        // keep the roots between the caps
+        const real near_height = oc_axis + near_root * d_axis;
+        const real far_height = oc_axis + far_root * d_axis;
+        if (near_height >= 0 && near_height <= length) x.body_near = near_root;
+        if (far_height >= 0 && far_height <= length) x.body_far = far_root;
     }
 
-    // Intersection with plane of top cap
-    double denom2 = dot(rd, unit_vector(ba));
-    if (std::fabs(denom2) > 1e-8) { // If ray not parallel to cap plane
-        t_cap2 = dot(p2() - ro, unit_vector(ba)) / denom2;
-        if (t_cap2 > ray_tmin && t_cap2 < ray_tmax) {
-            point3 p_cap = r.at(t_cap2);
-            if ((p_cap - p2()).length_squared() > radius()*radius()) { // Point outside cap circle
-                t_cap2 = std::numeric_limits<double>::infinity();
-            }
-        } else {
-            t_cap2 = std::numeric_limits<double>::infinity();
-        }
+    if (std::fabs(d_axis) > real(1e-8)) { // not parallel to the cap planes
+        const real t_bottom = -oc_axis / d_axis;
+        if (!((oc + t_bottom * d).length_squared() > radius2)) x.bottom = t_bottom;
+        const real t_top = (length - oc_axis) / d_axis;
+        if (!((oc + t_top * d - length * axis).length_squared() > radius2)) x.top = t_top;
     }
-    
-    double t_final = std::numeric_limits<double>::infinity();
-    bool hit_something = false;
+    return x;
+}
 
-    if (hit_body && t_body < t_final) {
-        t_final = t_body;
-        hit_something = true;
+cylinder::part cylinder::closest(const crossings& x, real ray_tmin, real ray_tmax, real& t) {
+    part hit_part = part::none;
+    t = ray_tmax;
+    // ties go to the earlier part
+    if (x.body_near > ray_tmin && x.body_near < t) {
+        t = x.body_near;
+        hit_part = part::body;
+    } else if (x.body_far > ray_tmin && x.body_far < t) {
+        t = x.body_far;
+        hit_part = part::body;
     }
-    if (t_cap1 < t_final) {
-        t_final = t_cap1;
-        hit_something = true;
+    if (x.bottom > ray_tmin && x.bottom < t) {
+        t = x.bottom;
+        hit_part = part::bottom;
     }
-    if (t_cap2 < t_final) {
-        t_final = t_cap2;
-        hit_something = true;
+    if (x.top > ray_tmin && x.top < t) {
+        t = x.top;
+        hit_part = part::top;
     }
+    return hit_part;
+}
 
-    if (!hit_something) return false;
-
-    rec.t = t_final;
-    rec.p = r.at(t_final);
-
-    vec3 outward_normal;
-    if (t_final == t_body) {
-        // Normal for cylinder body
-        double height = dot(rec.p - p1(), unit_vector(ba));
-        outward_normal = unit_vector(rec.p - p1() - height * unit_vector(ba));
-    } else if (t_final == t_cap1) {
-        // Normal for bottom cap
-        outward_normal = -unit_vector(ba);
-    } else { // t_final == t_cap2
-        // Normal for top cap
-        outward_normal = unit_vector(ba);
+vec3 cylinder::outward_normal(part hit_part, const point3& p1, const vec3& axis, real radius, const point3& p) {
+    switch (hit_part) {
+        case part::bottom: return -axis;
+        case part::top: return axis;
+        default: break;
     }
-
-    rec.set_face_normal(r, outward_normal);
-    rec.mat = get_material();
-
-    return true;
+    const vec3 v = p - p1;
+    return (v - dot(v, axis) * axis) / radius;
 }
 
 aabb cylinder::bounding_box() const {
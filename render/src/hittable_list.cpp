@@ -1,12 +1,12 @@
 #include "hittable_list.hpp"
 
-bool hittable_list::hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const {
+bool hittable_list::hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const {
     hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = ray_tmax;
 
     for (const auto& object : objects) {
-        if (object->hit(r, ray_tmin, closest_so_far, temp_rec)) {
+        if (object.hit(r, ray_tmin, closest_so_far, temp_rec)) {
             hit_anything = true;
             closest_so_far = temp_rec.t;
             rec = temp_rec;
@@ -21,10 +21,10 @@ aabb hittable_list::bounding_box() const {
         return aabb();
     }
 
-    aabb total_box = objects[0]->bounding_box();
+    aabb total_box = objects[0].bounding_box();
     
     for (size_t i = 1; i < objects.size(); ++i) {
-        total_box = aabb(total_box, objects[i]->bounding_box());
+        total_box = aabb(total_box, objects[i].bounding_box());
     }
 
     return total_box;
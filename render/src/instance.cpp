@@ -0,0 +1,35 @@
+#include "instance.hpp"
+
+#include "bvh.hpp"
+
+instance::instance(std::shared_ptr<const bvh> blas, const transform& object_to_world)
+    : instance(nullptr, std::move(blas), object_to_world) {}
+
+instance::instance(std::shared_ptr<const triangle_mesh> mesh, std::shared_ptr<const bvh> blas,
+                   const transform& object_to_world) {
+    auto d = std::make_shared<data>();
+    d->blas = std::move(blas);
+    d->mesh = std::move(mesh);
+    d->object_to_world = object_to_world;
+    object_to_world.inverse(d->world_to_object);
+    d->world_box = object_to_world.box(d->blas->bounding_box());
+    _data = std::move(d);
+}
+
+std::shared_ptr<const bvh> instance::build_blas(const std::shared_ptr<const triangle_mesh>& mesh,
+                                                const bvh_build_options& options) {
+    return std::make_shared<bvh>(mesh, options);
+}
+
+bool instance::hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const {
+    const ray object_ray(_data->world_to_object.point(r.origin()), _data->world_to_object.vector(r.direction()));
+    if (!_data->blas->hit(object_ray, ray_tmin, ray_tmax, rec)) {
+        return false;
+    }
+
+    // The normal faces the object ray, so its world image (through the inverse transpose)
+    // faces the world ray and front_face carries over
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(_data->world_to_object.transposed_vector(rec.normal));
+    return true;
+}
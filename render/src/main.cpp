@@ -5,8 +5,10 @@
 #include "cxxopts.hpp"
 
 #include "scene_parser.hpp"
+#include "benchmark.hpp"
 #include "renderer.hpp"
 #include "bvh.hpp"
+#include "wide_bvh.hpp"
 #include "camera.hpp"
 #include "color.hpp"
 #include "hittable_list.hpp"
@@ -23,7 +25,7 @@ aabb compute_scene_bounds(const hittable_list& world) {
     bool first_box = true;
 
     for (const auto& object : world.objects) {
-        aabb object_box = object->bounding_box();
+        aabb object_box = object.bounding_box();
         if ((object_box.max() - object_box.min()).length() > 1000.0) continue;
 
         total_bounds = first_box ? object_box : aabb(total_bounds, object_box);
@@ -62,7 +64,18 @@ int main(int argc, char* argv[]) {
         ("h,height", "Image height", cxxopts::value<int>()->default_value("800"))
         ("samples", "Samples per pixel", cxxopts::value<int>()->default_value("100"))
         ("depth", "Max ray depth", cxxopts::value<int>()->default_value("50"))
+        ("roulette-depth", "Bounces before Russian roulette may end a path (0 disables it)", cxxopts::value<int>()->default_value("0"))
+        ("noise-threshold", "Relative noise at which adaptive sampling stops (0 disables it)", cxxopts::value<double>()->default_value("0"))
+        ("sampler", "Sample generator: independent, stratified, sobol or bluenoise", cxxopts::value<std::string>()->default_value("independent"))
         ("f,frame-scene", "Automatically frame the scene", cxxopts::value<bool>()->default_value("false"))
+        ("bvh", "BVH builder (sah or median)", cxxopts::value<std::string>()->default_value("sah"))
+        ("bvh-leaf-size", "Max primitives per BVH leaf", cxxopts::value<int>()->default_value("4"))
+        ("bvh-width", "BVH branching factor used for traversal (2, 4 or 8)", cxxopts::value<int>()->default_value("2"))
+        ("trace", "Ray tracing mode: single, packet or stream", cxxopts::value<std::string>()->default_value("single"))
+        ("packet-size", "Rays per packet / batch in packet and stream mode (4, 8 or 16)", cxxopts::value<int>()->default_value("8"))
+        ("bench", "Run a microbenchmark instead of rendering (slab, leaf, packet, roulette, convergence, precision, vec3, refcount, cylinder)", cxxopts::value<std::string>())
+        ("bench-rays", "Rays traced by --bench", cxxopts::value<int>()->default_value("100000"))
+        ("bench-reference", "Tile written by --bench precision, or compared against when it exists", cxxopts::value<std::string>()->default_value(""))
         ("help", "Print usage");
     
     auto result = options.parse(argc, argv);
@@ -72,20 +85,61 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    bvh_build_options bvh_options;
+    if (!parse_bvh_build_method(result["bvh"].as<std::string>(), bvh_options.method)) {
+        std::cerr << "Unknown BVH builder '" << result["bvh"].as<std::string>() << "' (expected sah or median)." << std::endl;
+        return 1;
+    }
+    bvh_options.max_leaf_size = result["bvh-leaf-size"].as<int>();
+    if (bvh_options.max_leaf_size <= 0) {
+        std::cerr << "BVH leaf size must be positive." << std::endl;
+        return 1;
+    }
+    const int bvh_width = result["bvh-width"].as<int>();
+    if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8) {
+        std::cerr << "BVH width must be 2, 4 or 8." << std::endl;
+        return 1;
+    }
+
+    render_options render_opts;
+    if (!parse_trace_mode(result["trace"].as<std::string>(), render_opts.mode)) {
+        std::cerr << "Unknown trace mode '" << result["trace"].as<std::string>() << "' (expected single, packet or stream)." << std::endl;
+        return 1;
+    }
+    render_opts.packet_size = result["packet-size"].as<int>();
+    if (render_opts.packet_size != 4 && render_opts.packet_size != 8 && render_opts.packet_size != 16) {
+        std::cerr << "Packet size must be 4, 8 or 16." << std::endl;
+        return 1;
+    }
+    render_opts.roulette_depth = result["roulette-depth"].as<int>();
+    if (render_opts.roulette_depth < 0) {
+        std::cerr << "Roulette depth must not be negative." << std::endl;
+        return 1;
+    }
+    render_opts.noise_threshold = result["noise-threshold"].as<double>();
+    if (render_opts.noise_threshold < 0.0) {
+        std::cerr << "Noise threshold must not be negative." << std::endl;
+        return 1;
+    }
+    if (!parse_sampler_kind(result["sampler"].as<std::string>(), render_opts.sampler)) {
+        std::cerr << "Unknown sampler '" << result["sampler"].as<std::string>() << "' (expected independent, stratified, sobol or bluenoise)." << std::endl;
+        return 1;
+    }
+
     scene current_scene;
     if (result.count("scene")) {
-        current_scene = parse_scene(result["scene"].as<std::string>());
+        current_scene = parse_scene(result["scene"].as<std::string>(), bvh_options);
         std::clog << "Scene parsed." << std::endl;
     } else {
         std::clog << "No scene file provided. Creating default scene." << std::endl;
-        auto material_ground = std::make_shared<lambertian>(color(0.8, 0.8, 0.0));
-        auto material_center = std::make_shared<lambertian>(color(0.1, 0.2, 0.5));
-        auto material_left   = std::make_shared<metal>(color(0.8, 0.8, 0.8), 0.3);
-        auto material_right  = std::make_shared<metal>(color(0.8, 0.6, 0.2), 1.0);
-        current_scene.world.add(std::make_shared<sphere>(point3( 0.0, -100.5, -1.0), 100.0, material_ground));
-        current_scene.world.add(std::make_shared<sphere>(point3( 0.0,    0.0, -1.0),   0.5, material_center));
-        current_scene.world.add(std::make_shared<sphere>(point3(-1.0,    0.0, -1.0),   0.5, material_left));
-        current_scene.world.add(std::make_shared<sphere>(point3( 1.0,    0.0, -1.0),   0.5, material_right));
+        auto material_ground = std::make_shared<material>(lambertian(color(0.8, 0.8, 0.0)));
+        auto material_center = std::make_shared<material>(lambertian(color(0.1, 0.2, 0.5)));
+        auto material_left   = std::make_shared<material>(metal(color(0.8, 0.8, 0.8), 0.3));
+        auto material_right  = std::make_shared<material>(metal(color(0.8, 0.6, 0.2), 1.0));
+        current_scene.world.add(sphere(point3( 0.0, -100.5, -1.0), 100.0, material_ground));
+        current_scene.world.add(sphere(point3( 0.0,    0.0, -1.0),   0.5, material_center));
+        current_scene.world.add(sphere(point3(-1.0,    0.0, -1.0),   0.5, material_left));
+        current_scene.world.add(sphere(point3( 1.0,    0.0, -1.0),   0.5, material_right));
     }
 
     int image_width = result["width"].as<int>();
@@ -101,9 +155,16 @@ int main(int argc, char* argv[]) {
     }
 
     std::clog << "Constructing BVH..." << std::endl;
-    hittable_list world_bvh;
-    world_bvh.add(std::make_shared<bvh_node>(current_scene.world));
-    std::clog << "BVH constructed." << std::endl;
+    auto world_bvh = std::make_shared<bvh>(current_scene.world, bvh_options);
+    std::clog << "BVH constructed: " << world_bvh->stats() << std::endl;
+    // the BVH keeps its own copy of the primitives
+    current_scene.world.clear();
+    auto world = make_wide_bvh(world_bvh, bvh_width);
+    if (auto wide = std::dynamic_pointer_cast<bvh4>(world)) {
+        std::clog << "Collapsed to BVH4: " << wide->nodes().size() << " nodes, " << wide->kernel_name() << " kernel." << std::endl;
+    } else if (auto wide = std::dynamic_pointer_cast<bvh8>(world)) {
+        std::clog << "Collapsed to BVH8: " << wide->nodes().size() << " nodes, " << wide->kernel_name() << " kernel." << std::endl;
+    }
 
     camera cam(
         current_scene.camera.position,
@@ -115,13 +176,26 @@ int main(int argc, char* argv[]) {
         image_height
     );
 
-    renderer rend(cam, world_bvh);
+    if (result.count("bench")) {
+        benchmark_context ctx{*world_bvh, *world, cam, image_width, image_height, result["bench-rays"].as<int>(),
+                              result["depth"].as<int>(), render_opts, result["bench-reference"].as<std::string>()};
+        if (!run_benchmark(result["bench"].as<std::string>(), ctx, std::cout)) {
+            std::cerr << "Unknown benchmark '" << result["bench"].as<std::string>() << "'." << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    renderer rend(cam, *world, render_opts);
+    render_stats stats;
     std::vector<color> out_pixels = rend.render_tile(
         0, 0, image_width, image_height,
         result["samples"].as<int>(),
         result["depth"].as<int>(),
-        0
+        0,
+        &stats
     );
+    std::clog << std::endl << "Traced " << stats << std::endl;
 
     std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
     for (const auto& pixel : out_pixels) {
@@ -2,8 +2,10 @@
 
 // Lambertian
 
-bool lambertian::scatter(const ray&, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng) const {
-    auto scatter_direction = rec.normal + random_in_hemisphere(rec.normal, rng);
+bool lambertian::scatter(const ray&, const hit_record& rec, color& attenuation, ray& scattered, sample_stream& samples) const {
+    double u1, u2;
+    samples.next_2d(u1, u2);
+    auto scatter_direction = rec.normal + sample_in_hemisphere(rec.normal, u1, u2, samples.next_1d());
 
     // Catch degenerate scatter direction
     if (near_zero(scatter_direction))
@@ -16,34 +18,36 @@ bool lambertian::scatter(const ray&, const hit_record& rec, color& attenuation,
 
 // Metal
 
-bool metal::scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng) const {
-    vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-    scattered = ray(rec.p, reflected + fuzz() * random_in_unit_sphere(rng));
+bool metal::scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sample_stream& samples) const {
+    vec3 reflected = reflect(r_in.direction(), rec.normal);
+    double u1, u2;
+    samples.next_2d(u1, u2);
+    scattered = ray(rec.p, reflected + fuzz() * sample_in_unit_sphere(u1, u2, samples.next_1d()));
     attenuation = albedo();
     return (dot(scattered.direction(), rec.normal) > 0);
 }
 
 // Dielectric
 
-double dielectric::reflectance(double cosine, double ref_idx) {
+real dielectric::reflectance(real cosine, real ref_idx) {
     // Use Schlick's approximation for reflectance.
     auto r0 = (1-ref_idx) / (1+ref_idx);
     r0 = r0*r0;
     return r0 + (1-r0)*pow((1 - cosine),5);
 }
 
-bool dielectric::scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, pcg32& rng) const {
+bool dielectric::scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sample_stream& samples) const {
     attenuation = color(0.95, 0.95, 0.95); // -5% absorption :p
-    double refraction_ratio = rec.front_face ? (1.0/ir()) : ir();
+    real refraction_ratio = rec.front_face ? (1/ir()) : ir();
 
-    vec3 unit_direction = unit_vector(r_in.direction());
-    double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-    double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
+    const vec3& unit_direction = r_in.direction();
+    real cos_theta = std::fmin(dot(-unit_direction, rec.normal), real(1));
+    real sin_theta = std::sqrt(1 - cos_theta*cos_theta);
 
     bool cannot_refract = refraction_ratio * sin_theta > 1.0;
     vec3 direction;
 
-    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > nextDouble(rng))
+    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > samples.next_1d())
         direction = reflect(unit_direction, rec.normal);
     else
         direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -0,0 +1,586 @@
+#include "primitive_store.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "bvh.hpp"
+#include "math_utils.hpp"
+#include "simd_real.hpp"
+#include "sphere.hpp"
+#include "cylinder.hpp"
+#include "triangle.hpp"
+
+// Spheres
+
+uint32_t sphere_soa::begin_leaf() {
+    slots = (slots + lanes - 1) / lanes * lanes;
+    simd = cpu_supports_avx2();
+    return slots / lanes;
+}
+
+void sphere_soa::add(const sphere& s) {
+    const uint32_t lane = slots % lanes;
+    if (lane == 0) {
+        // padding lanes never intersect: radius2 = -inf makes the discriminant negative
+        block b;
+        std::fill(std::begin(b.cx), std::end(b.cx), 0.0);
+        std::fill(std::begin(b.cy), std::end(b.cy), 0.0);
+        std::fill(std::begin(b.cz), std::end(b.cz), 0.0);
+        std::fill(std::begin(b.radius2), std::end(b.radius2), -std::numeric_limits<real>::infinity());
+        blocks.push_back(b);
+        radius.resize(blocks.size() * lanes, 0.0);
+        mat.resize(blocks.size() * lanes);
+    }
+
+    block& b = blocks.back();
+    b.cx[lane] = s.center_point().x();
+    b.cy[lane] = s.center_point().y();
+    b.cz[lane] = s.center_point().z();
+    b.radius2[lane] = s.radius_value() * s.radius_value();
+    radius[slots] = s.radius_value();
+    mat[slots] = s.get_material().get();
+    ++slots;
+}
+
+bool sphere_soa::hit(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const {
+    uint32_t best;
+    real best_t;
+    // a single sphere is not worth the vector setup
+    const bool found = simd && count > 1
+        ? hit_avx2(first_block, count, r, ray_tmin, closest_so_far, best, best_t)
+        : hit_scalar(first_block, count, r, ray_tmin, closest_so_far, best, best_t);
+    if (!found) {
+        return false;
+    }
+
+    const block& b = blocks[best / lanes];
+    const uint32_t lane = best % lanes;
+    const point3 center(b.cx[lane], b.cy[lane], b.cz[lane]);
+    rec.t = best_t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius[best];
+    rec.set_face_normal(r, outward_normal);
+    rec.mat = mat[best];
+    closest_so_far = best_t;
+    return true;
+}
+
+// Same arithmetic, in the same order, as sphere::hit, so every kernel picks the same roots.
+bool sphere_soa::hit_scalar(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                            uint32_t& best, real& best_t) const {
+    const vec3& d = r.direction();
+    bool found = false;
+
+    for (uint32_t n = 0; n < count; ++n) {
+        const block& b = blocks[first_block + n / lanes];
+        const uint32_t lane = n % lanes;
+        vec3 oc = r.origin() - point3(b.cx[lane], b.cy[lane], b.cz[lane]);
+        real near_root, far_root;
+        if (!solve_radius_quadratic(oc, d, b.radius2[lane], near_root, far_root)) continue;
+
+        auto root = near_root;
+        if (root <= ray_tmin || closest_so_far <= root) {
+            root = far_root;
+            if (root <= ray_tmin || closest_so_far <= root)
+                continue;
+        }
+
+        closest_so_far = root;
+        best = first_block * lanes + n;
+        best_t = root;
+        found = true;
+    }
+    return found;
+}
+
+#if defined(RT_HAVE_AVX2_KERNELS)
+using namespace simd;
+
+namespace {
+
+// solve_radius_quadratic on every lane, with a = |d|^2 given. Returns the lanes with roots as
+// a bit mask (and in root_lanes as a vector mask), or 0 without computing them when no
+// discriminant is non-negative; "not less than" and "not equal" keep NaN lanes, as the
+// scalar comparisons do.
+RT_TARGET_AVX2 inline int vsolve_radius_quadratic(vreal ocx, vreal ocy, vreal ocz, vreal dx, vreal dy, vreal dz,
+                                                  vreal a, vreal radius2, vreal& near_root, vreal& far_root,
+                                                  vreal& root_lanes) {
+    const vreal sign = vset1(-0.0);
+    const vreal zero = vset1(0.0);
+    const vreal half_b = vadd(vadd(vmul(ocx, dx), vmul(ocy, dy)), vmul(ocz, dz));
+    const vreal k = vdiv(half_b, a);
+    const vreal lx = vsub(ocx, vmul(k, dx));
+    const vreal ly = vsub(ocy, vmul(k, dy));
+    const vreal lz = vsub(ocz, vmul(k, dz));
+    const vreal l_len2 = vadd(vadd(vmul(lx, lx), vmul(ly, ly)), vmul(lz, lz));
+    const vreal disc = vmul(a, vsub(radius2, l_len2));
+
+    const vreal disc_lanes = vcmp<_CMP_NLT_UQ>(disc, zero);
+    if (vmovemask(disc_lanes) == 0) return 0;
+
+    const vreal oc_len2 = vadd(vadd(vmul(ocx, ocx), vmul(ocy, ocy)), vmul(ocz, ocz));
+    const vreal c = vsub(oc_len2, radius2);
+    const vreal signed_sqrtd = vor(vsqrt(disc), vand(half_b, sign));
+    const vreal q = vsub(vxor(half_b, sign), signed_sqrtd);
+    root_lanes = vand(disc_lanes, vcmp<_CMP_NEQ_UQ>(q, zero));
+    const int mask = vmovemask(root_lanes);
+    if (mask == 0) return 0;
+
+    const vreal root0 = vdiv(c, q);
+    const vreal root1 = vdiv(q, a);
+    const vreal swap = vcmp<_CMP_GT_OQ>(root0, root1);
+    near_root = vblend(root0, root1, swap);
+    far_root = vblend(root1, root0, swap);
+    return mask;
+}
+
+}
+
+// One block per iteration. Roots are picked per lane afterwards so the rejection tests see
+// closest_so_far shrink in lane order, exactly as in the scalar kernel.
+RT_TARGET_AVX2
+bool sphere_soa::hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                          uint32_t& best, real& best_t) const {
+    const vec3& d = r.direction();
+    const vreal ox = vset1(r.origin().x());
+    const vreal oy = vset1(r.origin().y());
+    const vreal oz = vset1(r.origin().z());
+    const vreal dx = vset1(d.x());
+    const vreal dy = vset1(d.y());
+    const vreal dz = vset1(d.z());
+    const vreal a = vset1(d.length_squared());
+    bool found = false;
+
+    for (uint32_t n = 0; n < count; n += lanes) {
+        const block& b = blocks[first_block + n / lanes];
+        vreal root0, root1, root_lanes;
+        const int mask = vsolve_radius_quadratic(vsub(ox, vload(b.cx)), vsub(oy, vload(b.cy)), vsub(oz, vload(b.cz)),
+                                                 dx, dy, dz, a, vload(b.radius2), root0, root1, root_lanes);
+        if (mask == 0) continue;
+
+        alignas(32) real near_root[lanes];
+        alignas(32) real far_root[lanes];
+        vstore(near_root, root0);
+        vstore(far_root, root1);
+
+        const uint32_t valid = std::min(lanes, count - n);
+        for (uint32_t lane = 0; lane < valid; ++lane) {
+            if (!(mask & (1 << lane))) continue;
+            real root = near_root[lane];
+            if (root <= ray_tmin || closest_so_far <= root) {
+                root = far_root[lane];
+                if (root <= ray_tmin || closest_so_far <= root)
+                    continue;
+            }
+            closest_so_far = root;
+            best = first_block * lanes + n + lane;
+            best_t = root;
+            found = true;
+        }
+    }
+    return found;
+}
+#else
+bool sphere_soa::hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                          uint32_t& best, real& best_t) const {
+    return hit_scalar(first_block, count, r, ray_tmin, closest_so_far, best, best_t);
+}
+#endif
+
+// Cylinders
+
+uint32_t cylinder_soa::begin_leaf() {
+    slots = (slots + lanes - 1) / lanes * lanes;
+    simd = cpu_supports_avx2();
+    return slots / lanes;
+}
+
+void cylinder_soa::add(const cylinder& c) {
+    const uint32_t lane = slots % lanes;
+    if (lane == 0) {
+        // padding lanes never intersect: a zero axis is parallel to no ray, so the caps are
+        // skipped, and radius2 = -inf makes the body's discriminant negative
+        block b;
+        for (real* column : {b.p1x, b.p1y, b.p1z, b.ax, b.ay, b.az, b.length}) {
+            std::fill(column, column + lanes, 0.0);
+        }
+        std::fill(std::begin(b.radius2), std::end(b.radius2), -std::numeric_limits<real>::infinity());
+        blocks.push_back(b);
+        radius.resize(blocks.size() * lanes, 0.0);
+        mat.resize(blocks.size() * lanes);
+    }
+
+    block& b = blocks.back();
+    b.p1x[lane] = c.p1().x();
+    b.p1y[lane] = c.p1().y();
+    b.p1z[lane] = c.p1().z();
+    b.ax[lane] = c.axis().x();
+    b.ay[lane] = c.axis().y();
+    b.az[lane] = c.axis().z();
+    b.length[lane] = c.length();
+    b.radius2[lane] = c.radius2();
+    radius[slots] = c.radius();
+    mat[slots] = c.get_material().get();
+    ++slots;
+}
+
+bool cylinder_soa::hit(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const {
+    uint32_t best;
+    real best_t;
+    cylinder::part best_part;
+    const bool found = simd && count > 1
+        ? hit_avx2(first_block, count, r, ray_tmin, closest_so_far, best, best_t, best_part)
+        : hit_scalar(first_block, count, r, ray_tmin, closest_so_far, best, best_t, best_part);
+    if (!found) {
+        return false;
+    }
+
+    const block& b = blocks[best / lanes];
+    const uint32_t lane = best % lanes;
+    rec.t = best_t;
+    rec.p = r.at(rec.t);
+    const vec3 outward_normal = cylinder::outward_normal(best_part, point3(b.p1x[lane], b.p1y[lane], b.p1z[lane]),
+                                                         vec3(b.ax[lane], b.ay[lane], b.az[lane]), radius[best], rec.p);
+    rec.set_face_normal(r, outward_normal);
+    rec.mat = mat[best];
+    closest_so_far = best_t;
+    return true;
+}
+
+bool cylinder_soa::hit_scalar(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                              uint32_t& best, real& best_t, cylinder::part& best_part) const {
+    bool found = false;
+
+    for (uint32_t n = 0; n < count; ++n) {
+        const block& b = blocks[first_block + n / lanes];
+        const uint32_t lane = n % lanes;
+        const cylinder::crossings x = cylinder::intersect(point3(b.p1x[lane], b.p1y[lane], b.p1z[lane]),
+                                                          vec3(b.ax[lane], b.ay[lane], b.az[lane]),
+                                                          b.length[lane], b.radius2[lane], r);
+        real t;
+        const cylinder::part hit_part = cylinder::closest(x, ray_tmin, closest_so_far, t);
+        if (hit_part == cylinder::part::none) continue;
+
+        closest_so_far = t;
+        best = first_block * lanes + n;
+        best_t = t;
+        best_part = hit_part;
+        found = true;
+    }
+    return found;
+}
+
+#if defined(RT_HAVE_AVX2_KERNELS)
+// cylinder::intersect for a block per iteration, with the same arithmetic in the same order;
+// the crossings are then picked per lane with cylinder::closest, as in the scalar kernel.
+RT_TARGET_AVX2
+bool cylinder_soa::hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                            uint32_t& best, real& best_t, cylinder::part& best_part) const {
+    const vec3& d = r.direction();
+    const vreal ox = vset1(r.origin().x());
+    const vreal oy = vset1(r.origin().y());
+    const vreal oz = vset1(r.origin().z());
+    const vreal dx = vset1(d.x());
+    const vreal dy = vset1(d.y());
+    const vreal dz = vset1(d.z());
+    const vreal sign = vset1(-0.0);
+    const vreal zero = vset1(0.0);
+    const vreal parallel_limit = vset1(1e-8);
+    const vreal infinity = vset1(std::numeric_limits<real>::infinity());
+    bool found = false;
+
+    for (uint32_t n = 0; n < count; n += lanes) {
+        const block& b = blocks[first_block + n / lanes];
+        const vreal ax = vload(b.ax);
+        const vreal ay = vload(b.ay);
+        const vreal az = vload(b.az);
+        const vreal length = vload(b.length);
+        const vreal radius2 = vload(b.radius2);
+        const vreal ocx = vsub(ox, vload(b.p1x));
+        const vreal ocy = vsub(oy, vload(b.p1y));
+        const vreal ocz = vsub(oz, vload(b.p1z));
+        const vreal d_axis = vadd(vadd(vmul(dx, ax), vmul(dy, ay)), vmul(dz, az));
+        const vreal oc_axis = vadd(vadd(vmul(ocx, ax), vmul(ocy, ay)), vmul(ocz, az));
+
+        const vreal dpx = vsub(dx, vmul(d_axis, ax));
+        const vreal dpy = vsub(dy, vmul(d_axis, ay));
+        const vreal dpz = vsub(dz, vmul(d_axis, az));
+        const vreal a = vadd(vadd(vmul(dpx, dpx), vmul(dpy, dpy)), vmul(dpz, dpz));
+        vreal body_near = infinity;
+        vreal body_far = infinity;
+        vreal root0, root1, root_lanes;
+        if (vsolve_radius_quadratic(vsub(ocx, vmul(oc_axis, ax)), vsub(ocy, vmul(oc_axis, ay)),
+                                    vsub(ocz, vmul(oc_axis, az)), dpx, dpy, dpz, a, radius2, root0, root1,
+                                    root_lanes) != 0) {
+            // keep the roots between the caps
+            const vreal near_height = vadd(oc_axis, vmul(root0, d_axis));
+            const vreal far_height = vadd(oc_axis, vmul(root1, d_axis));
+            const vreal near_between = vand(vcmp<_CMP_GE_OQ>(near_height, zero), vcmp<_CMP_LE_OQ>(near_height, length));
+            const vreal far_between = vand(vcmp<_CMP_GE_OQ>(far_height, zero), vcmp<_CMP_LE_OQ>(far_height, length));
+            body_near = vblend(infinity, root0, vand(root_lanes, near_between));
+            body_far = vblend(infinity, root1, vand(root_lanes, far_between));
+        }
+
+        const vreal not_parallel = vcmp<_CMP_GT_OQ>(vandnot(sign, d_axis), parallel_limit);
+        const vreal t_bottom = vdiv(vxor(oc_axis, sign), d_axis);
+        const vreal bx = vadd(ocx, vmul(t_bottom, dx));
+        const vreal by = vadd(ocy, vmul(t_bottom, dy));
+        const vreal bz = vadd(ocz, vmul(t_bottom, dz));
+        const vreal bottom_outside = vcmp<_CMP_GT_OQ>(vadd(vadd(vmul(bx, bx), vmul(by, by)), vmul(bz, bz)), radius2);
+        const vreal bottom = vblend(infinity, t_bottom, vandnot(bottom_outside, not_parallel));
+        const vreal t_top = vdiv(vsub(length, oc_axis), d_axis);
+        const vreal tx = vsub(vadd(ocx, vmul(t_top, dx)), vmul(length, ax));
+        const vreal ty = vsub(vadd(ocy, vmul(t_top, dy)), vmul(length, ay));
+        const vreal tz = vsub(vadd(ocz, vmul(t_top, dz)), vmul(length, az));
+        const vreal top_outside = vcmp<_CMP_GT_OQ>(vadd(vadd(vmul(tx, tx), vmul(ty, ty)), vmul(tz, tz)), radius2);
+        const vreal top = vblend(infinity, t_top, vandnot(top_outside, not_parallel));
+
+        alignas(32) real x_body_near[lanes];
+        alignas(32) real x_body_far[lanes];
+        alignas(32) real x_bottom[lanes];
+        alignas(32) real x_top[lanes];
+        vstore(x_body_near, body_near);
+        vstore(x_body_far, body_far);
+        vstore(x_bottom, bottom);
+        vstore(x_top, top);
+
+        const uint32_t valid = std::min(lanes, count - n);
+        for (uint32_t lane = 0; lane < valid; ++lane) {
+            const cylinder::crossings x{x_body_near[lane], x_body_far[lane], x_bottom[lane], x_top[lane]};
+            real t;
+            const cylinder::part hit_part = cylinder::closest(x, ray_tmin, closest_so_far, t);
+            if (hit_part == cylinder::part::none) continue;
+            closest_so_far = t;
+            best = first_block * lanes + n + lane;
+            best_t = t;
+            best_part = hit_part;
+            found = true;
+        }
+    }
+    return found;
+}
+#else
+bool cylinder_soa::hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                            uint32_t& best, real& best_t, cylinder::part& best_part) const {
+    return hit_scalar(first_block, count, r, ray_tmin, closest_so_far, best, best_t, best_part);
+}
+#endif
+
+// Triangles
+
+uint32_t triangle_soa::begin_leaf() {
+    slots = (slots + lanes - 1) / lanes * lanes;
+    simd = cpu_supports_avx2();
+    return slots / lanes;
+}
+
+void triangle_soa::add(const triangle_mesh& mesh, uint32_t t) {
+    const uint32_t lane = slots % lanes;
+    if (lane == 0) {
+        // padding lanes never intersect: zero edges make the barycentrics NaN
+        block b;
+        for (real* column : {b.v0x, b.v0y, b.v0z, b.e1x, b.e1y, b.e1z, b.e2x, b.e2y, b.e2z}) {
+            std::fill(column, column + lanes, 0.0);
+        }
+        blocks.push_back(b);
+    }
+
+    block& b = blocks.back();
+    const point3 v0 = mesh.corner(t, 0);
+    const vec3 e1 = mesh.corner(t, 1) - v0;
+    const vec3 e2 = mesh.corner(t, 2) - v0;
+    b.v0x[lane] = v0.x();
+    b.v0y[lane] = v0.y();
+    b.v0z[lane] = v0.z();
+    b.e1x[lane] = e1.x();
+    b.e1y[lane] = e1.y();
+    b.e1z[lane] = e1.z();
+    b.e2x[lane] = e2.x();
+    b.e2y[lane] = e2.y();
+    b.e2z[lane] = e2.z();
+    ++slots;
+}
+
+bool triangle_soa::hit(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real& closest_so_far, hit_record& rec) const {
+    uint32_t best;
+    real best_t;
+    const bool found = simd && count > 1
+        ? hit_avx2(first_block, count, r, ray_tmin, closest_so_far, best, best_t)
+        : hit_scalar(first_block, count, r, ray_tmin, closest_so_far, best, best_t);
+    if (!found) {
+        return false;
+    }
+
+    const block& b = blocks[best / lanes];
+    const uint32_t lane = best % lanes;
+    rec.t = best_t;
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, triangle::outward_normal(vec3(b.e1x[lane], b.e1y[lane], b.e1z[lane]),
+                                                    vec3(b.e2x[lane], b.e2y[lane], b.e2z[lane])));
+    rec.mat = mat;
+    closest_so_far = best_t;
+    return true;
+}
+
+bool triangle_soa::hit_scalar(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                              uint32_t& best, real& best_t) const {
+    bool found = false;
+
+    for (uint32_t n = 0; n < count; ++n) {
+        const block& b = blocks[first_block + n / lanes];
+        const uint32_t lane = n % lanes;
+        real t;
+        if (!triangle::intersect(point3(b.v0x[lane], b.v0y[lane], b.v0z[lane]),
+                                 vec3(b.e1x[lane], b.e1y[lane], b.e1z[lane]),
+                                 vec3(b.e2x[lane], b.e2y[lane], b.e2z[lane]), r, ray_tmin, closest_so_far, t)) {
+            continue;
+        }
+        closest_so_far = t;
+        best = first_block * lanes + n;
+        best_t = t;
+        found = true;
+    }
+    return found;
+}
+
+#if defined(RT_HAVE_AVX2_KERNELS)
+// triangle::intersect for a block per iteration, with the same arithmetic in the same order.
+// The barycentric tests don't depend on closest_so_far, so only the distance test is left
+// to the lanes, in order, as in the scalar kernel.
+RT_TARGET_AVX2
+bool triangle_soa::hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                            uint32_t& best, real& best_t) const {
+    const vec3& d = r.direction();
+    const vreal ox = vset1(r.origin().x());
+    const vreal oy = vset1(r.origin().y());
+    const vreal oz = vset1(r.origin().z());
+    const vreal dx = vset1(d.x());
+    const vreal dy = vset1(d.y());
+    const vreal dz = vset1(d.z());
+    const vreal zero = vset1(0.0);
+    const vreal one = vset1(1.0);
+    const vreal tmin = vset1(ray_tmin);
+    bool found = false;
+
+    for (uint32_t n = 0; n < count; n += lanes) {
+        const block& b = blocks[first_block + n / lanes];
+        const vreal e1x = vload(b.e1x);
+        const vreal e1y = vload(b.e1y);
+        const vreal e1z = vload(b.e1z);
+        const vreal e2x = vload(b.e2x);
+        const vreal e2y = vload(b.e2y);
+        const vreal e2z = vload(b.e2z);
+
+        // pvec = cross(d, e2)
+        const vreal px = vsub(vmul(dy, e2z), vmul(dz, e2y));
+        const vreal py = vsub(vmul(dz, e2x), vmul(dx, e2z));
+        const vreal pz = vsub(vmul(dx, e2y), vmul(dy, e2x));
+        const vreal inv_det = vdiv(one, vadd(vadd(vmul(e1x, px), vmul(e1y, py)), vmul(e1z, pz)));
+        const vreal tx = vsub(ox, vload(b.v0x));
+        const vreal ty = vsub(oy, vload(b.v0y));
+        const vreal tz = vsub(oz, vload(b.v0z));
+        const vreal u = vmul(vadd(vadd(vmul(tx, px), vmul(ty, py)), vmul(tz, pz)), inv_det);
+        const vreal u_inside = vand(vcmp<_CMP_GE_OQ>(u, zero), vcmp<_CMP_LE_OQ>(u, one));
+        if (vmovemask(u_inside) == 0) continue;
+
+        // qvec = cross(tvec, e1)
+        const vreal qx = vsub(vmul(ty, e1z), vmul(tz, e1y));
+        const vreal qy = vsub(vmul(tz, e1x), vmul(tx, e1z));
+        const vreal qz = vsub(vmul(tx, e1y), vmul(ty, e1x));
+        const vreal v = vmul(vadd(vadd(vmul(dx, qx), vmul(dy, qy)), vmul(dz, qz)), inv_det);
+        const vreal t = vmul(vadd(vadd(vmul(e2x, qx), vmul(e2y, qy)), vmul(e2z, qz)), inv_det);
+        const vreal inside = vand(u_inside, vand(vcmp<_CMP_GE_OQ>(v, zero), vcmp<_CMP_LE_OQ>(vadd(u, v), one)));
+        const int mask = vmovemask(vand(inside, vcmp<_CMP_GT_OQ>(t, tmin)));
+        if (mask == 0) continue;
+
+        alignas(32) real roots[lanes];
+        vstore(roots, t);
+        const uint32_t valid = std::min(lanes, count - n);
+        for (uint32_t lane = 0; lane < valid; ++lane) {
+            if (!(mask & (1 << lane)) || !(roots[lane] < closest_so_far)) continue;
+            closest_so_far = roots[lane];
+            best = first_block * lanes + n + lane;
+            best_t = roots[lane];
+            found = true;
+        }
+    }
+    return found;
+}
+#else
+bool triangle_soa::hit_avx2(uint32_t first_block, uint32_t count, const ray& r, real ray_tmin, real closest_so_far,
+                            uint32_t& best, real& best_t) const {
+    return hit_scalar(first_block, count, r, ray_tmin, closest_so_far, best, best_t);
+}
+#endif
+
+// Store
+
+primitive_store::primitive_store(std::vector<primitive> primitives, const std::vector<bvh_node>& nodes)
+    : _primitives(std::move(primitives)) {
+    index_leaves(_primitives.size(), nodes);
+
+    // nodes are depth-first, so leaves come in primitive order
+    for (const bvh_node& node : nodes) {
+        if (!node.is_leaf()) continue;
+
+        leaf_ranges& leaf = _leaves[leaf_index(node.offset)];
+        leaf.sphere_block = _spheres.begin_leaf();
+        leaf.cylinder_block = _cylinders.begin_leaf();
+        leaf.triangle_block = 0;
+        leaf.spheres = 0;
+        leaf.cylinders = 0;
+        leaf.triangles = 0;
+        leaf.instances = 0;
+        for (uint32_t i = node.offset; i < node.offset + node.primitive_count; ++i) {
+            switch (_primitives[i].type()) {
+                case primitive::kind::sphere:
+                    _spheres.add(_primitives[i].as<sphere>());
+                    ++leaf.spheres;
+                    break;
+                case primitive::kind::cylinder:
+                    _cylinders.add(_primitives[i].as<cylinder>());
+                    ++leaf.cylinders;
+                    break;
+                case primitive::kind::instance:
+                    ++leaf.instances;
+                    break;
+            }
+        }
+    }
+}
+
+primitive_store::primitive_store(std::shared_ptr<const triangle_mesh> mesh, const std::vector<uint32_t>& triangles,
+                                 const std::vector<bvh_node>& nodes)
+    : _mesh(std::move(mesh)), _triangles(_mesh->get_material().get()) {
+    index_leaves(triangles.size(), nodes);
+
+    for (const bvh_node& node : nodes) {
+        if (!node.is_leaf()) continue;
+
+        leaf_ranges& leaf = _leaves[leaf_index(node.offset)];
+        leaf.sphere_block = 0;
+        leaf.cylinder_block = 0;
+        leaf.triangle_block = _triangles.begin_leaf();
+        leaf.spheres = 0;
+        leaf.cylinders = 0;
+        leaf.triangles = node.primitive_count;
+        leaf.instances = 0;
+        for (uint32_t i = node.offset; i < node.offset + node.primitive_count; ++i) {
+            _triangles.add(*_mesh, triangles[i]);
+        }
+    }
+}
+
+void primitive_store::index_leaves(size_t count, const std::vector<bvh_node>& nodes) {
+    _leaf_starts.assign((count + 63) / 64, leaf_start_word{0, 0});
+    for (const bvh_node& node : nodes) {
+        if (node.is_leaf()) _leaf_starts[node.offset / 64].bits |= uint64_t{1} << (node.offset % 64);
+    }
+    uint32_t leaf_count = 0;
+    for (leaf_start_word& word : _leaf_starts) {
+        word.before = leaf_count;
+        leaf_count += static_cast<uint32_t>(std::popcount(word.bits));
+    }
+    _leaves.resize(leaf_count);
+}
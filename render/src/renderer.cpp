@@ -1,6 +1,11 @@
 #include <iostream>
 #include <iomanip> 
 #include <chrono>
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <memory>
+#include <sstream>
 
 #include "renderer.hpp"
 #include "material.hpp" 
@@ -9,7 +14,8 @@
 #include "ray.hpp"
 #include "camera.hpp"
 #include "math_utils.hpp"
-#include "../third_party/pcg_random_helper.hpp"
+#include "sampler.hpp"
+#include "vec3_bundle.hpp"
 
 #if defined(_OPENMP)
 #include <omp.h>
@@ -17,70 +23,490 @@
 static inline int omp_get_thread_num() { return 0; }
 #endif
 
-renderer::renderer(const camera& cam_, const hittable& world_)
-    : cam(cam_), world(world_) {}
+// Secondary rays start just off the surface they leave (see offset_ray_origin), so a hit
+// only has to lie in front of the origin
+static constexpr real ray_tmin = 0;
+
+// r's direction must be unit length
+static color background(const ray& r) {
+    auto t = 0.5 * (r.direction().y() + 1.0);
+
+    return (1.0 - t) * color(1.0, 1.0, 1.0)
+         + t * color(0.5, 0.7, 1.0);
+}
+
+bool parse_trace_mode(const std::string& name, trace_mode& mode) {
+    if (name == "single") {
+        mode = trace_mode::single;
+    } else if (name == "packet") {
+        mode = trace_mode::packet;
+    } else if (name == "stream") {
+        mode = trace_mode::stream;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::ostream& operator<<(std::ostream& out, const render_stats& stats) {
+    // formatted separately so the fixed-point progress bar settings do not apply
+    std::ostringstream text;
+    text << stats.rays() << " rays (" << stats.primary_rays << " primary) in " << stats.seconds
+         << " s, " << stats.rays_per_second() / 1e6 << " Mrays/s";
+    if (stats.roulette_kills > 0) {
+        text << ", " << stats.roulette_kills << " paths ended by roulette";
+    }
+    return out << text.str();
+}
+
+// Paths in flight per thread. Finished paths are replaced by new camera rays every bounce,
+// so the arrays stay full until the scanline runs out of samples.
+static constexpr size_t max_paths_in_flight = 1 << 14;
+
+// Lowest survival probability of Russian roulette, which bounds the weight a surviving
+// path can gain to 1 / min_survival and so keeps fireflies in check.
+static constexpr double min_survival = 0.05;
+
+// Adaptive sampling: every pixel first takes this many samples (at most samples_per_pixel)
+// so its variance estimate means something, and no pixel takes more than
+// adaptive_max_factor * samples_per_pixel.
+static constexpr int adaptive_min_samples = 16;
+static constexpr int adaptive_max_factor = 8;
+
+// Noise is measured as if the pixel were at least this bright, so the steep gamma curve near
+// black does not make nearly black pixels sample forever.
+static constexpr double noise_luminance_floor = 1e-3;
+
+// Pixels on either side whose noise also keeps a pixel sampling
+static constexpr int noise_block_radius = 2;
+
+// splitmix64 finalizer, to spread neighbouring pixels over unrelated generator states
+static uint64_t mix_bits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// State of every path in flight, structure-of-arrays. Slots [0, size) are in use.
+struct renderer::path_states {
+    std::vector<ray> rays;
+    std::vector<color> throughput; // product of the attenuations along the path so far
+    std::vector<uint32_t> pixel;   // column within the scanline
+    std::vector<int> depth;        // bounces left, counting the ray in `rays`
+    std::vector<color> radiance;   // gathered so far
+    std::vector<sample_stream> samples; // the sample's own random numbers
+    std::vector<hit_record> recs;
+    std::unique_ptr<bool[]> hits;
+    std::vector<uint8_t> alive;
+    size_t size = 0;
+    size_t first_new = 0; // slots [first_new, size) hold camera rays generated this round
+
+    // stream mode: sort keys, the resulting order, and gather buffers
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> order;
+    std::vector<ray> sorted_rays;
+    std::vector<color> sorted_throughput;
+    std::vector<uint32_t> sorted_pixel;
+    std::vector<int> sorted_depth;
+    std::vector<color> sorted_radiance;
+    std::vector<sample_stream> sorted_samples;
+
+    explicit path_states(size_t capacity)
+        : rays(capacity), throughput(capacity), pixel(capacity), depth(capacity), radiance(capacity), samples(capacity), recs(capacity),
+          hits(new bool[capacity]), alive(capacity), keys(capacity), order(capacity) {}
+
+    size_t capacity() const { return rays.size(); }
+};
+
+// One scanline: per pixel sums over the finished samples and the samples still to generate
+// in the current round. Kept per thread and reset for every row.
+struct renderer::row_context {
+    int x0;
+    int y = 0;
+    int width;
+    int samples_per_pixel;
+    int max_depth;
+    const sampler& pixel_sampler;
+    uint64_t pixel_seed = 0; // shared by the pixels of the row, see sample
+    uint64_t image_seed = 0; // shared by every row
+    render_stats stats;
+    std::vector<color> radiance;      // summed over samples
+    std::vector<double> luminance_sq; // squared sample luminance, summed
+    std::vector<int> samples;         // samples generated so far
+    std::vector<int> pending;         // samples still to generate this round
+    std::vector<double> pixel_noise;  // noise() of every pixel, between adaptive rounds
+    int next_pixel = 0;               // pixels before it have nothing pending
+
+    row_context(int x0_, int width_, int samples_per_pixel_, int max_depth_, const sampler& pixel_sampler_)
+        : x0(x0_), width(width_), samples_per_pixel(samples_per_pixel_), max_depth(max_depth_), pixel_sampler(pixel_sampler_),
+          radiance(width_), luminance_sq(width_), samples(width_), pending(width_), pixel_noise(width_) {}
+
+    void reset(int y_, uint64_t seed, int first_sample) {
+        y = y_;
+        pixel_seed = mix_bits(seed ^ mix_bits((static_cast<uint64_t>(y_) << 32) + static_cast<uint64_t>(first_sample)));
+        image_seed = mix_bits(seed ^ mix_bits(static_cast<uint64_t>(first_sample)));
+        stats = render_stats();
+        std::fill(radiance.begin(), radiance.end(), color(0, 0, 0));
+        std::fill(luminance_sq.begin(), luminance_sq.end(), 0.0);
+        std::fill(samples.begin(), samples.end(), 0);
+    }
+
+    // Random numbers of sample `index` of pixel i: the seed depends on the render's seed and
+    // the pixel, and every sample of the pixel gets its own pcg32 stream
+    sample_stream sample(int i, int index) const {
+        return sample_stream(pixel_sampler, x0 + i, y, mix_bits(pixel_seed + static_cast<uint64_t>(x0 + i)), image_seed,
+                             static_cast<uint32_t>(index));
+    }
+
+    // Standard error of the pixel's mean luminance after the gamma 2 transform of write_color,
+    // using d sqrt(x) = dx / (2 sqrt(x))
+    double noise(int i) const {
+        const int n = samples[i];
+        if (n < 2) return std::numeric_limits<double>::infinity();
+        const double mean = luminance(radiance[i]) / n;
+        const double variance = std::max(0.0, (luminance_sq[i] - n * mean * mean) / (n - 1));
+        return std::sqrt(variance / n) / (2.0 * std::sqrt(std::max(mean, noise_luminance_floor)));
+    }
+};
+
+renderer::renderer(const camera& cam_, const hittable& world_, const render_options& options_)
+    : cam(cam_), world(world_), options(options_) {
+    options.packet_size = std::clamp(options.packet_size, 1, render_options::max_packet_size);
+}
 
 std::vector<color> renderer::render_tile(
     int x0, int y0,
     int tile_width, int tile_height,
     int samples_per_pixel,
     int max_depth,
-    uint64_t seed
+    uint64_t seed,
+    render_stats* stats,
+    int first_sample
 ) const {
+    const auto start = std::chrono::steady_clock::now();
     std::vector<color> out_pixels(
         static_cast<size_t>(tile_width) *
         static_cast<size_t>(tile_height)
     );
 
-    #pragma omp parallel for schedule(dynamic)
-    for (int j = 0; j < tile_height; ++j) {
-        pcg32 rng(seed + omp_get_thread_num());
+    uint64_t primary_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t roulette_kills = 0;
+    uint64_t samples = 0;
+    const size_t capacity = std::max<size_t>(1, std::min(max_paths_in_flight,
+        static_cast<size_t>(tile_width) * static_cast<size_t>(std::max(samples_per_pixel, 0))));
 
-        if (omp_get_thread_num() == 0) {
-            print_progress(j, tile_height);
-        }
-        for (int i = 0; i < tile_width; ++i) {
-            color pixel_color(0, 0, 0);
+    const std::unique_ptr<sampler> pixel_sampler = make_sampler(options.sampler, samples_per_pixel);
 
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                // anti aliasing
-                ray r = cam.get_ray(x0 + i, y0 + j, rng);
-                pixel_color += ray_color(r, max_depth, rng);
+    #pragma omp parallel reduction(+:primary_rays, secondary_rays, roulette_kills, samples)
+    {
+        path_states paths(capacity);
+        row_context row(x0, tile_width, samples_per_pixel, max_depth, *pixel_sampler);
+
+        #pragma omp for schedule(dynamic)
+        for (int j = 0; j < tile_height; ++j) {
+            if (options.show_progress && omp_get_thread_num() == 0) {
+                print_progress(j, tile_height);
             }
 
-            out_pixels[
-                static_cast<size_t>(j) * tile_width +
-                static_cast<size_t>(i)
-            ] = pixel_color / samples_per_pixel;
+            row.reset(y0 + j, seed, first_sample);
+            render_row(row, paths);
+
+            color* out = &out_pixels[static_cast<size_t>(j) * tile_width];
+            for (int i = 0; i < tile_width; ++i) {
+                out[i] = row.samples[i] > 0 ? row.radiance[i] / row.samples[i] : color(0, 0, 0);
+            }
+            primary_rays += row.stats.primary_rays;
+            secondary_rays += row.stats.secondary_rays;
+            roulette_kills += row.stats.roulette_kills;
+            samples += row.stats.samples;
         }
     }
 
+    if (stats) {
+        stats->primary_rays = primary_rays;
+        stats->secondary_rays = secondary_rays;
+        stats->roulette_kills = roulette_kills;
+        stats->samples = samples;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
     return out_pixels;
 }
 
-color renderer::ray_color(const ray& r, int depth, pcg32& rng) const {
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
-        return color(0, 0, 0);
+// Renders one scanline. Without a noise threshold every pixel takes samples_per_pixel samples
+// in a single round. With one, every pixel starts with a few samples and later rounds give
+// more to the pixels still above the threshold, until they converge or the row has used
+// samples_per_pixel samples per pixel on average.
+void renderer::render_row(row_context& row, path_states& paths) const {
+    const int spp = std::max(row.samples_per_pixel, 0);
+    const bool adaptive = options.noise_threshold > 0.0;
+    std::fill(row.pending.begin(), row.pending.end(), adaptive ? std::min(spp, adaptive_min_samples) : spp);
+    trace_round(row, paths);
+    if (!adaptive) return;
 
-    hit_record rec;
-    // Use a slightly larger t_min to avoid self-intersection issues with floating point inaccuracies
-    if (world.hit(r, 0.005, std::numeric_limits<double>::infinity(), rec)) {
-        ray scattered;
-        color attenuation;
-        color emitted = rec.mat->emitted(rec);
+    const int max_samples = spp * adaptive_max_factor;
+    int64_t budget = static_cast<int64_t>(row.width) * spp - static_cast<int64_t>(row.stats.samples);
+    while (budget > 0) {
+        int active = 0;
+        for (int i = 0; i < row.width; ++i) {
+            row.pixel_noise[i] = row.noise(i);
+        }
+        for (int i = 0; i < row.width; ++i) {
+            // a pixel counts as noisy while any pixel of its block is, so one whose few
+            // samples happened to agree does not stop next to neighbours that did not
+            const int first = std::max(0, i - noise_block_radius);
+            const int last = std::min(row.width, i + noise_block_radius + 1);
+            const double block_noise = *std::max_element(row.pixel_noise.begin() + first, row.pixel_noise.begin() + last);
+            const bool noisy = row.samples[i] < max_samples && block_noise > options.noise_threshold;
+            row.pending[i] = noisy;
+            active += noisy;
+        }
+        if (active == 0) break;
+
+        // each noisy pixel at most doubles its samples, sharing the budget left evenly
+        const int64_t share = std::max<int64_t>(1, budget / active);
+        for (int i = 0; i < row.width; ++i) {
+            if (!row.pending[i]) continue;
+            const int64_t extra = std::min<int64_t>({row.samples[i], share, max_samples - row.samples[i], budget});
+            row.pending[i] = static_cast<int>(extra);
+            budget -= extra;
+        }
+        trace_round(row, paths);
+    }
+}
+
+// Runs the wavefront until every pending sample of the row is finished: each iteration tops
+// the path arrays up with camera rays, advances every path by one bounce and retires the
+// finished ones.
+void renderer::trace_round(row_context& row, path_states& paths) const {
+    row.next_pixel = 0;
+    paths.size = 0;
+    while (true) {
+        generate(row, paths);
+        if (paths.size == 0) break;
+        extend(row, paths);
+        shade(row, paths);
+        terminate(row, paths);
+    }
+}
 
-        if (rec.mat->scatter(r, rec, attenuation, scattered, rng))
-            return emitted + attenuation * ray_color(scattered, depth - 1, rng);
+void renderer::generate(row_context& row, path_states& paths) const {
+    paths.first_new = paths.size;
+    for (; row.next_pixel < row.width; ++row.next_pixel) {
+        const int i = row.next_pixel;
+        int& pending = row.pending[i];
+        row.samples[i] += pending;
+        row.stats.samples += pending;
+        // without any bounce a camera ray gathers no light, so there is nothing to trace
+        if (row.max_depth <= 0) {
+            pending = 0;
+        }
+        for (; pending > 0 && paths.size < paths.capacity(); --pending) {
+            const size_t k = paths.size++;
+            // anti aliasing
+            paths.samples[k] = row.sample(i, row.samples[i] - pending);
+            paths.rays[k] = cam.get_ray(row.x0 + i, row.y, paths.samples[k]);
+            paths.throughput[k] = color(1, 1, 1);
+            paths.radiance[k] = color(0, 0, 0);
+            paths.pixel[k] = static_cast<uint32_t>(i);
+            paths.depth[k] = row.max_depth;
+        }
+        if (pending > 0) {
+            // counted again when the pixel is resumed
+            row.samples[i] -= pending;
+            row.stats.samples -= pending;
+            break;
+        }
+    }
+}
+
+// Counting sort of keys[0, count) into order, stable so the result stays deterministic
+static void sort_by_key(const std::vector<uint32_t>& keys, size_t count, uint32_t key_count, std::vector<uint32_t>& order) {
+    std::vector<uint32_t> start(key_count + 1, 0);
+    for (size_t k = 0; k < count; ++k) ++start[keys[k] + 1];
+    for (uint32_t b = 0; b < key_count; ++b) start[b + 1] += start[b];
+    for (size_t k = 0; k < count; ++k) order[start[keys[k]]++] = static_cast<uint32_t>(k);
+}
 
-        return emitted;
+void renderer::extend(row_context& row, path_states& paths) const {
+    const size_t count = paths.size;
+    const real ray_tmax = std::numeric_limits<real>::infinity();
+
+    for (size_t k = 0; k < count; ++k) {
+        (paths.depth[k] == row.max_depth ? row.stats.primary_rays : row.stats.secondary_rays) += 1;
     }
 
-    vec3 unit_direction = unit_vector(r.direction());
-    auto t = 0.5 * (unit_direction.y() + 1.0);
+    if (options.mode == trace_mode::single) {
+        for (size_t k = 0; k < count; ++k) {
+            paths.hits[k] = world.hit(paths.rays[k], ray_tmin, ray_tmax, paths.recs[k]);
+        }
+        return;
+    }
 
-    return (1.0 - t) * color(1.0, 1.0, 1.0)
-         + t * color(0.5, 0.7, 1.0);
+    auto trace_batches = [&](size_t first, size_t last) {
+        for (size_t k = first; k < last; k += options.packet_size) {
+            const int n = static_cast<int>(std::min<size_t>(options.packet_size, last - k));
+            world.hit_batch(&paths.rays[k], n, ray_tmin, ray_tmax, &paths.recs[k], &paths.hits[k]);
+        }
+    };
+
+    if (options.mode == trace_mode::packet) {
+        // camera rays start their own packets so they can share a common origin
+        trace_batches(0, paths.first_new);
+        trace_batches(paths.first_new, count);
+        return;
+    }
+
+    // stream: octant and dominant axis of the direction, so a batch walks similar nodes
+    for (size_t k = 0; k < count; ++k) {
+        const vec3& d = paths.rays[k].direction();
+        const uint32_t octant = (d.x() < 0) | (d.y() < 0) << 1 | (d.z() < 0) << 2;
+        const real ax = std::fabs(d.x()), ay = std::fabs(d.y()), az = std::fabs(d.z());
+        const uint32_t axis = ax >= ay && ax >= az ? 0 : (ay >= az ? 1 : 2);
+        paths.keys[k] = octant * 3 + axis;
+    }
+    sort_by_key(paths.keys, count, 24, paths.order);
+
+    paths.sorted_rays.resize(paths.capacity());
+    paths.sorted_throughput.resize(paths.capacity());
+    paths.sorted_pixel.resize(paths.capacity());
+    paths.sorted_depth.resize(paths.capacity());
+    paths.sorted_radiance.resize(paths.capacity());
+    paths.sorted_samples.resize(paths.capacity());
+    for (size_t k = 0; k < count; ++k) {
+        const uint32_t from = paths.order[k];
+        paths.sorted_rays[k] = paths.rays[from];
+        paths.sorted_throughput[k] = paths.throughput[from];
+        paths.sorted_pixel[k] = paths.pixel[from];
+        paths.sorted_depth[k] = paths.depth[from];
+        paths.sorted_radiance[k] = paths.radiance[from];
+        paths.sorted_samples[k] = paths.samples[from];
+    }
+    std::swap(paths.rays, paths.sorted_rays);
+    std::swap(paths.throughput, paths.sorted_throughput);
+    std::swap(paths.pixel, paths.sorted_pixel);
+    std::swap(paths.depth, paths.sorted_depth);
+    std::swap(paths.radiance, paths.sorted_radiance);
+    std::swap(paths.samples, paths.sorted_samples);
+
+    trace_batches(0, count);
+}
+
+// Continues a path with probability equal to its largest throughput channel and divides the
+// survivor's throughput by that probability, so the expected radiance is unchanged while
+// paths that can only add little light stop early.
+static bool survives_roulette(color& throughput, sample_stream& samples) {
+    const double p = std::clamp<double>(std::max({throughput.x(), throughput.y(), throughput.z()}), min_survival, 1.0);
+    if (p >= 1.0) {
+        return true;
+    }
+    if (samples.next_1d() >= p) {
+        return false;
+    }
+    throughput = throughput / p;
+    return true;
+}
+
+// Replaces the direction of every ray by its unit vector, a bundle at a time
+static void normalize_directions(ray* rays, size_t count) {
+    vec3_bundle directions;
+    for (size_t first = 0; first < count; first += vec3_bundle::width) {
+        const int n = static_cast<int>(std::min<size_t>(vec3_bundle::width, count - first));
+        for (int i = 0; i < vec3_bundle::width; ++i) {
+            directions.set(i, i < n ? rays[first + i].direction() : vec3(1, 0, 0));
+        }
+        unit_vector(directions, directions);
+        for (int i = 0; i < n; ++i) {
+            rays[first + i] = ray(rays[first + i].origin(), directions.get(i));
+        }
+    }
+}
+
+// Adds what each path gathers at its hit (or from the sky) and scatters it into its next
+// ray. This is one level of the old recursion: emitted + attenuation * (rest of the path).
+void renderer::shade(row_context& row, path_states& paths) const {
+    const size_t count = paths.size;
+    // the sky and the materials look at the incoming direction only once it is a unit vector
+    normalize_directions(paths.rays.data(), count);
+
+    if (options.mode == trace_mode::stream) {
+        // misses first, then hits grouped by material in order of first appearance
+        std::unordered_map<const material*, uint32_t> material_ids;
+        for (size_t k = 0; k < count; ++k) {
+            if (!paths.hits[k]) {
+                paths.keys[k] = 0;
+                continue;
+            }
+            auto it = material_ids.emplace(paths.recs[k].mat, static_cast<uint32_t>(material_ids.size() + 1)).first;
+            paths.keys[k] = it->second;
+        }
+        sort_by_key(paths.keys, count, static_cast<uint32_t>(material_ids.size() + 1), paths.order);
+    } else {
+        for (size_t k = 0; k < count; ++k) {
+            paths.order[k] = static_cast<uint32_t>(k);
+        }
+    }
+
+    for (size_t n = 0; n < count; ++n) {
+        const uint32_t k = paths.order[n];
+        color& radiance = paths.radiance[k];
+        if (!paths.hits[k]) {
+            radiance += paths.throughput[k] * background(paths.rays[k]);
+            paths.alive[k] = false;
+            continue;
+        }
+
+        const hit_record& rec = paths.recs[k];
+        radiance += paths.throughput[k] * rec.mat->emitted(rec);
+
+        ray scattered;
+        color attenuation;
+        sample_stream& samples = paths.samples[k];
+        const int bounce = row.max_depth - paths.depth[k];
+        samples.start_bounce(bounce);
+        if (rec.mat->scatter(paths.rays[k], rec, attenuation, scattered, samples)) {
+            paths.rays[k] = ray(offset_ray_origin(rec.p, rec.normal, scattered.direction()), scattered.direction());
+            paths.throughput[k] = paths.throughput[k] * attenuation;
+            // past the bounce limit no more light is gathered
+            paths.alive[k] = --paths.depth[k] > 0;
+            if (paths.alive[k] && options.roulette_depth > 0 && bounce + 1 >= options.roulette_depth) {
+                samples.start_bounce(bounce, sample_stream::roulette_dimension);
+                paths.alive[k] = survives_roulette(paths.throughput[k], samples);
+                row.stats.roulette_kills += !paths.alive[k];
+            }
+        } else {
+            paths.alive[k] = false;
+        }
+    }
+}
+
+// Adds finished paths to their pixel's sums and moves the survivors to the front in their
+// current order.
+void renderer::terminate(row_context& row, path_states& paths) const {
+    size_t live = 0;
+    for (size_t k = 0; k < paths.size; ++k) {
+        if (!paths.alive[k]) {
+            const uint32_t pixel = paths.pixel[k];
+            const double l = luminance(paths.radiance[k]);
+            row.radiance[pixel] += paths.radiance[k];
+            row.luminance_sq[pixel] += l * l;
+            continue;
+        }
+        if (live != k) {
+            paths.rays[live] = paths.rays[k];
+            paths.throughput[live] = paths.throughput[k];
+            paths.pixel[live] = paths.pixel[k];
+            paths.depth[live] = paths.depth[k];
+            paths.radiance[live] = paths.radiance[k];
+            paths.samples[live] = paths.samples[k];
+        }
+        ++live;
+    }
+    paths.size = live;
 }
 
 void renderer::print_progress(int current_scanline, int total_scanlines) const {
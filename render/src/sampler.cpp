@@ -0,0 +1,316 @@
+#include "sampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+bool parse_sampler_kind(const std::string& name, sampler_kind& kind) {
+    if (name == "independent") {
+        kind = sampler_kind::independent;
+    } else if (name == "stratified") {
+        kind = sampler_kind::stratified;
+    } else if (name == "sobol") {
+        kind = sampler_kind::sobol;
+    } else if (name == "bluenoise") {
+        kind = sampler_kind::blue_noise;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* sampler_kind_name(sampler_kind kind) {
+    switch (kind) {
+        case sampler_kind::independent: return "independent";
+        case sampler_kind::stratified: return "stratified";
+        case sampler_kind::sobol: return "sobol";
+        case sampler_kind::blue_noise: return "bluenoise";
+    }
+    return "unknown";
+}
+
+namespace {
+
+// splitmix64 finalizer
+uint64_t mix_bits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// A 32 bit seed for `dimension` of the stream of `seed`
+uint32_t hash_dimension(uint64_t seed, uint32_t dimension) {
+    return static_cast<uint32_t>(mix_bits(seed ^ (0x9e3779b97f4a7c15ULL * (dimension + 1))));
+}
+
+double to_unit(uint32_t x) {
+    return x * 0x1p-32;
+}
+
+uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// The first two dimensions of the Sobol sequence: the van der Corput sequence, and the one
+// whose direction numbers follow v_i = v_{i-1} ^ (v_{i-1} >> 1)
+uint32_t sobol(uint32_t index, int dimension) {
+    if (dimension == 0) {
+        return reverse_bits(index);
+    }
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) result ^= v;
+    }
+    return result;
+}
+
+// Hash-based Owen scrambling (Burley 2020): a Laine-Karras style permutation applied to the
+// reversed bits flips every bit depending only on the bits above it, which keeps the
+// stratification of the points while decorrelating different seeds.
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverse_bits(x);
+}
+
+// Owen-scrambled Sobol points, one independently shuffled and scrambled 1D or 2D point set
+// per dimension (pair), so every pair is well stratified without a table of directions.
+double owen_sobol_1d(uint32_t index, uint32_t seed) {
+    const uint32_t shuffled = nested_uniform_scramble(index, seed);
+    return to_unit(nested_uniform_scramble(sobol(shuffled, 0), seed ^ 0xa511e9b3u));
+}
+
+void owen_sobol_2d(uint32_t index, uint32_t seed, double& u, double& v) {
+    const uint32_t shuffled = nested_uniform_scramble(index, seed);
+    u = to_unit(nested_uniform_scramble(sobol(shuffled, 0), seed ^ 0xa511e9b3u));
+    v = to_unit(nested_uniform_scramble(sobol(shuffled, 1), seed ^ 0x63d83595u));
+}
+
+// Element i of a pseudo-random permutation of [0, length) chosen by seed (Kensler 2013)
+uint32_t permute(uint32_t i, uint32_t length, uint32_t seed) {
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + seed) % length;
+}
+
+class independent_sampler : public sampler {
+  public:
+    double get_1d(sample_stream& s, uint32_t) const override {
+        return nextDouble(s.rng);
+    }
+    void get_2d(sample_stream& s, uint32_t, double& u, double& v) const override {
+        u = nextDouble(s.rng);
+        v = nextDouble(s.rng);
+    }
+};
+
+// Jittered sampling: sample i of a pixel falls in stratum permute(i) of every dimension, a
+// different permutation per dimension and pixel. Samples past samples_per_pixel (adaptive
+// sampling) start over at the first stratum.
+class stratified_sampler : public sampler {
+  public:
+    explicit stratified_sampler(int samples_per_pixel)
+        : _count(static_cast<uint32_t>(std::max(samples_per_pixel, 1))) {
+        _columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(_count))));
+        _rows = (_count + _columns - 1) / _columns;
+    }
+
+    double get_1d(sample_stream& s, uint32_t dimension) const override {
+        const uint32_t stratum = permute(s.index % _count, _count, hash_dimension(s.pixel_seed, dimension));
+        return (stratum + nextDouble(s.rng)) / _count;
+    }
+
+    void get_2d(sample_stream& s, uint32_t dimension, double& u, double& v) const override {
+        const uint32_t cells = _columns * _rows;
+        const uint32_t cell = permute(s.index % _count, cells, hash_dimension(s.pixel_seed, dimension));
+        u = (cell % _columns + nextDouble(s.rng)) / _columns;
+        v = (cell / _columns + nextDouble(s.rng)) / _rows;
+    }
+
+  private:
+    uint32_t _count;
+    uint32_t _columns;
+    uint32_t _rows;
+};
+
+class sobol_sampler : public sampler {
+  public:
+    double get_1d(sample_stream& s, uint32_t dimension) const override {
+        return owen_sobol_1d(s.index, hash_dimension(s.pixel_seed, dimension));
+    }
+    void get_2d(sample_stream& s, uint32_t dimension, double& u, double& v) const override {
+        owen_sobol_2d(s.index, hash_dimension(s.pixel_seed, dimension), u, v);
+    }
+};
+
+// Side of the tileable blue-noise mask
+constexpr int mask_size = 64;
+
+// A mask_size x mask_size threshold map whose values (0 to 1) are ranked by Ulichney's
+// void-and-cluster method, so every threshold level is a blue-noise point set. Computed
+// once, in a few tens of milliseconds.
+std::vector<float> make_blue_noise_mask() {
+    constexpr int n = mask_size * mask_size;
+    constexpr int wrap = mask_size - 1;
+    constexpr double sigma = 1.5;
+
+    // Gaussian energy kernel on the torus, indexed by offset
+    std::vector<double> kernel(n);
+    for (int dy = 0; dy < mask_size; ++dy) {
+        for (int dx = 0; dx < mask_size; ++dx) {
+            const int ex = std::min(dx, mask_size - dx);
+            const int ey = std::min(dy, mask_size - dy);
+            kernel[dy * mask_size + dx] = std::exp(-(ex * ex + ey * ey) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<uint8_t> ones(n, 0);
+    std::vector<double> energy(n, 0.0);
+    auto toggle = [&](int p, bool set) {
+        ones[p] = set;
+        const double sign = set ? 1.0 : -1.0;
+        const int px = p % mask_size, py = p / mask_size;
+        for (int y = 0; y < mask_size; ++y) {
+            const double* row = &kernel[((y - py) & wrap) * mask_size];
+            for (int x = 0; x < mask_size; ++x) {
+                energy[y * mask_size + x] += sign * row[(x - px) & wrap];
+            }
+        }
+    };
+    auto tightest_cluster = [&] {
+        int best = -1;
+        for (int p = 0; p < n; ++p) {
+            if (ones[p] && (best < 0 || energy[p] > energy[best])) best = p;
+        }
+        return best;
+    };
+    auto largest_void = [&] {
+        int best = -1;
+        for (int p = 0; p < n; ++p) {
+            if (!ones[p] && (best < 0 || energy[p] < energy[best])) best = p;
+        }
+        return best;
+    };
+
+    // initial pattern: random points, relaxed by moving the tightest cluster into the largest void
+    const int initial = n / 10;
+    pcg32 rng(0x853c49e6748fea9bULL);
+    for (int placed = 0; placed < initial;) {
+        const int p = static_cast<int>(rng(static_cast<uint32_t>(n)));
+        if (!ones[p]) {
+            toggle(p, true);
+            ++placed;
+        }
+    }
+    while (true) {
+        const int cluster = tightest_cluster();
+        toggle(cluster, false);
+        const int hole = largest_void();
+        toggle(hole, true);
+        if (hole == cluster) break;
+    }
+
+    std::vector<uint32_t> rank(n);
+    const std::vector<uint8_t> initial_ones = ones;
+    const std::vector<double> initial_energy = energy;
+    // the initial points get the lowest ranks, tightest clusters first to go
+    for (int r = initial - 1; r >= 0; --r) {
+        const int cluster = tightest_cluster();
+        toggle(cluster, false);
+        rank[cluster] = static_cast<uint32_t>(r);
+    }
+    // the rest fill the largest voids in turn
+    ones = initial_ones;
+    energy = initial_energy;
+    for (int r = initial; r < n; ++r) {
+        const int hole = largest_void();
+        toggle(hole, true);
+        rank[hole] = static_cast<uint32_t>(r);
+    }
+
+    std::vector<float> mask(n);
+    for (int p = 0; p < n; ++p) {
+        mask[p] = (rank[p] + 0.5f) / n;
+    }
+    return mask;
+}
+
+const std::vector<float>& blue_noise_mask() {
+    static const std::vector<float> mask = make_blue_noise_mask();
+    return mask;
+}
+
+// Every pixel walks the same Owen-scrambled Sobol sequence, shifted modulo 1 by the blue-noise
+// mask (toroidally offset per dimension). Neighbouring pixels thus get very different shifts
+// and their errors, while as large as with sobol_sampler, form blue noise that is much less
+// visible than white noise at low sample counts (Georgiev and Fajardo 2016, Heitz et al. 2019).
+class blue_noise_sampler : public sampler {
+  public:
+    blue_noise_sampler() : _mask(blue_noise_mask()) {}
+
+    double get_1d(sample_stream& s, uint32_t dimension) const override {
+        return shift(owen_sobol_1d(s.index, hash_dimension(s.image_seed, dimension)), s, dimension);
+    }
+
+    void get_2d(sample_stream& s, uint32_t dimension, double& u, double& v) const override {
+        owen_sobol_2d(s.index, hash_dimension(s.image_seed, dimension), u, v);
+        u = shift(u, s, dimension);
+        v = shift(v, s, dimension + 1);
+    }
+
+  private:
+    double shift(double u, const sample_stream& s, uint32_t dimension) const {
+        const uint32_t offset = hash_dimension(s.image_seed ^ 0x5bd1e995ULL, dimension);
+        const int x = (s.x + static_cast<int>(offset & 0xffff)) & (mask_size - 1);
+        const int y = (s.y + static_cast<int>(offset >> 16)) & (mask_size - 1);
+        u += _mask[y * mask_size + x];
+        return u >= 1.0 ? u - 1.0 : u;
+    }
+
+    const std::vector<float>& _mask;
+};
+
+}
+
+std::unique_ptr<sampler> make_sampler(sampler_kind kind, int samples_per_pixel) {
+    switch (kind) {
+        case sampler_kind::stratified: return std::make_unique<stratified_sampler>(samples_per_pixel);
+        case sampler_kind::sobol: return std::make_unique<sobol_sampler>();
+        case sampler_kind::blue_noise: return std::make_unique<blue_noise_sampler>();
+        case sampler_kind::independent: break;
+    }
+    return std::make_unique<independent_sampler>();
+}
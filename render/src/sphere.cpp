@@ -1,19 +1,16 @@
 #include "sphere.hpp"
 
-bool sphere::hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const {
-    vec3 oc = r.origin() - center;
-    auto a = r.direction().length_squared();
-    auto half_b = dot(oc, r.direction());
-    auto c = oc.length_squared() - radius*radius;
+#include "math_utils.hpp"
 
-    auto discriminant = half_b*half_b - a*c;
-    if (discriminant < 0) return false;
-    auto sqrtd = std::sqrt(discriminant);
+bool sphere::hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const {
+    vec3 oc = r.origin() - center;
+    real near_root, far_root;
+    if (!solve_radius_quadratic(oc, r.direction(), radius*radius, near_root, far_root)) return false;
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    auto root = near_root;
     if (root <= ray_tmin || ray_tmax <= root) {
-        root = (-half_b + sqrtd) / a;
+        root = far_root;
         if (root <= ray_tmin || ray_tmax <= root)
             return false;
     }
@@ -22,7 +19,7 @@ bool sphere::hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat = mat;
+    rec.mat = mat.get();
 
     return true;
 }
@@ -0,0 +1,109 @@
+#include "transform.hpp"
+
+#include <cmath>
+
+#include "math_utils.hpp"
+
+transform::transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+transform transform::translate(const vec3& offset) {
+    transform t;
+    for (int i = 0; i < 3; ++i) t.m[i][3] = offset[i];
+    return t;
+}
+
+transform transform::scale(const vec3& factors) {
+    transform t;
+    for (int i = 0; i < 3; ++i) t.m[i][i] = factors[i];
+    return t;
+}
+
+// Rodrigues' rotation formula
+transform transform::rotate(const vec3& axis, double degrees) {
+    const vec3 u = unit_vector(axis);
+    const real c = std::cos(degrees_to_radians(degrees));
+    const real s = std::sin(degrees_to_radians(degrees));
+    transform t;
+    t.m[0][0] = c + u.x() * u.x() * (1 - c);
+    t.m[0][1] = u.x() * u.y() * (1 - c) - u.z() * s;
+    t.m[0][2] = u.x() * u.z() * (1 - c) + u.y() * s;
+    t.m[1][0] = u.y() * u.x() * (1 - c) + u.z() * s;
+    t.m[1][1] = c + u.y() * u.y() * (1 - c);
+    t.m[1][2] = u.y() * u.z() * (1 - c) - u.x() * s;
+    t.m[2][0] = u.z() * u.x() * (1 - c) - u.y() * s;
+    t.m[2][1] = u.z() * u.y() * (1 - c) + u.x() * s;
+    t.m[2][2] = c + u.z() * u.z() * (1 - c);
+    return t;
+}
+
+transform transform::then(const transform& next) const {
+    transform t;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            t.m[i][j] = next.m[i][0] * m[0][j] + next.m[i][1] * m[1][j] + next.m[i][2] * m[2][j];
+        }
+        t.m[i][3] += next.m[i][3];
+    }
+    return t;
+}
+
+bool transform::inverse(transform& out) const {
+    // adjugate over determinant for the linear part, then -M^-1 t for the translation
+    const real c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    const real c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    const real c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    const real det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (det == 0 || !std::isfinite(det)) {
+        return false;
+    }
+    const real inv_det = 1 / det;
+
+    transform t;
+    t.m[0][0] = c00 * inv_det;
+    t.m[1][0] = c01 * inv_det;
+    t.m[2][0] = c02 * inv_det;
+    t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+    for (int i = 0; i < 3; ++i) {
+        t.m[i][3] = -(t.m[i][0] * m[0][3] + t.m[i][1] * m[1][3] + t.m[i][2] * m[2][3]);
+    }
+    out = t;
+    return true;
+}
+
+point3 transform::point(const point3& p) const {
+    return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                  m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                  m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+}
+
+vec3 transform::vector(const vec3& v) const {
+    return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+}
+
+vec3 transform::transposed_vector(const vec3& v) const {
+    return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+}
+
+// Per output axis, each input axis contributes its smaller and larger product (Arvo)
+aabb transform::box(const aabb& b) const {
+    point3 lo, hi;
+    for (int i = 0; i < 3; ++i) {
+        lo[i] = hi[i] = m[i][3];
+        for (int j = 0; j < 3; ++j) {
+            const real e0 = m[i][j] * b.min()[j];
+            const real e1 = m[i][j] * b.max()[j];
+            lo[i] += std::min(e0, e1);
+            hi[i] += std::max(e0, e1);
+        }
+    }
+    return aabb(lo, hi);
+}
@@ -0,0 +1,35 @@
+#include "triangle.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+bool triangle::intersect(const point3& v0, const vec3& e1, const vec3& e2, const ray& r,
+                         real ray_tmin, real ray_tmax, real& t) {
+    const vec3 pvec = cross(r.direction(), e2);
+    const real inv_det = 1 / dot(e1, pvec);
+    const vec3 tvec = r.origin() - v0;
+    const real u = dot(tvec, pvec) * inv_det;
+    if (!(u >= 0 && u <= 1)) return false;
+
+    const vec3 qvec = cross(tvec, e1);
+    const real v = dot(r.direction(), qvec) * inv_det;
+    if (!(v >= 0 && u + v <= 1)) return false;
+
+    const real root = dot(e2, qvec) * inv_det;
+    if (!(root > ray_tmin && root < ray_tmax)) return false;
+    t = root;
+    return true;
+}
+
+aabb triangle::bounding_box(const triangle_mesh& mesh, uint32_t t) {
+    const point3 a = mesh.corner(t, 0), b = mesh.corner(t, 1), c = mesh.corner(t, 2);
+    point3 lo, hi;
+    for (int i = 0; i < 3; ++i) {
+        lo[i] = std::min({a[i], b[i], c[i]});
+        hi[i] = std::max({a[i], b[i], c[i]});
+    }
+    // an axis-aligned triangle has a flat box, which a slab test never hits; give it depth
+    const real pad = 1e-5 * std::max({real(1), std::fabs(lo.x()), std::fabs(lo.y()), std::fabs(lo.z()),
+                                      std::fabs(hi.x()), std::fabs(hi.y()), std::fabs(hi.z())});
+    return aabb(lo - vec3(pad, pad, pad), hi + vec3(pad, pad, pad));
+}
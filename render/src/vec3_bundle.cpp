@@ -0,0 +1,148 @@
+#include "vec3_bundle.hpp"
+
+#include "simd_real.hpp"
+
+namespace {
+
+constexpr int width = vec3_bundle::width;
+
+void dot_scalar(const vec3_bundle& u, const vec3_bundle& v, real_bundle& out) {
+    for (int i = 0; i < width; ++i) out[i] = dot(u.get(i), v.get(i));
+}
+
+void cross_scalar(const vec3_bundle& u, const vec3_bundle& v, vec3_bundle& out) {
+    for (int i = 0; i < width; ++i) out.set(i, cross(u.get(i), v.get(i)));
+}
+
+void unit_vector_scalar(const vec3_bundle& v, vec3_bundle& out) {
+    for (int i = 0; i < width; ++i) out.set(i, unit_vector(v.get(i)));
+}
+
+void reflect_scalar(const vec3_bundle& v, const vec3_bundle& n, vec3_bundle& out) {
+    for (int i = 0; i < width; ++i) out.set(i, reflect(v.get(i), n.get(i)));
+}
+
+void refract_scalar(const vec3_bundle& uv, const vec3_bundle& n, const real_bundle& etai_over_etat, vec3_bundle& out) {
+    for (int i = 0; i < width; ++i) out.set(i, refract(uv.get(i), n.get(i), etai_over_etat[i]));
+}
+
+#if defined(RT_HAVE_AVX2_KERNELS)
+using namespace simd;
+
+// The components of `lanes` consecutive lanes of a bundle, starting at lane i
+struct vvec3 {
+    vreal x, y, z;
+};
+
+RT_TARGET_AVX2 inline vvec3 vload3(const vec3_bundle& v, int i) {
+    return {vload(v.x + i), vload(v.y + i), vload(v.z + i)};
+}
+
+RT_TARGET_AVX2 inline void vstore3(vec3_bundle& out, int i, const vvec3& v) {
+    vstore(out.x + i, v.x);
+    vstore(out.y + i, v.y);
+    vstore(out.z + i, v.z);
+}
+
+RT_TARGET_AVX2 inline vreal vdot(const vvec3& u, const vvec3& v) {
+    return vadd(vadd(vmul(u.x, v.x), vmul(u.y, v.y)), vmul(u.z, v.z));
+}
+
+RT_TARGET_AVX2 inline vvec3 vscale(vreal t, const vvec3& v) {
+    return {vmul(t, v.x), vmul(t, v.y), vmul(t, v.z)};
+}
+
+RT_TARGET_AVX2
+void dot_avx2(const vec3_bundle& u, const vec3_bundle& v, real_bundle& out) {
+    for (int i = 0; i < width; i += lanes) {
+        vstore(out.v + i, vdot(vload3(u, i), vload3(v, i)));
+    }
+}
+
+RT_TARGET_AVX2
+void cross_avx2(const vec3_bundle& u, const vec3_bundle& v, vec3_bundle& out) {
+    for (int i = 0; i < width; i += lanes) {
+        const vvec3 a = vload3(u, i);
+        const vvec3 b = vload3(v, i);
+        vstore3(out, i, {vsub(vmul(a.y, b.z), vmul(a.z, b.y)),
+                         vsub(vmul(a.z, b.x), vmul(a.x, b.z)),
+                         vsub(vmul(a.x, b.y), vmul(a.y, b.x))});
+    }
+}
+
+// As vec3's operator/, a reciprocal and three multiplications
+RT_TARGET_AVX2
+void unit_vector_avx2(const vec3_bundle& v, vec3_bundle& out) {
+    const vreal one = vset1(1);
+    for (int i = 0; i < width; i += lanes) {
+        const vvec3 a = vload3(v, i);
+        vstore3(out, i, vscale(vdiv(one, vsqrt(vdot(a, a))), a));
+    }
+}
+
+RT_TARGET_AVX2
+void reflect_avx2(const vec3_bundle& v, const vec3_bundle& n, vec3_bundle& out) {
+    const vreal two = vset1(2);
+    for (int i = 0; i < width; i += lanes) {
+        const vvec3 a = vload3(v, i);
+        const vvec3 b = vload3(n, i);
+        const vvec3 along = vscale(vmul(two, vdot(a, b)), b);
+        vstore3(out, i, {vsub(a.x, along.x), vsub(a.y, along.y), vsub(a.z, along.z)});
+    }
+}
+
+RT_TARGET_AVX2
+void refract_avx2(const vec3_bundle& uv, const vec3_bundle& n, const real_bundle& etai_over_etat, vec3_bundle& out) {
+    const vreal one = vset1(1);
+    const vreal sign = vset1(-0.0);
+    for (int i = 0; i < width; i += lanes) {
+        const vvec3 u = vload3(uv, i);
+        const vvec3 m = vload3(n, i);
+        // dot(-uv, n) is exactly -dot(uv, n); vmin returns its second operand for NaN, as fmin does
+        const vreal cos_theta = vmin(vxor(vdot(u, m), sign), one);
+        const vvec3 perp = vscale(vload(etai_over_etat.v + i), {vadd(u.x, vmul(cos_theta, m.x)),
+                                                                vadd(u.y, vmul(cos_theta, m.y)),
+                                                                vadd(u.z, vmul(cos_theta, m.z))});
+        const vreal k = vxor(vsqrt(vandnot(sign, vsub(one, vdot(perp, perp)))), sign);
+        const vvec3 parallel = vscale(k, m);
+        vstore3(out, i, {vadd(perp.x, parallel.x), vadd(perp.y, parallel.y), vadd(perp.z, parallel.z)});
+    }
+}
+#endif
+
+}
+
+void dot(const vec3_bundle& u, const vec3_bundle& v, real_bundle& out) {
+#if defined(RT_HAVE_AVX2_KERNELS)
+    if (cpu_supports_avx2()) return dot_avx2(u, v, out);
+#endif
+    dot_scalar(u, v, out);
+}
+
+void cross(const vec3_bundle& u, const vec3_bundle& v, vec3_bundle& out) {
+#if defined(RT_HAVE_AVX2_KERNELS)
+    if (cpu_supports_avx2()) return cross_avx2(u, v, out);
+#endif
+    cross_scalar(u, v, out);
+}
+
+void unit_vector(const vec3_bundle& v, vec3_bundle& out) {
+#if defined(RT_HAVE_AVX2_KERNELS)
+    if (cpu_supports_avx2()) return unit_vector_avx2(v, out);
+#endif
+    unit_vector_scalar(v, out);
+}
+
+void reflect(const vec3_bundle& v, const vec3_bundle& n, vec3_bundle& out) {
+#if defined(RT_HAVE_AVX2_KERNELS)
+    if (cpu_supports_avx2()) return reflect_avx2(v, n, out);
+#endif
+    reflect_scalar(v, n, out);
+}
+
+void refract(const vec3_bundle& uv, const vec3_bundle& n, const real_bundle& etai_over_etat, vec3_bundle& out) {
+#if defined(RT_HAVE_AVX2_KERNELS)
+    if (cpu_supports_avx2()) return refract_avx2(uv, n, etai_over_etat, out);
+#endif
+    refract_scalar(uv, n, etai_over_etat, out);
+}
@@ -0,0 +1,285 @@
+#include "wide_bvh.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+
+#include "cpu_features.hpp"
+
+#if defined(RT_X86)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Ray data in the precision and layout of the node bounds.
+struct simd_ray {
+    float origin[3];
+    float inv_dir[3];
+    int neg[3]; // sign bit of the direction, so -0 counts as negative like its 1/-0 = -inf
+};
+
+// Slightly widens the far distance so float rounding in the slab test cannot drop a
+// box the ray grazes; the primitive tests decide the actual hit at full precision.
+constexpr float far_scale = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+// The near plane is picked by direction sign rather than taking min/max of the two slab
+// distances: unused slots (min = +inf, max = -inf) then always miss, and a NaN from
+// 0 * inf (origin on a plane of an axis the ray is parallel to) leaves the running
+// interval untouched instead of poisoning it.
+template <int N>
+int slab_test_scalar(const wide_bvh_node<N>& node, const simd_ray& r, float tmin, float tmax, float* tnear_out) {
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float tnear = tmin;
+        float tfar = tmax;
+        for (int a = 0; a < 3; ++a) {
+            const float near_plane = r.neg[a] ? node.bounds_max[a][i] : node.bounds_min[a][i];
+            const float far_plane = r.neg[a] ? node.bounds_min[a][i] : node.bounds_max[a][i];
+            const float t0 = (near_plane - r.origin[a]) * r.inv_dir[a];
+            const float t1 = (far_plane - r.origin[a]) * r.inv_dir[a];
+            tnear = t0 > tnear ? t0 : tnear;
+            tfar = t1 < tfar ? t1 : tfar;
+        }
+        tnear_out[i] = tnear;
+        if (tnear <= tfar * far_scale) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#if defined(RT_X86)
+// SSE is part of x86-64, so the 4-wide kernel needs no runtime check. _mm_max_ps and
+// _mm_min_ps return their second operand when either is NaN, which gives the same NaN
+// handling as the scalar kernel.
+int slab_test_sse(const wide_bvh_node<4>& node, const simd_ray& r, float tmin, float tmax, float* tnear_out) {
+    __m128 tnear = _mm_set1_ps(tmin);
+    __m128 tfar = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; ++a) {
+        const __m128 origin = _mm_set1_ps(r.origin[a]);
+        const __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+        const __m128 near_plane = _mm_load_ps(r.neg[a] ? node.bounds_max[a] : node.bounds_min[a]);
+        const __m128 far_plane = _mm_load_ps(r.neg[a] ? node.bounds_min[a] : node.bounds_max[a]);
+        tnear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, origin), inv_dir), tnear);
+        tfar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, origin), inv_dir), tfar);
+    }
+    _mm_storeu_ps(tnear_out, tnear);
+    return _mm_movemask_ps(_mm_cmple_ps(tnear, _mm_mul_ps(tfar, _mm_set1_ps(far_scale))));
+}
+
+#if defined(RT_HAVE_AVX2_KERNELS)
+RT_TARGET_AVX2
+int slab_test_avx2(const wide_bvh_node<8>& node, const simd_ray& r, float tmin, float tmax, float* tnear_out) {
+    __m256 tnear = _mm256_set1_ps(tmin);
+    __m256 tfar = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; ++a) {
+        const __m256 origin = _mm256_set1_ps(r.origin[a]);
+        const __m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+        const __m256 near_plane = _mm256_load_ps(r.neg[a] ? node.bounds_max[a] : node.bounds_min[a]);
+        const __m256 far_plane = _mm256_load_ps(r.neg[a] ? node.bounds_min[a] : node.bounds_max[a]);
+        tnear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, origin), inv_dir), tnear);
+        tfar = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, origin), inv_dir), tfar);
+    }
+    _mm256_storeu_ps(tnear_out, tnear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tnear, _mm256_mul_ps(tfar, _mm256_set1_ps(far_scale)), _CMP_LE_OQ));
+}
+#endif
+#endif
+
+template <int N>
+bool simd_supported();
+
+template <>
+bool simd_supported<4>() {
+#if defined(RT_X86)
+    return true;
+#else
+    return false;
+#endif
+}
+
+template <>
+bool simd_supported<8>() {
+    return cpu_supports_avx2();
+}
+
+template <int N>
+int slab_test(bool simd, const wide_bvh_node<N>& node, const simd_ray& r, float tmin, float tmax, float* tnear_out) {
+#if defined(RT_X86)
+    if constexpr (N == 4) {
+        if (simd) return slab_test_sse(node, r, tmin, tmax, tnear_out);
+    }
+#endif
+#if defined(RT_HAVE_AVX2_KERNELS)
+    if constexpr (N == 8) {
+        if (simd) return slab_test_avx2(node, r, tmin, tmax, tnear_out);
+    }
+#endif
+    return slab_test_scalar(node, r, tmin, tmax, tnear_out);
+}
+
+double binary_area(const bvh_node& node) {
+    return node.bounds().surface_area();
+}
+
+}
+
+template <int N>
+wide_bvh<N>::wide_bvh(const bvh& binary)
+    : _store(binary.store()), _bbox(binary.bounding_box()), _simd(simd_supported<N>()) {
+    if (binary.nodes().empty()) {
+        return;
+    }
+    // every wide node absorbs at least one binary interior node
+    _nodes.reserve(binary.nodes().size() / 2 + 1);
+    collapse(binary, 0);
+}
+
+// Emits the wide node replacing binary node `binary_index` and returns its index. Its children
+// are found by repeatedly opening the interior candidate with the largest surface area,
+// which is the one most likely to be entered, until N slots are filled or only leaves remain.
+template <int N>
+uint32_t wide_bvh<N>::collapse(const bvh& binary, uint32_t binary_index) {
+    const auto& bnodes = binary.nodes();
+
+    uint32_t candidates[N];
+    int count = 0;
+    const bvh_node& root = bnodes[binary_index];
+    if (root.is_leaf()) {
+        candidates[count++] = binary_index;
+    } else {
+        candidates[count++] = binary_index + 1;
+        candidates[count++] = root.offset;
+    }
+
+    while (count < N) {
+        int best = -1;
+        double best_area = -1.0;
+        for (int i = 0; i < count; ++i) {
+            const bvh_node& c = bnodes[candidates[i]];
+            if (!c.is_leaf() && binary_area(c) > best_area) {
+                best = i;
+                best_area = binary_area(c);
+            }
+        }
+        if (best < 0) break;
+
+        const uint32_t opened = candidates[best];
+        candidates[best] = opened + 1;
+        candidates[count++] = bnodes[opened].offset;
+    }
+
+    const uint32_t index = static_cast<uint32_t>(_nodes.size());
+    _nodes.emplace_back();
+    for (int i = 0; i < N; ++i) {
+        for (int a = 0; a < 3; ++a) {
+            _nodes[index].bounds_min[a][i] = std::numeric_limits<float>::infinity();
+            _nodes[index].bounds_max[a][i] = -std::numeric_limits<float>::infinity();
+        }
+        _nodes[index].child[i] = 0;
+        _nodes[index].primitive_count[i] = 0;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const bvh_node& c = bnodes[candidates[i]];
+        // _nodes may be reallocated by the recursive call, so index again afterwards
+        const uint32_t child = c.is_leaf() ? c.offset : collapse(binary, candidates[i]);
+        auto& node = _nodes[index];
+        for (int a = 0; a < 3; ++a) {
+            node.bounds_min[a][i] = c.bounds_min[a];
+            node.bounds_max[a][i] = c.bounds_max[a];
+        }
+        node.child[i] = child;
+        node.primitive_count[i] = c.is_leaf() ? c.primitive_count : 0;
+    }
+
+    return index;
+}
+
+template <int N>
+bool wide_bvh<N>::hit(const ray& r, real ray_tmin, real ray_tmax, hit_record& rec) const {
+    if (_nodes.empty()) {
+        return false;
+    }
+
+    const traversal_ray tr(r);
+    simd_ray sr;
+    for (int a = 0; a < 3; ++a) {
+        sr.origin[a] = static_cast<float>(tr.origin()[a]);
+        sr.inv_dir[a] = static_cast<float>(tr.inv_direction()[a]);
+        sr.neg[a] = tr.dir_is_neg(a);
+    }
+
+    struct stack_entry {
+        uint32_t ref;
+        uint32_t primitive_count; // nonzero for a leaf
+        float tnear;
+    };
+    // each level can leave at most N - 1 siblings behind
+    stack_entry stack[bvh::max_depth * (N - 1) + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, -std::numeric_limits<float>::infinity()};
+
+    bool hit_anything = false;
+    real closest_so_far = ray_tmax;
+    const float tmin = static_cast<float>(ray_tmin);
+
+    while (stack_size > 0) {
+        const stack_entry entry = stack[--stack_size];
+        if (entry.tnear > closest_so_far) continue;
+
+        if (entry.primitive_count > 0) {
+            if (_store->hit(entry.ref, entry.primitive_count, r, ray_tmin, closest_so_far, rec)) {
+                hit_anything = true;
+            }
+            continue;
+        }
+
+        const wide_bvh_node<N>& node = _nodes[entry.ref];
+        float tnear[N];
+        int mask = slab_test(_simd, node, sr, tmin, static_cast<float>(closest_so_far), tnear);
+
+        // order the hit children near to far, then push them far first so the nearest pops next
+        stack_entry hits[N];
+        int hit_count = 0;
+        while (mask) {
+            const int i = std::countr_zero(static_cast<unsigned>(mask));
+            mask &= mask - 1;
+            stack_entry e{node.child[i], node.primitive_count[i], tnear[i]};
+            int j = hit_count++;
+            while (j > 0 && hits[j - 1].tnear > e.tnear) {
+                hits[j] = hits[j - 1];
+                --j;
+            }
+            hits[j] = e;
+        }
+        for (int i = hit_count - 1; i >= 0; --i) {
+            stack[stack_size++] = hits[i];
+        }
+    }
+
+    return hit_anything;
+}
+
+template <int N>
+aabb wide_bvh<N>::bounding_box() const {
+    return _bbox;
+}
+
+template <int N>
+const char* wide_bvh<N>::kernel_name() const {
+    if (!_simd) return "scalar";
+    return N == 4 ? "sse" : "avx2";
+}
+
+template class wide_bvh<4>;
+template class wide_bvh<8>;
+
+std::shared_ptr<hittable> make_wide_bvh(const std::shared_ptr<bvh>& binary, int width) {
+    switch (width) {
+        case 2: return binary;
+        case 4: return std::make_shared<bvh4>(*binary);
+        case 8: return std::make_shared<bvh8>(*binary);
+        default: return nullptr;
+    }
+}
@@ -1,25 +1,77 @@
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 
 #include <grpcpp/grpcpp.h>
 #include "cxxopts.hpp"
 #include "worker.hpp"
+#include "bvh.hpp"
+#include "renderer.hpp"
 
 int main(int argc, char** argv) {
     cxxopts::Options options("Raytracer Worker", "A worker node for the distributed raytracer.");
     options.add_options()
         ("a,address", "Master address", cxxopts::value<std::string>()->default_value("localhost:50051"))
-        ("n,name", "Worker name/hostname", cxxopts::value<std::string>()->default_value("local-worker"));
+        ("n,name", "Worker name/hostname", cxxopts::value<std::string>()->default_value("local-worker"))
+        ("bvh", "BVH to render with: master (as shipped), sah or median (rebuilt locally)", cxxopts::value<std::string>()->default_value("master"))
+        ("bvh-leaf-size", "Max primitives per BVH leaf when rebuilding", cxxopts::value<int>()->default_value("4"))
+        ("bvh-width", "BVH branching factor used for traversal (2, 4 or 8)", cxxopts::value<int>()->default_value("2"))
+        ("trace", "Ray tracing mode: single, packet or stream", cxxopts::value<std::string>()->default_value("single"))
+        ("packet-size", "Rays per packet / batch in packet and stream mode (4, 8 or 16)", cxxopts::value<int>()->default_value("8"))
+        ("task-window", "Tasks held at once over a task stream (0 uses one RequestTask / SubmitResult round trip per tile)", cxxopts::value<int>()->default_value("3"));
     
     auto result = options.parse(argc, argv);
     auto master_address = result["address"].as<std::string>();
     auto worker_name = result["name"].as<std::string>();
+
+    std::optional<bvh_build_options> bvh_rebuild;
+    const auto bvh_choice = result["bvh"].as<std::string>();
+    if (bvh_choice != "master") {
+        bvh_build_options bvh_options;
+        if (!parse_bvh_build_method(bvh_choice, bvh_options.method)) {
+            std::cerr << "Unknown BVH builder '" << bvh_choice << "' (expected master, sah or median)." << std::endl;
+            return 1;
+        }
+        bvh_options.max_leaf_size = result["bvh-leaf-size"].as<int>();
+        if (bvh_options.max_leaf_size <= 0) {
+            std::cerr << "BVH leaf size must be positive." << std::endl;
+            return 1;
+        }
+        bvh_rebuild = bvh_options;
+    }
+
+    const int bvh_width = result["bvh-width"].as<int>();
+    if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8) {
+        std::cerr << "BVH width must be 2, 4 or 8." << std::endl;
+        return 1;
+    }
     
+    render_options render_opts;
+    if (!parse_trace_mode(result["trace"].as<std::string>(), render_opts.mode)) {
+        std::cerr << "Unknown trace mode '" << result["trace"].as<std::string>() << "' (expected single, packet or stream)." << std::endl;
+        return 1;
+    }
+    render_opts.packet_size = result["packet-size"].as<int>();
+    if (render_opts.packet_size != 4 && render_opts.packet_size != 8 && render_opts.packet_size != 16) {
+        std::cerr << "Packet size must be 4, 8 or 16." << std::endl;
+        return 1;
+    }
+
+    const int task_window = result["task-window"].as<int>();
+    if (task_window < 0) {
+        std::cerr << "Task window must not be negative." << std::endl;
+        return 1;
+    }
+
     try {
         RaytracerWorker worker(
             grpc::CreateChannel(master_address, grpc::InsecureChannelCredentials()),
-            worker_name
+            worker_name,
+            bvh_rebuild,
+            bvh_width,
+            render_opts,
+            task_window
         );
         std::cout << "Worker attempting to connect to master at " << master_address << std::endl;
         worker.run();
@@ -3,19 +3,33 @@
 #include <grpcpp/grpcpp.h>
 
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include <vector>
 
 #include "renderer.hpp"
 #include "hittable.hpp"
 #include "serialization.hpp"
+#include "wide_bvh.hpp"
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 using grpc::ClientContext;
 using grpc::Status;
 
-RaytracerWorker::RaytracerWorker(std::shared_ptr<grpc::Channel> channel, std::string hostname)
+RaytracerWorker::RaytracerWorker(std::shared_ptr<grpc::Channel> channel, std::string hostname,
+                                 std::optional<bvh_build_options> bvh_rebuild, int bvh_width,
+                                 render_options render_opts, int task_window)
     : hostname_(std::move(hostname)),
+      bvh_rebuild_(std::move(bvh_rebuild)),
+      bvh_width_(bvh_width),
+      render_options_(render_opts),
+      task_window_(task_window),
       stub_(RaytracerService::NewStub(std::move(channel))) {}
 
 void RaytracerWorker::run() {
@@ -27,44 +41,175 @@ void RaytracerWorker::run() {
         return;
     }
 
+    if (task_window_ > 0) {
+        StreamResult result = run_stream();
+        while (result == StreamResult::Reregistered) {
+            result = run_stream();
+        }
+        if (result == StreamResult::Failed) {
+            return;
+        }
+    } else {
+        run_unary();
+    }
+
+    std::cout << worker_id_ << " finished - no more work." << std::endl;
+}
+
+void RaytracerWorker::run_unary() {
     while (true) {
-        RenderTask task;
-        TaskFetchResult result = request_task(task);
-        if (result == TaskFetchResult::NoMoreTasks) {
+        TaskAssignment assignment;
+        TaskFetchResult fetched = request_tasks(assignment);
+        if (fetched == TaskFetchResult::NoMoreTasks) {
             break;
         }
-        if (result == TaskFetchResult::Retry) {
+        if (fetched == TaskFetchResult::Retry) {
             continue;
         }
 
-        const auto& tile = task.tile();
-        std::cout << worker_id_ << " rendering tile (" << tile.x0() << ", " << tile.y0() << ")" << std::endl;
-
-        uint64_t seed = static_cast<uint64_t>(tile.task_id()) * 7919ULL + 17ULL;
-
-        renderer rend(*camera_, *world_);
-        std::vector<color> pixels = rend.render_tile(
-            tile.x0(),
-            tile.y0(),
-            tile.width(),
-            tile.height(),
-            task.samples_per_pixel(),
-            task.max_depth(),
-            seed
-        );
-        
-        if (!submit_result(tile, pixels)) {
+        // the master sizes batches so one takes about as long as its batch target
+        SubmitResultRequest request;
+        request.set_worker_id(worker_id_);
+        for (const auto& task : assignment.tasks()) {
+            render_task(task, *request.add_results());
+        }
+        if (!submit_results(request)) {
             break;
         }
     }
+}
 
-    std::cout << worker_id_ << " finished - no more work." << std::endl;
+// Renders the tasks of one task stream. A reader thread takes tasks off the stream and a
+// writer thread sends results back, so this thread keeps rendering while the next task is on
+// its way in and the last result on its way out.
+RaytracerWorker::StreamResult RaytracerWorker::run_stream() {
+    ClientContext context;
+    auto stream = stub_->StreamTasks(&context);
+
+    TaskStreamRequest open;
+    open.mutable_open()->set_worker_id(worker_id_);
+    open.mutable_open()->set_window(task_window_);
+    stream->Write(open);
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<RenderTask> tasks;
+    std::deque<TaskStreamRequest> results;
+    bool tasks_closed = false;   // the master ended the stream
+    bool results_closed = false; // no more results will be queued
+
+    std::thread reader([&] {
+        RenderTask task;
+        while (stream->Read(&task)) {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(std::move(task));
+            cv.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        tasks_closed = true;
+        cv.notify_all();
+    });
+
+    std::thread writer([&] {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [&] { return !results.empty() || results_closed; });
+            if (results.empty()) break;
+            TaskStreamRequest request = std::move(results.front());
+            results.pop_front();
+            lock.unlock();
+            const bool written = stream->Write(request);
+            lock.lock();
+            if (!written) break; // the reader sees the stream end too
+        }
+        lock.unlock();
+        stream->WritesDone();
+    });
+
+    while (true) {
+        RenderTask task;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&] { return !tasks.empty() || tasks_closed; });
+            if (tasks.empty()) break;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        TaskStreamRequest request;
+        render_task(task, *request.mutable_result());
+        std::lock_guard<std::mutex> lock(mtx);
+        results.push_back(std::move(request));
+        cv.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        results_closed = true;
+        cv.notify_all();
+    }
+    writer.join();
+    reader.join();
+
+    Status status = stream->Finish();
+    if (status.ok()) {
+        return StreamResult::Finished;
+    }
+    if (status.error_code() == grpc::StatusCode::UNAUTHENTICATED) {
+        std::cerr << "Master no longer recognizes " << worker_id_ << ". Attempting to re-register..." << std::endl;
+        return register_with_master() ? StreamResult::Reregistered : StreamResult::Failed;
+    }
+    std::cerr << "Task stream failed: " << status.error_message() << std::endl;
+    return StreamResult::Failed;
+}
+
+void RaytracerWorker::render_task(const RenderTask& task, TileResult& result) const {
+    const auto& tile = task.tile();
+    std::cout << worker_id_ << " rendering tile (" << tile.x0() << ", " << tile.y0() << ")" << std::endl;
+
+    // samples are keyed by pixel and sample index, so every tile uses the standalone
+    // renderer's seed and renders exactly what `render` would for those pixels
+    const uint64_t seed = 0;
+
+    render_options task_options = render_options_;
+    task_options.roulette_depth = task.roulette_depth();
+    task_options.noise_threshold = task.noise_threshold();
+    task_options.sampler = static_cast<sampler_kind>(task.sampler());
+    renderer rend(*camera_, *world_, task_options);
+    render_stats stats;
+    std::vector<color> pixels = rend.render_tile(
+        tile.x0(),
+        tile.y0(),
+        tile.width(),
+        tile.height(),
+        task.samples_per_pixel(),
+        task.max_depth(),
+        seed,
+        &stats,
+        task.first_sample()
+    );
+    std::cout << worker_id_ << " traced " << stats << std::endl;
+
+    result.mutable_tile()->CopyFrom(tile);
+    auto* radiance = result.mutable_radiance();
+    radiance->Reserve(static_cast<int>(pixels.size() * 3));
+    for (const auto& p : pixels) {
+        radiance->Add(static_cast<float>(p.x()));
+        radiance->Add(static_cast<float>(p.y()));
+        radiance->Add(static_cast<float>(p.z()));
+    }
+    result.set_samples_used(stats.samples);
 }
 
 bool RaytracerWorker::register_with_master() {
     ClientContext context;
     WorkerRegistrationRequest request;
     request.set_hostname(hostname_);
+#if defined(_OPENMP)
+    request.set_cores(omp_get_max_threads());
+#else
+    request.set_cores(static_cast<int>(std::thread::hardware_concurrency()));
+#endif
     WorkerRegistrationResponse response;
 
     Status status = stub_->RegisterWorker(&context, request, &response);
@@ -75,15 +220,30 @@ bool RaytracerWorker::register_with_master() {
 
     worker_id_ = response.worker_id();
     config_ = response.config();
-    scene_cache_ = response.scene();
 
-    world_ = deserialize_scene(scene_cache_);
-    if (!world_) {
+    // the scene is kept only as built: response, with its copy of every mesh buffer, goes
+    // when registration returns
+    auto shipped = deserialize_scene(response.scene(), bvh_rebuild_);
+    if (!shipped) {
         std::cerr << "Failed to build scene from master response." << std::endl;
         return false;
     }
 
-    camera_ = build_camera_from_proto(scene_cache_.camera());
+    if (bvh_rebuild_) {
+        hittable_list primitives;
+        primitives.objects = shipped->primitives();
+        shipped = std::make_shared<bvh>(primitives, *bvh_rebuild_);
+        std::cout << "Rebuilt BVH: " << shipped->stats() << std::endl;
+    } else {
+        std::cout << "Using master BVH: " << shipped->stats() << std::endl;
+    }
+    world_ = make_wide_bvh(shipped, bvh_width_);
+    if (!world_) {
+        std::cerr << "Unsupported BVH width " << bvh_width_ << "." << std::endl;
+        return false;
+    }
+
+    camera_ = build_camera_from_proto(response.scene().camera());
     if (!camera_) {
         std::cerr << "Failed to construct camera from master response." << std::endl;
         return false;
@@ -113,13 +273,12 @@ bool RaytracerWorker::health_check() {
     return true;
 }
 
-RaytracerWorker::TaskFetchResult RaytracerWorker::request_task(RenderTask& task) {
+RaytracerWorker::TaskFetchResult RaytracerWorker::request_tasks(TaskAssignment& assignment) {
     ClientContext context;
     WorkRequest request;
     request.set_worker_id(worker_id_);
 
-    TaskAssignment response;
-    Status status = stub_->RequestTask(&context, request, &response);
+    Status status = stub_->RequestTask(&context, request, &assignment);
 
     if (!status.ok()) {
         if (status.error_code() == grpc::StatusCode::UNAUTHENTICATED) {
@@ -135,31 +294,19 @@ RaytracerWorker::TaskFetchResult RaytracerWorker::request_task(RenderTask& task)
         return TaskFetchResult::Retry;
     }
 
-    if (!response.has_assignment()) {
+    if (!assignment.has_assignment() || assignment.tasks().empty()) {
+        if (assignment.retry_after_ms() > 0) {
+            // the frame is not finished yet, and a late tile may still need a copy
+            std::this_thread::sleep_for(std::chrono::milliseconds(assignment.retry_after_ms()));
+            return TaskFetchResult::Retry;
+        }
         return TaskFetchResult::NoMoreTasks;
     }
-
-    task = response.task();
     return TaskFetchResult::TaskReceived;
 }
 
-bool RaytracerWorker::submit_result(const Tile& tile, const std::vector<color>& pixels) {
+bool RaytracerWorker::submit_results(const SubmitResultRequest& request) {
     ClientContext context;
-    SubmitResultRequest request;
-    request.set_worker_id(worker_id_);
-
-    auto* result = request.mutable_result();
-    result->mutable_tile()->CopyFrom(tile);
-    
-    std::string buffer;
-    buffer.reserve(pixels.size() * 3);
-    for (const auto& p : pixels) {
-        buffer.push_back(static_cast<char>(static_cast<uint8_t>(255.999 * p.x())));
-        buffer.push_back(static_cast<char>(static_cast<uint8_t>(255.999 * p.y())));
-        buffer.push_back(static_cast<char>(static_cast<uint8_t>(255.999 * p.z())));
-    }
-    result->set_pixel_data(std::move(buffer));
-
     google::protobuf::Empty response;
     Status status = stub_->SubmitResult(&context, request, &response);
     if (!status.ok()) {
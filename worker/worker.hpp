@@ -4,17 +4,26 @@
 #include <grpcpp/grpcpp.h>
 #include "raytracer.grpc.pb.h"
 #include <memory>
+#include <optional>
 #include <vector>
 #include <string>
 #include "color.hpp"
 #include "hittable.hpp"
 #include "camera.hpp"
+#include "bvh.hpp"
+#include "renderer.hpp"
 
 using namespace raytracer;
 
 class RaytracerWorker {
 public:
-    RaytracerWorker(std::shared_ptr<grpc::Channel> channel, std::string hostname);
+    // bvh_rebuild replaces the BVH shipped by the master with one built locally,
+    // bvh_width collapses it to a BVH4 / BVH8 for traversal. With a task_window the worker
+    // takes its tasks over a task stream holding that many at once, otherwise one
+    // RequestTask / SubmitResult round trip per tile.
+    RaytracerWorker(std::shared_ptr<grpc::Channel> channel, std::string hostname,
+                    std::optional<bvh_build_options> bvh_rebuild = std::nullopt, int bvh_width = 2,
+                    render_options render_opts = {}, int task_window = 0);
     void run();
 
 private:
@@ -24,17 +33,29 @@ private:
         Retry
     };
 
+    enum class StreamResult {
+        Finished,
+        Reregistered,
+        Failed
+    };
+
     bool health_check();
     bool register_with_master();
-    TaskFetchResult request_task(RenderTask& task);
-    bool submit_result(const Tile& tile, const std::vector<color>& pixels);
+    void run_unary();
+    StreamResult run_stream();
+    void render_task(const RenderTask& task, TileResult& result) const;
+    TaskFetchResult request_tasks(TaskAssignment& assignment);
+    bool submit_results(const SubmitResultRequest& request);
     std::unique_ptr<camera> build_camera_from_proto(const raytracer::Camera& proto_cam) const;
 
     std::string hostname_;
+    std::optional<bvh_build_options> bvh_rebuild_;
+    int bvh_width_;
+    render_options render_options_;
+    int task_window_;
     std::unique_ptr<RaytracerService::Stub> stub_;
     std::string worker_id_;
     RenderConfig config_;
-    SceneData scene_cache_;
     std::shared_ptr<hittable> world_;
     std::unique_ptr<camera> camera_;
 };